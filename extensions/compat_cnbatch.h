@@ -0,0 +1,169 @@
+#pragma once
+/*
+ *	Connector messages batched per CPU, for the modules that report
+ *	events to a netlink group (xt_pknock, xt_DNETMAP).
+ *
+ *	Events gather in a message of the CPU they happen on, which goes out
+ *	once it is full or the flush interval has passed. cn_msg.ack carries
+ *	the number of events lost before that message.
+ */
+#include <linux/connector.h>
+#include <linux/jiffies.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timer.h>
+
+struct compat_cnbatch;
+
+/*
+ * Events of one CPU, waiting to go out in one connector message.
+ *
+ * @lock:	the packet path and the timer need not run on the same CPU
+ * @timer:	sends a batch that does not fill up in time
+ * @owner:	for the timer
+ * @m:		message with room for owner->max events
+ * @count:	events in @m
+ * @lost:	events that could not be sent since the last message
+ */
+struct compat_cnbatch_cpu {
+	spinlock_t lock;
+	struct timer_list timer;
+	const struct compat_cnbatch *owner;
+	struct cn_msg *m;
+	unsigned int count, lost;
+};
+
+/*
+ * @cpu:	per-CPU batches, NULL when not set up
+ * @group:	netlink multicast group
+ * @max:	events per message
+ * @size:	bytes per event
+ * @delay:	jiffies an event may wait, 0 to send each at once
+ */
+struct compat_cnbatch {
+	struct compat_cnbatch_cpu __percpu *cpu;
+	int group;
+	unsigned int max, size;
+	unsigned long delay;
+};
+
+/* Sends the batched events, if any; needs the batch's lock. */
+static void compat_cnbatch_send(struct compat_cnbatch_cpu *b)
+{
+	int ret;
+
+	if (b->count == 0)
+		return;
+	b->m->len = b->count * b->owner->size;
+	b->m->ack = b->lost;
+	ret = cn_netlink_send(b->m, 0, b->owner->group, GFP_ATOMIC);
+	/*
+	 * -ESRCH means nobody listens, and a listener that overran gets
+	 * -ENOBUFS from its socket; only a failed allocation loses events
+	 * that nobody learns about.
+	 */
+	if (ret == -ENOMEM)
+		b->lost += b->count;
+	else
+		b->lost = 0;
+	b->count = 0;
+}
+
+static void compat_cnbatch_timer(struct timer_list *t)
+{
+	struct compat_cnbatch_cpu *b = from_timer(b, t, timer);
+
+	spin_lock(&b->lock);
+	compat_cnbatch_send(b);
+	spin_unlock(&b->lock);
+}
+
+/* Sends what is left and frees the batches. */
+static void compat_cnbatch_free(struct compat_cnbatch *c)
+{
+	struct compat_cnbatch_cpu *b;
+	unsigned int cpu;
+
+	if (c->cpu == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(c->cpu, cpu);
+		del_timer_sync(&b->timer);
+		if (b->m == NULL)
+			continue;
+		spin_lock_bh(&b->lock);
+		compat_cnbatch_send(b);
+		spin_unlock_bh(&b->lock);
+		kfree(b->m);
+	}
+	free_percpu(c->cpu);
+	c->cpu = NULL;
+}
+
+/*
+ * @id:		connector id of every message, for listeners to tell them apart
+ * @group:	netlink multicast group
+ * @max:	events per message
+ * @size:	bytes per event
+ * @interval:	milliseconds an event may wait, 0 to send each at once
+ */
+static int compat_cnbatch_alloc(struct compat_cnbatch *c,
+    const struct cb_id *id, int group, unsigned int max, unsigned int size,
+    unsigned int interval)
+{
+	struct compat_cnbatch_cpu *b;
+	unsigned int cpu;
+
+	c->group = group;
+	c->max   = max;
+	c->size  = size;
+	c->delay = msecs_to_jiffies(interval);
+	c->cpu   = alloc_percpu(struct compat_cnbatch_cpu);
+	if (c->cpu == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(c->cpu, cpu);
+		spin_lock_init(&b->lock);
+		timer_setup(&b->timer, compat_cnbatch_timer, 0);
+		b->owner = c;
+	}
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(c->cpu, cpu);
+		b->m = kzalloc(sizeof(*b->m) + max * size, GFP_KERNEL);
+		if (b->m == NULL) {
+			compat_cnbatch_free(c);
+			return -ENOMEM;
+		}
+		b->m->id = *id;
+	}
+	return 0;
+}
+
+/*
+ * Returns zeroed room for one event in this CPU's message, which stays
+ * locked until compat_cnbatch_commit(). Must be called with BH disabled.
+ */
+static void *compat_cnbatch_reserve(struct compat_cnbatch *c)
+{
+	struct compat_cnbatch_cpu *b = this_cpu_ptr(c->cpu);
+	void *ev;
+
+	spin_lock(&b->lock);
+	ev = b->m->data + b->count++ * c->size;
+	memset(ev, 0, c->size);
+	return ev;
+}
+
+/* Queues the event filled in since compat_cnbatch_reserve(). */
+static void compat_cnbatch_commit(struct compat_cnbatch *c)
+{
+	struct compat_cnbatch_cpu *b = this_cpu_ptr(c->cpu);
+
+	if (b->count == c->max || c->delay == 0)
+		compat_cnbatch_send(b);
+	else if (b->count == 1)
+		mod_timer(&b->timer, jiffies + c->delay);
+	spin_unlock(&b->lock);
+}
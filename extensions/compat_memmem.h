@@ -0,0 +1,58 @@
+#pragma once
+/*
+ *	Substring search behind HX_memmem, kept in a header so that the
+ *	userspace tools can run (and time) the very same code.
+ *
+ *	Boyer-Moore-Horspool: the last byte of the window decides how far to
+ *	slide. For haystacks too short to amortize the 256-byte shift table,
+ *	a plain scan keyed on the first needle byte is used instead.
+ */
+#ifdef __KERNEL__
+#	include <linux/string.h>
+#	include <linux/types.h>
+#else
+#	include <stddef.h>
+#	include <string.h>
+#endif
+
+enum {
+	HX_MEMMEM_SHORT = 64,
+};
+
+/* Not inline: gcc will not inline a frame with a 256-byte table (-Winline). */
+static void *
+compat_memmem(const void *space, size_t spacesize,
+    const void *point, size_t pointsize)
+{
+	const unsigned char *s = space, *p = point;
+	unsigned char skip[256], last;
+	size_t i, end;
+
+	if (pointsize == 0)
+		return (void *)space;
+	if (pointsize > spacesize)
+		return NULL;
+	if (pointsize == 1)
+		return memchr(space, p[0], spacesize);
+
+	end = spacesize - pointsize;
+	if (spacesize < HX_MEMMEM_SHORT) {
+		for (i = 0; i <= end; ++i)
+			if (s[i] == p[0] &&
+			    memcmp(s + i + 1, p + 1, pointsize - 1) == 0)
+				return (void *)(s + i);
+		return NULL;
+	}
+
+	/* Shifts are capped at 255, which only makes them more cautious. */
+	memset(skip, pointsize < 255 ? pointsize : 255, sizeof(skip));
+	for (i = 0; i < pointsize - 1; ++i)
+		skip[p[i]] = pointsize - 1 - i < 255 ? pointsize - 1 - i : 255;
+	last = p[pointsize - 1];
+
+	for (i = 0; i <= end; i += skip[s[i + pointsize - 1]])
+		if (s[i + pointsize - 1] == last &&
+		    memcmp(s + i, p, pointsize - 1) == 0)
+			return (void *)(s + i);
+	return NULL;
+}
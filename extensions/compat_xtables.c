@@ -22,6 +22,7 @@
 #include <net/ipv6.h>
 #include <net/route.h>
 #include <linux/export.h>
+#include "compat_memmem.h"
 #include "compat_skbuff.h"
 #if defined(CONFIG_IP6_NF_IPTABLES) || defined(CONFIG_IP6_NF_IPTABLES_MODULE)
 #	define WITH_IPV6 1
@@ -30,14 +31,7 @@
 void *HX_memmem(const void *space, size_t spacesize,
     const void *point, size_t pointsize)
 {
-	size_t i;
-
-	if (pointsize > spacesize)
-		return NULL;
-	for (i = 0; i <= spacesize - pointsize; ++i)
-		if (memcmp(space + i, point, pointsize) == 0)
-			return (void *)space + i;
-	return NULL;
+	return compat_memmem(space, spacesize, point, pointsize);
 }
 EXPORT_SYMBOL_GPL(HX_memmem);
 
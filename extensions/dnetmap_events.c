@@ -0,0 +1,169 @@
+/*
+ *	dnetmap_events - collector for the binding events of xt_DNETMAP
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License, either
+ *	version 2 of the License, or any later version.
+ *
+ *	Reads the batched binding events that xt_DNETMAP sends to a netlink
+ *	connector group and prints one tab-separated line per event.
+ */
+#define _GNU_SOURCE 1
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nf_nat.h>
+#include "xt_DNETMAP.h"
+
+#define DEFAULT_GROUP_ID 1
+#define MAX_GROUP_ID \
+	(sizeof((struct sockaddr_nl){0}.nl_groups) * CHAR_BIT)
+
+enum {
+	/* messages per recvmmsg() */
+	RECV_BATCH = 16,
+	RECV_BUF_SIZE = NLMSG_SPACE(sizeof(struct cn_msg) +
+	                XT_DNETMAP_NL_BATCH * sizeof(struct xt_DNETMAP_event)),
+	/* asked for, the kernel caps it at net.core.rmem_max */
+	RCVBUF_SIZE = 4 << 20,
+};
+
+static const char *const event_names[] = {
+	[XT_DNETMAP_EV_BIND]    = "bind",
+	[XT_DNETMAP_EV_TIMEOUT] = "timeout",
+	[XT_DNETMAP_EV_REMOVE]  = "remove",
+	[XT_DNETMAP_EV_STATIC]  = "static",
+};
+
+/* IPv6 bindings are between /64 networks */
+static void format_addr(char *buf, uint8_t family, const union nf_inet_addr *a)
+{
+	if (family == NFPROTO_IPV6) {
+		inet_ntop(AF_INET6, &a->in6, buf, INET6_ADDRSTRLEN);
+		strcat(buf, "/64");
+	} else {
+		inet_ntop(AF_INET, &a->in, buf, INET6_ADDRSTRLEN);
+	}
+}
+
+static void print_event(const struct xt_DNETMAP_event *ev)
+{
+	char prenat[INET6_ADDRSTRLEN + 3], postnat[INET6_ADDRSTRLEN + 3];
+	const char *name = "unknown";
+
+	if (ev->type < sizeof(event_names) / sizeof(*event_names) &&
+	    event_names[ev->type] != NULL)
+		name = event_names[ev->type];
+	format_addr(prenat, ev->family, &ev->prenat_addr);
+	format_addr(postnat, ev->family, &ev->postnat_addr);
+	printf("%llu.%09llu\t%s\t%s\t%s\n",
+	       (unsigned long long)ev->time / 1000000000,
+	       (unsigned long long)ev->time % 1000000000,
+	       name, prenat, postnat);
+}
+
+/* One datagram: netlink messages of a cn_msg with a batch of events each */
+static void handle_datagram(const void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh;
+	const struct cn_msg *cn_msg;
+	const struct xt_DNETMAP_event *ev;
+	unsigned int i;
+
+	for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn_msg)))
+			continue;
+		cn_msg = NLMSG_DATA(nlh);
+		if (cn_msg->len > nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*cn_msg)))
+			continue;
+		if (cn_msg->id.idx != XT_DNETMAP_CN_IDX ||
+		    cn_msg->id.val != XT_DNETMAP_CN_VAL)
+			continue;
+		if (cn_msg->ack != 0)
+			printf("lost\t%u\n", cn_msg->ack);
+		ev = (const void *)cn_msg->data;
+		for (i = 0; i < cn_msg->len / sizeof(*ev); ++i)
+			print_event(&ev[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static char bufs[RECV_BATCH][RECV_BUF_SIZE];
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	struct sockaddr_nl local_addr = {.nl_family = AF_NETLINK};
+	unsigned int group_id = DEFAULT_GROUP_ID;
+	int sock_fd, status, i, rcvbuf = RCVBUF_SIZE;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [group-id]\n", *argv);
+		return EXIT_FAILURE;
+	}
+	if (argc == 2) {
+		char *end;
+		unsigned long n = strtoul(argv[1], &end, 10);
+
+		if (*end != '\0' || n < 1 || n > MAX_GROUP_ID) {
+			fputs("Group ID invalid.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		group_id = n;
+	}
+
+	sock_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+	if (sock_fd == -1) {
+		perror("socket()");
+		return EXIT_FAILURE;
+	}
+	/* Best effort; bursts beyond it show up as overruns. */
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	local_addr.nl_groups = 1U << (group_id - 1);
+	if (bind(sock_fd, (struct sockaddr *)&local_addr,
+	    sizeof(local_addr)) == -1) {
+		perror("bind()");
+		close(sock_fd);
+		return EXIT_FAILURE;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RECV_BATCH; ++i) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len  = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (1) {
+		/* Waits for one message, then takes what else is queued. */
+		status = recvmmsg(sock_fd, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				printf("overrun\n");
+				fflush(stdout);
+				continue;
+			}
+			perror("recvmmsg()");
+			break;
+		}
+		for (i = 0; i < status; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				fputs("truncated message\n", stderr);
+			handle_datagram(bufs[i], msgs[i].msg_len);
+		}
+		fflush(stdout);
+	}
+	close(sock_fd);
+	return EXIT_FAILURE;
+}
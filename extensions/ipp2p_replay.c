@@ -0,0 +1,532 @@
+/*
+ *	ipp2p_replay - run the xt_ipp2p detectors over pcap files
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License, either
+ *	version 2 of the License, or any later version.
+ *
+ *	Reads classic pcap files (Ethernet, Linux cooked, raw IP) and feeds
+ *	TCP/UDP payloads to the very same detection code as the kernel
+ *	module. Reports per-detector hits, false positives against a label
+ *	given per file, and the time spent per packet. With -v, every hit is
+ *	listed so that runs of two builds can be diffed.
+ */
+#define _GNU_SOURCE 1
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Kernel facilities used by ipp2p_search.h */
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+#define GFP_KERNEL 0
+#define KERN_DEBUG
+#define KERN_INFO
+#define __constant_htonl(x) htonl(x)
+#define __constant_htons(x) htons(x)
+#define __ffs(x) __builtin_ctz(x)
+#define get_unaligned(p) ({ \
+	__typeof__(*(p)) __v; \
+	memcpy((void *)&__v, (p), sizeof(__v)); \
+	__v; \
+})
+#define kfree(p) free(p)
+#define kmalloc_array(n, size, flags) calloc((n), (size))
+#define kvfree(p) free(p)
+#define kvzalloc(size, flags) calloc(1, (size))
+#define printk printf
+struct u64_stats_sync {};
+#define u64_stats_update_begin(syncp) ((void)(syncp))
+#define u64_stats_update_end(syncp) ((void)(syncp))
+
+#define HX_memmem compat_memmem
+
+#include "compat_memmem.h"
+#include "ipp2p_search.h"
+
+enum {
+	LINKTYPE_NULL      = 0,
+	LINKTYPE_ETHERNET  = 1,
+	LINKTYPE_RAW       = 101,
+	LINKTYPE_LINUX_SLL = 113,
+	LINKTYPE_IPV4      = 228,
+	LINKTYPE_IPV6      = 229,
+	LINKTYPE_LINUX_SLL2 = 276,
+};
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec, ts_frac, caplen, len;
+};
+
+/* One TCP/UDP payload extracted from a capture */
+struct sample {
+	const unsigned char *data;
+	unsigned int len;
+	bool udp;
+};
+
+struct stats {
+	unsigned long long packets, samples, hits, false_pos, truncated;
+	struct ipp2p_stats det;
+	unsigned long long tcp_fp[ARRAY_SIZE(matchlist)];
+	unsigned long long udp_fp[ARRAY_SIZE(udp_list)];
+	double ns;
+};
+
+static unsigned int rp_rounds = 1, rp_max_bytes;
+static bool rp_verbose;
+
+static const char *cmd_name(unsigned int command)
+{
+	return ipp2p_names[__ffs(command)];
+}
+
+/* Parse a comma-separated protocol list ("all" and "none" allowed). */
+static bool parse_protocols(const char *arg, unsigned int *cmd)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	unsigned int i;
+
+	*cmd = 0;
+	for (tok = strtok_r(copy, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, "all") == 0) {
+			*cmd |= (1U << (IPP2N_XDCC + 1)) - 1;
+			continue;
+		} else if (strcmp(tok, "none") == 0) {
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(ipp2p_names); ++i)
+			if (strcmp(tok, ipp2p_names[i]) == 0)
+				break;
+		if (i == ARRAY_SIZE(ipp2p_names)) {
+			fprintf(stderr, "Unknown protocol \"%s\"\n", tok);
+			free(copy);
+			return false;
+		}
+		*cmd |= 1U << i;
+	}
+	free(copy);
+	return true;
+}
+
+/* Same checks as ipp2p_mt() and ipp2p_mt_tcp()/ipp2p_mt_udp(). */
+static bool
+parse_transport(const unsigned char *p, unsigned int len, unsigned int proto,
+                struct sample *smp)
+{
+	if (proto == IPPROTO_TCP) {
+		unsigned int doff;
+
+		if (len < 20)
+			return false;
+		if (p[13] & 0x07) /* FIN, SYN, RST */
+			return false;
+		doff = (p[12] >> 4) * 4;
+		if (len <= doff)
+			return false;
+		smp->data = p + doff;
+		smp->len  = len - doff;
+		smp->udp  = false;
+		return true;
+	} else if (proto == IPPROTO_UDP || proto == IPPROTO_UDPLITE) {
+		if (len <= 8)
+			return false;
+		smp->data = p + 8;
+		smp->len  = len - 8;
+		smp->udp  = true;
+		return true;
+	}
+	return false;
+}
+
+static bool
+parse_ip(const unsigned char *p, unsigned int caplen, struct sample *smp,
+         struct stats *st)
+{
+	unsigned int hlen, len, proto;
+
+	if (caplen < 1)
+		return false;
+	if (p[0] >> 4 == 4) {
+		if (caplen < 20)
+			return false;
+		hlen = (p[0] & 0x0F) * 4;
+		len  = ntohs(get_u16(p, 2));
+		if (ntohs(get_u16(p, 6)) & 0x1FFF) /* not the first fragment */
+			return false;
+		proto = p[9];
+	} else if (p[0] >> 4 == 6) {
+		if (caplen < 40)
+			return false;
+		hlen  = 40;
+		len   = 40 + ntohs(get_u16(p, 4));
+		proto = p[6];
+		while (proto == 0 || proto == 43 || proto == 44 || proto == 60) {
+			unsigned int next;
+
+			if (caplen < hlen + 8)
+				return false;
+			if (proto == 44 && ntohs(get_u16(p, hlen + 2)) & 0xFFF8)
+				return false;
+			next  = p[hlen];
+			hlen += proto == 44 ? 8 : (p[hlen + 1] + 1) * 8;
+			proto = next;
+		}
+	} else {
+		return false;
+	}
+	if (len > caplen) {
+		++st->truncated;
+		len = caplen;
+	}
+	if (len < hlen)
+		return false;
+	return parse_transport(p + hlen, len - hlen, proto, smp);
+}
+
+static bool
+parse_frame(unsigned int linktype, const unsigned char *p,
+            unsigned int caplen, struct sample *smp, struct stats *st)
+{
+	unsigned int off, ethertype;
+
+	switch (linktype) {
+	case LINKTYPE_NULL:
+		off = 4;
+		break;
+	case LINKTYPE_ETHERNET:
+		if (caplen < 14)
+			return false;
+		off = 12;
+		ethertype = ntohs(get_u16(p, off));
+		while ((ethertype == 0x8100 || ethertype == 0x88A8) &&
+		    caplen >= off + 6) {
+			off += 4;
+			ethertype = ntohs(get_u16(p, off));
+		}
+		if (ethertype != 0x0800 && ethertype != 0x86DD)
+			return false;
+		off += 2;
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		off = 0;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		off = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		off = 20;
+		break;
+	default:
+		return false;
+	}
+	if (caplen < off)
+		return false;
+	return parse_ip(p + off, caplen - off, smp, st);
+}
+
+static inline uint32_t pcap_u32(uint32_t x, bool swap)
+{
+	return swap ? __builtin_bswap32(x) : x;
+}
+
+static unsigned char *slurp(const char *file, size_t *size)
+{
+	unsigned char *buf = NULL;
+	size_t alloc = 0, ret;
+	FILE *fp;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return NULL;
+	}
+	*size = 0;
+	do {
+		if (*size == alloc) {
+			void *nb;
+			alloc = alloc == 0 ? 1 << 20 : alloc * 2;
+			nb = realloc(buf, alloc);
+			if (nb == NULL) {
+				fprintf(stderr, "%s: out of memory\n", file);
+				free(buf);
+				fclose(fp);
+				return NULL;
+			}
+			buf = nb;
+		}
+		ret = fread(buf + *size, 1, alloc - *size, fp);
+		*size += ret;
+	} while (ret > 0);
+	fclose(fp);
+	return buf;
+}
+
+/* Collect all TCP/UDP payloads of a capture; they point into @buf. */
+static struct sample *
+parse_pcap(const char *file, const unsigned char *buf, size_t size,
+           size_t *nsamples, struct stats *st)
+{
+	struct pcap_file_header fh;
+	struct sample *smp = NULL;
+	size_t nalloc = 0, pos;
+	bool swap;
+
+	*nsamples = 0;
+	if (size < sizeof(fh)) {
+		fprintf(stderr, "%s: short file\n", file);
+		return NULL;
+	}
+	memcpy(&fh, buf, sizeof(fh));
+	if (fh.magic == 0xA1B2C3D4 || fh.magic == 0xA1B23C4D) {
+		swap = false;
+	} else if (fh.magic == 0xD4C3B2A1 || fh.magic == 0x4D3CB2A1) {
+		swap = true;
+	} else {
+		fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n",
+		        file);
+		return NULL;
+	}
+	fh.linktype = pcap_u32(fh.linktype, swap) & 0xFFFF;
+
+	for (pos = sizeof(fh); pos + sizeof(struct pcap_record_header) <= size; ) {
+		struct pcap_record_header rec;
+		unsigned int caplen;
+		struct sample s;
+
+		memcpy(&rec, buf + pos, sizeof(rec));
+		pos   += sizeof(rec);
+		caplen = pcap_u32(rec.caplen, swap);
+		if (caplen > size - pos) {
+			fprintf(stderr, "%s: truncated record\n", file);
+			break;
+		}
+		++st->packets;
+		if (parse_frame(fh.linktype, buf + pos, caplen, &s, st)) {
+			if (*nsamples == nalloc) {
+				void *ns;
+				nalloc = nalloc == 0 ? 1024 : nalloc * 2;
+				ns = realloc(smp, nalloc * sizeof(*smp));
+				if (ns == NULL) {
+					fprintf(stderr, "%s: out of memory\n", file);
+					break;
+				}
+				smp = ns;
+			}
+			smp[(*nsamples)++] = s;
+		}
+		pos += caplen;
+	}
+	return smp;
+}
+
+static inline unsigned int
+classify(const struct ipp2p_matcher *m, const struct sample *s,
+         unsigned int *idx, struct ipp2p_stats *det)
+{
+	unsigned int len = s->len;
+
+	if (rp_max_bytes != 0 && len > rp_max_bytes)
+		len = rp_max_bytes;
+	return s->udp ? ipp2p_search_udp(m, s->data, len, s->len, idx, det) :
+	       ipp2p_search_tcp(m, s->data, len, s->len, idx, det);
+}
+
+static void
+replay(const char *file, const struct ipp2p_matcher *m, unsigned int label,
+       bool labelled, struct stats *st)
+{
+	struct timespec start, stop;
+	struct ipp2p_stats timed = {};
+	struct sample *smp;
+	unsigned char *buf;
+	size_t size, n, i;
+	unsigned int round, idx, result;
+
+	buf = slurp(file, &size);
+	if (buf == NULL)
+		return;
+	smp = parse_pcap(file, buf, size, &n, st);
+	st->samples += n;
+
+	for (i = 0; i < n; ++i) {
+		unsigned int command;
+
+		result = classify(m, &smp[i], &idx, &st->det);
+		if (result == 0)
+			continue;
+		++st->hits;
+		command = smp[i].udp ? udp_list[idx].command :
+		          matchlist[idx].command;
+		if (labelled && !(label & command)) {
+			++st->false_pos;
+			if (smp[i].udp)
+				++st->udp_fp[idx];
+			else
+				++st->tcp_fp[idx];
+		}
+		if (rp_verbose)
+			printf("%s:%zu %s %s %u\n", file, i,
+			       smp[i].udp ? "udp" : "tcp",
+			       cmd_name(command), result);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < rp_rounds; ++round)
+		for (i = 0; i < n; ++i)
+			classify(m, &smp[i], &idx, &timed);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	st->ns += (stop.tv_sec - start.tv_sec) * 1e9 +
+	          (stop.tv_nsec - start.tv_nsec);
+	free(smp);
+	free(buf);
+}
+
+static void
+report_counter(const char *proto, unsigned int command,
+               const struct ipp2p_counter *c, unsigned long long fp)
+{
+	if (c->calls == 0)
+		return;
+	printf("\t%s %-10s %10llu calls %10llu hits %10llu fp "
+	       "%12llu bytes\n", proto, cmd_name(command),
+	       (unsigned long long)c->calls, (unsigned long long)c->hits, fp,
+	       (unsigned long long)c->bytes);
+}
+
+static void report(const char *name, const struct stats *st)
+{
+	unsigned int i;
+
+	printf("%s: %llu packets, %llu payloads, %llu hits, "
+	       "%llu false positives, %llu truncated\n",
+	       name, st->packets, st->samples, st->hits, st->false_pos,
+	       st->truncated);
+	if (st->samples > 0)
+		printf("\t%.1f ns/payload over %u round(s)\n",
+		       st->ns / st->samples / rp_rounds, rp_rounds);
+	for (i = 0; matchlist[i].command != 0; ++i)
+		report_counter("tcp", matchlist[i].command, &st->det.tcp[i],
+		               st->tcp_fp[i]);
+	for (i = 0; udp_list[i].command != 0; ++i)
+		report_counter("udp", udp_list[i].command, &st->det.udp[i],
+		               st->udp_fp[i]);
+}
+
+static void
+counter_add(struct ipp2p_counter *sum, const struct ipp2p_counter *c)
+{
+	sum->calls += c->calls;
+	sum->hits  += c->hits;
+	sum->bytes += c->bytes;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+	"Usage: %s [-v] [-b bytes] [-n rounds] [-p protocols] "
+	"file.pcap[=label]...\n"
+	"  -b bytes      Inspect at most this much payload, like --max-bytes\n"
+	"  -n rounds     Time the detectors over this many passes (default 1)\n"
+	"  -p protocols  Comma-separated protocols to enable (default: all)\n"
+	"  -v            List every hit, for diffing two builds\n"
+	"A label is a protocol list (or \"none\") the file is known to\n"
+	"contain; hits by other protocols are counted as false positives.\n"
+	"Protocols:", argv0);
+	for (unsigned int i = 0; i < ARRAY_SIZE(ipp2p_names); ++i)
+		fprintf(stderr, " %s", ipp2p_names[i]);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cmd = (1U << (IPP2N_XDCC + 1)) - 1;
+	struct stats total = {};
+	struct ipp2p_matcher *m;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:n:p:v")) != -1) {
+		switch (c) {
+		case 'b':
+			rp_max_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			rp_rounds = strtoul(optarg, NULL, 0);
+			if (rp_rounds == 0)
+				rp_rounds = 1;
+			break;
+		case 'p':
+			if (!parse_protocols(optarg, &cmd))
+				return EXIT_FAILURE;
+			break;
+		case 'v':
+			rp_verbose = true;
+			break;
+		default:
+			usage(*argv);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind == argc) {
+		usage(*argv);
+		return EXIT_FAILURE;
+	}
+
+	m = ipp2p_matcher_build(cmd);
+	if (m == NULL) {
+		fprintf(stderr, "Could not build matcher\n");
+		return EXIT_FAILURE;
+	}
+
+	for (; optind < argc; ++optind) {
+		char *file = argv[optind], *eq = strrchr(file, '=');
+		unsigned int label = 0;
+		struct stats st = {};
+
+		if (eq != NULL) {
+			*eq++ = '\0';
+			if (!parse_protocols(eq, &label))
+				return EXIT_FAILURE;
+		}
+		replay(file, m, label, eq != NULL, &st);
+		report(file, &st);
+
+		total.packets   += st.packets;
+		total.samples   += st.samples;
+		total.hits      += st.hits;
+		total.false_pos += st.false_pos;
+		total.truncated += st.truncated;
+		total.ns        += st.ns;
+		for (i = 0; i < ARRAY_SIZE(matchlist); ++i) {
+			counter_add(&total.det.tcp[i], &st.det.tcp[i]);
+			total.tcp_fp[i] += st.tcp_fp[i];
+		}
+		for (i = 0; i < ARRAY_SIZE(udp_list); ++i) {
+			counter_add(&total.det.udp[i], &st.det.udp[i]);
+			total.udp_fp[i] += st.udp_fp[i];
+		}
+	}
+	report("total", &total);
+	kvfree(m);
+	return EXIT_SUCCESS;
+}
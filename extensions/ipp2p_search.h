@@ -0,0 +1,1215 @@
+/*
+ *	Detectors of xt_ipp2p, shared with the userspace replay tool.
+ *	Userspace has to provide the few kernel facilities used here
+ *	before including this file.
+ */
+#pragma once
+#ifdef __KERNEL__
+#	include <linux/kernel.h>
+#	include <linux/mm.h>
+#	include <linux/slab.h>
+#	include <linux/string.h>
+#	include <linux/u64_stats_sync.h>
+#	include <asm/unaligned.h>
+#	include "compat_xtables.h"
+#endif
+#include "xt_ipp2p.h"
+
+//#define IPP2P_DEBUG_ARES
+//#define IPP2P_DEBUG_SOUL
+//#define IPP2P_DEBUG_WINMX
+
+#define get_u8(X,  O)  (*(const __u8 *)((X) + O))
+#define get_u16(X, O)  get_unaligned((const __u16 *)((X) + O))
+#define get_u32(X, O)  get_unaligned((const __u32 *)((X) + O))
+
+/* Search for UDP eDonkey/eMule/Kad commands */
+static unsigned int
+udp_search_edk(const unsigned char *t, const unsigned int packet_len)
+{
+	if (packet_len < 4)
+		return 0;
+
+	switch (t[0]) {
+	case 0xe3:
+		/* edonkey */
+		switch (t[1]) {
+		/* client -> server status request */
+		case 0x96:
+			if (packet_len == 6)
+				return IPP2P_EDK * 100 + 50;
+			break;
+
+		/* server -> client status request */
+		case 0x97:
+			if (packet_len == 34)
+				return IPP2P_EDK * 100 + 51;
+			break;
+
+		/* server description request */
+		/* e3 2a ff f0 .. | size == 6 */
+		case 0xa2:
+			if (packet_len == 6 &&
+			    get_u16(t, 2) == __constant_htons(0xfff0))
+				return IPP2P_EDK * 100 + 52;
+			break;
+
+		/* server description response */
+		/* e3 a3 ff f0 ..  | size > 40 && size < 200 */
+		/*
+		case 0xa3:
+			return IPP2P_EDK * 100 + 53;
+			break;
+		*/
+
+		case 0x9a:
+			if (packet_len == 18)
+				return IPP2P_EDK * 100 + 54;
+			break;
+
+		case 0x92:
+			if (packet_len == 10)
+				return IPP2P_EDK * 100 + 55;
+			break;
+		}
+		break;
+
+	case 0xe4:
+		switch (t[1]) {
+		/* e4 20 .. | size == 35 */
+		case 0x20:
+			if (packet_len == 35 && t[2] != 0x00 && t[34] != 0x00)
+				return IPP2P_EDK * 100 + 60;
+			break;
+
+		/* e4 00 .. 00 | size == 27 ? */
+		case 0x00:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 61;
+			break;
+
+		/* e4 10 .. 00 | size == 27 ? */
+		case 0x10:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 62;
+			break;
+
+		/* e4 18 .. 00 | size == 27 ? */
+		case 0x18:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 63;
+			break;
+
+		/* e4 52 .. | size = 36 */
+		case 0x52:
+			if (packet_len == 36)
+				return IPP2P_EDK * 100 + 64;
+			break;
+
+		/* e4 58 .. | size == 6 */
+		case 0x58:
+			if (packet_len == 6)
+				return IPP2P_EDK * 100 + 65;
+			break;
+
+		/* e4 59 .. | size == 2 */
+		case 0x59:
+			if (packet_len == 2)
+				return IPP2P_EDK * 100 + 66;
+			break;
+
+		/* e4 28 .. | packet_len == 49,69,94,119... */
+		case 0x28:
+			if ((packet_len - 44) % 25 == 0)
+				return IPP2P_EDK * 100 + 67;
+			break;
+
+		/* e4 50 xx xx | size == 4 */
+		case 0x50:
+			if (packet_len == 4)
+				return IPP2P_EDK * 100 + 68;
+			break;
+
+		/* e4 40 xx xx | size == 48 */
+		case 0x40:
+			if (packet_len == 48)
+				return IPP2P_EDK * 100 + 69;
+			break;
+		}
+		break;
+	}
+	return 0;
+}
+
+/* Search for UDP Gnutella commands */
+static unsigned int
+udp_search_gnu(const unsigned char *t, const unsigned int packet_len)
+{
+	if (packet_len >= 3 && memcmp(t, "GND", 3) == 0)
+		return IPP2P_GNU * 100 + 51;
+	if (packet_len >= 9 && memcmp(t, "GNUTELLA ", 9) == 0)
+		return IPP2P_GNU * 100 + 52;
+	return 0;
+}
+
+/* Search for UDP KaZaA commands */
+static unsigned int
+udp_search_kazaa(const unsigned char *t, const unsigned int packet_len)
+{
+	if (packet_len < 6)
+		return 0;
+	if (memcmp(t + packet_len - 6, "KaZaA\x00", 6) == 0)
+		return IPP2P_KAZAA * 100 + 50;
+	return 0;
+}
+
+/* Search for UDP DirectConnect commands */
+static unsigned int udp_search_directconnect(const unsigned char *t,
+                                             const unsigned int packet_len)
+{
+	if (packet_len < 5)
+		return 0;
+	if (t[0] == 0x24 && t[packet_len-1] == 0x7c) {
+		if (memcmp(&t[1], "SR ", 3) == 0)
+			return IPP2P_DC * 100 + 60;
+		if (packet_len >= 7 && memcmp(&t[1], "Ping ", 5) == 0)
+			return IPP2P_DC * 100 + 61;
+	}
+	return 0;
+}
+
+/* Search for UDP BitTorrent commands */
+static unsigned int
+udp_search_bit(const unsigned char *haystack, const unsigned int packet_len)
+{
+	switch (packet_len) {
+	case 16:
+		/* ^ 00 00 04 17 27 10 19 80 */
+		if (ntohl(get_u32(haystack, 0)) == 0x00000417 &&
+		    ntohl(get_u32(haystack, 4)) == 0x27101980)
+			return IPP2P_BIT * 100 + 50;
+		break;
+	case 36:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000400) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 51;
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000400))
+			return IPP2P_BIT * 100 + 61;
+		break;
+	case 57:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000404) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 52;
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000404))
+			return IPP2P_BIT * 100 + 62;
+		break;
+	case 59:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000406) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return (IPP2P_BIT * 100 + 53);
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000406))
+			return (IPP2P_BIT * 100 + 63);
+		break;
+	case 203:
+		if (get_u32(haystack, 0) == __constant_htonl(0x00000405))
+			return IPP2P_BIT * 100 + 54;
+		break;
+	case 21:
+		if (get_u32(haystack, 0) == __constant_htonl(0x00000401))
+			return IPP2P_BIT * 100 + 55;
+		break;
+	case 44:
+		if (get_u32(haystack, 0)  == __constant_htonl(0x00000827) &&
+		    get_u32(haystack, 4) == __constant_htonl(0x37502950))
+			return IPP2P_BIT * 100 + 80;
+		break;
+	default:
+		/* this packet does not have a constant size */
+		if (packet_len >= 32 &&
+		    get_u32(haystack, 8) == __constant_htonl(0x00000402) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 56;
+		break;
+	}
+
+	/* some extra-bitcomet rules: "d1:" [a|r] "d2:id20:" */
+	if (packet_len > 22 && get_u8(haystack, 0) == 'd' &&
+	    get_u8(haystack, 1) == '1' && get_u8(haystack, 2) == ':')
+		if (get_u8(haystack, 3) == 'a' ||
+		    get_u8(haystack, 3) == 'r')
+			if (memcmp(haystack + 4, "d2:id20:", 8) == 0)
+				return IPP2P_BIT * 100 + 57;
+
+#if 0
+	/* bitlord rules */
+	/* packetlen must be bigger than 32 */
+	/* first 4 bytes are zero */
+	if (packet_len > 32 && get_u32(haystack, 0) == 0x00000000) {
+		/* first rule: 00 00 00 00 01 00 00 xx xx xx xx 00 00 00 00*/
+		if (get_u32(haystack, 4) == 0x00000000 &&
+		    get_u32(haystack, 8) == 0x00010000 &&
+		    get_u32(haystack, 16) == 0x00000000)
+			return IPP2P_BIT * 100 + 71;
+
+		/* 00 01 00 00 0d 00 00 xx xx xx xx 00 00 00 00*/
+		if (get_u32(haystack, 4) == 0x00000001 &&
+		    get_u32(haystack, 8) == 0x000d0000 &&
+		    get_u32(haystack, 16) == 0x00000000)
+			return IPP2P_BIT * 100 + 71;
+	}
+#endif
+
+	return 0;
+}
+
+/* Search for Ares commands */
+static unsigned int
+search_ares(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 3)
+		return 0;
+	/* all ares packets start with  */
+	if (payload[1] == 0 && plen - payload[0] == 3) {
+		switch (payload[2]) {
+		case 0x5a:
+			/* ares connect */
+			if (plen == 6 && payload[5] == 0x05)
+				return IPP2P_ARES * 100 + 1;
+			break;
+		case 0x09:
+			/*
+			 * ares search, min 3 chars --> 14 bytes
+			 * lets define a search can be up to 30 chars
+			 * --> max 34 bytes
+			 */
+			if (plen >= 14 && plen <= 34)
+				return IPP2P_ARES * 100 + 1;
+			break;
+#ifdef IPP2P_DEBUG_ARES
+		default:
+			printk(KERN_DEBUG "Unknown Ares command %x "
+			       "recognized, len: %u\n",
+			       (unsigned int)payload[2], plen);
+#endif
+		}
+	}
+
+#if 0
+	/* found connect packet: 03 00 5a 04 03 05 */
+	/* new version ares 1.8: 03 00 5a xx xx 05 */
+	if (plen == 6)
+		/* possible connect command */
+		if (payload[0] == 0x03 && payload[1] == 0x00 &&
+		    payload[2] == 0x5a && payload[5] == 0x05)
+			return IPP2P_ARES * 100 + 1;
+
+	if (plen == 60)
+		/* possible download command*/
+		if (payload[59] == 0x0a && payload[58] == 0x0a)
+			if (memcmp(t, "PUSH SHA1:", 10) == 0)
+				/* found download command */
+				return IPP2P_ARES * 100 + 2;
+#endif
+
+	return 0;
+}
+
+/* Search for SoulSeek commands */
+static unsigned int
+search_soul(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 8)
+		return 0;
+	/* match: xx xx xx xx | xx = sizeof(payload) - 4 */
+	if (get_u32(payload, 0) == plen - 4) {
+		const uint32_t m = get_u32(payload, 4);
+
+		/* match 00 yy yy 00, yy can be everything */
+		if (get_u8(payload, 4) == 0x00 && get_u8(payload, 7) == 0x00) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "0: Soulseek command 0x%x "
+			       "recognized\n", get_u32(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 1;
+		}
+
+		/* next match: 01 yy 00 00 | yy can be everything */
+		if (get_u8(payload, 4) == 0x01 && get_u16(payload, 6) == 0x0000) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "1: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 2;
+		}
+
+		/* other soulseek commandos are: 1-5,7,9,13-18,22,23,26,28,35-37,40-46,50,51,60,62-69,91,92,1001 */
+		/* try to do this in an intelligent way */
+		/* get all small commandos */
+		switch (m) {
+		case 7:
+		case 9:
+		case 22:
+		case 23:
+		case 26:
+		case 28:
+		case 50:
+		case 51:
+		case 60:
+		case 91:
+		case 92:
+		case 1001:
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "2: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 3;
+		}
+
+		if (m > 0 && m < 6) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "3: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 4;
+		}
+
+		if (m > 12 && m < 19) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "4: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 5;
+		}
+
+		if (m > 34 && m < 38) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "5: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 6;
+		}
+
+		if (m > 39 && m < 47) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "6: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 7;
+		}
+
+		if (m > 61 && m < 70) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "7: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 8;
+		}
+
+#ifdef IPP2P_DEBUG_SOUL
+		printk(KERN_DEBUG "unknown SOULSEEK command: 0x%x, first "
+		       "16 bit: 0x%x, first 8 bit: 0x%x ,soulseek ???\n",
+		       get_u32(payload, 4), get_u16(payload, 4) >> 16,
+		       get_u8(payload, 4) >> 24);
+#endif
+	}
+
+	/* match 14 00 00 00 01 yy 00 00 00 STRING(YY) 01 00 00 00 00 46|50 00 00 00 00 */
+	/* without size at the beginning !!! */
+	if (get_u32(payload, 0) == 0x14 && get_u8(payload, 4) == 0x01) {
+		uint32_t y = get_u32(payload, 5);
+
+		/* we need 19 chars + string */
+		if (y + 19 <= plen) {
+			const unsigned char *w = payload + 9 + y;
+			if (get_u32(w, 0) == 0x01 &&
+			    (get_u16(w, 4) == 0x4600 ||
+			    get_u16(w, 4) == 0x5000) &&
+			    get_u32(w, 6) == 0x00)
+				;
+#ifdef IPP2P_DEBUG_SOUL
+	    		printk(KERN_DEBUG "Soulssek special client command recognized\n");
+#endif
+	    		return IPP2P_SOUL * 100 + 9;
+		}
+	}
+	return 0;
+}
+
+/* Search for WinMX commands */
+static unsigned int
+search_winmx(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen == 4 && memcmp(payload, "SEND", 4) == 0)
+		return IPP2P_WINMX * 100 + 1;
+	if (plen == 3 && memcmp(payload, "GET", 3) == 0)
+		return IPP2P_WINMX * 100 + 2;
+	/*
+	if (packet_len < head_len + 10)
+		return 0;
+	*/
+	if (plen < 10)
+		return 0;
+
+	if (memcmp(payload, "SEND", 4) == 0 || memcmp(payload, "GET", 3) == 0) {
+		uint16_t c = 4;
+		const uint16_t end = plen - 2;
+		uint8_t count = 0;
+
+		while (c < end) {
+			if (payload[c] == 0x20 && payload[c+1] == 0x22) {
+				c++;
+				count++;
+				if (count >= 2)
+					return IPP2P_WINMX * 100 + 3;
+			}
+			c++;
+		}
+	}
+
+	if (plen == 149 && payload[0] == '8') {
+#ifdef IPP2P_DEBUG_WINMX
+		printk(KERN_INFO "maybe WinMX\n");
+#endif
+		if (get_u32(payload, 17) == 0 && get_u32(payload, 21) == 0 &&
+		    get_u32(payload, 25) == 0 &&
+//		    get_u32(payload, 33) == __constant_htonl(0x71182b1a) &&
+//		    get_u32(payload, 37) == __constant_htonl(0x05050000) &&
+//		    get_u32(payload, 133) == __constant_htonl(0x31097edf) &&
+//		    get_u32(payload, 145) == __constant_htonl(0xdcb8f792))
+		    get_u16(payload, 39) == 0 &&
+		    get_u16(payload, 135) == __constant_htons(0x7edf) &&
+		    get_u16(payload,147) == __constant_htons(0xf792))
+		{
+#ifdef IPP2P_DEBUG_WINMX
+			printk(KERN_INFO "got WinMX\n");
+#endif
+			return IPP2P_WINMX * 100 + 4;
+		}
+	}
+	return 0;
+}
+
+/* Search for appleJuice commands */
+static unsigned int
+search_apple(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen > 7 && payload[6] == 0x0d && payload[7] == 0x0a &&
+	    memcmp(payload, "ajprot", 6) == 0)
+		return IPP2P_APPLE * 100;
+
+	return 0;
+}
+
+/* Search for BitTorrent commands */
+static unsigned int
+search_bittorrent(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen > 20) {
+		/* test for match 0x13+"BitTorrent protocol" */
+		if (payload[0] == 0x13)
+			if (memcmp(payload + 1, "BitTorrent protocol", 19) == 0)
+				return IPP2P_BIT * 100;
+		/*
+		 * Any tracker command starts with GET / then *may be* some file on web server
+		 * (e.g. announce.php or dupa.pl or whatever.cgi or NOTHING for tracker on root dir)
+		 * but *must have* one (or more) of strings listed below (true for scrape and announce)
+		 */
+		if (memcmp(payload, "GET /", 5) == 0) {
+			if (HX_memmem(payload, plen, "info_hash=", 10) != NULL)
+				return IPP2P_BIT * 100 + 1;
+			if (HX_memmem(payload, plen, "peer_id=", 8) != NULL)
+				return IPP2P_BIT * 100 + 2;
+			if (HX_memmem(payload, plen, "passkey=", 8) != NULL)
+				return IPP2P_BIT * 100 + 4;
+		}
+	} else {
+	    	/* bitcomet encryptes the first packet, so we have to detect another
+	    	 * one later in the flow */
+		/* first try failed, too many false positives */
+	    	/*
+		if (size == 5 && get_u32(t, 0) == __constant_htonl(1) &&
+		    t[4] < 3)
+			return IPP2P_BIT * 100 + 3;
+		*/
+
+	    	/* second try: block request packets */
+	    	if (plen == 17 &&
+		    get_u32(payload, 0) == __constant_htonl(0x0d) &&
+		    payload[4] == 0x06 &&
+		    get_u32(payload,13) == __constant_htonl(0x4000))
+			return IPP2P_BIT * 100 + 3;
+	}
+
+	return 0;
+}
+
+/* check for Kazaa get command */
+static unsigned int
+search_kazaa(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 13)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a &&
+	    memcmp(payload, "GET /.hash=", 11) == 0)
+		return IPP2P_DATA_KAZAA * 100;
+
+	return 0;
+}
+
+/* check for gnutella get command */
+static unsigned int
+search_gnu(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 11)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
+		if (memcmp(payload, "GET /get/", 9) == 0)
+			return IPP2P_DATA_GNU * 100 + 1;
+		if (plen >= 15 && memcmp(payload, "GET /uri-res/", 13) == 0)
+			return IPP2P_DATA_GNU * 100 + 2;
+	}
+	return 0;
+}
+
+/* check for gnutella get commands and other typical data */
+static unsigned int
+search_all_gnu(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 11)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
+		if (plen >= 19 && memcmp(payload, "GNUTELLA CONNECT/", 17) == 0)
+			return IPP2P_GNU * 100 + 1;
+		if (memcmp(payload, "GNUTELLA/", 9) == 0)
+			return IPP2P_GNU * 100 + 2;
+
+		if (plen >= 22 && (memcmp(payload, "GET /get/", 9) == 0 ||
+		    memcmp(payload, "GET /uri-res/", 13) == 0))
+		{
+			unsigned int c;
+
+			for (c = 0; c < plen - 22; ++c)
+				if (payload[c] == 0x0d &&
+				    payload[c+1] == 0x0a &&
+				    (memcmp(&payload[c+2], "X-Gnutella-", 11) == 0 ||
+				    memcmp(&payload[c+2], "X-Queue:", 8) == 0))
+					return IPP2P_GNU * 100 + 3;
+		}
+	}
+	return 0;
+}
+
+/* check for KaZaA download commands and other typical data */
+/* plen is guaranteed to be >= 5 (see @matchlist) */
+static unsigned int
+search_all_kazaa(const unsigned char *payload, const unsigned int plen)
+{
+	uint16_t c, end, rem;
+
+	if (plen < 7)
+		/* too short for anything we test for - early bailout */
+		return 0;
+
+	if (payload[plen-2] != 0x0d || payload[plen-1] != 0x0a)
+		return 0;
+
+	if (memcmp(payload, "GIVE ", 5) == 0)
+		return IPP2P_KAZAA * 100 + 1;
+
+	if (memcmp(payload, "GET /", 5) != 0)
+		return 0;
+
+	if (plen < 18)
+		/* The next tests would not succeed anyhow. */
+		return 0;
+
+	end = plen - 18;
+	rem = plen - 5;
+	for (c = 5; c < end; ++c, --rem) {
+		if (payload[c] != 0x0d)
+			continue;
+		if (payload[c+1] != 0x0a)
+			continue;
+		if (rem >= 18 &&
+		    memcmp(&payload[c+2], "X-Kazaa-Username: ", 18) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+		if (rem >= 24 &&
+		    memcmp(&payload[c+2], "User-Agent: PeerEnabler/", 24) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+	}
+
+	return 0;
+}
+
+/* fast check for edonkey file segment transfer command */
+static unsigned int
+search_edk(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0xe3) {
+		return 0;
+	} else {
+		if (payload[5] == 0x47)
+			return IPP2P_DATA_EDK * 100;
+		else
+			return 0;
+	}
+}
+
+/* intensive but slower search for some edonkey packets including size-check */
+static unsigned int
+search_all_edk(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0xe3) {
+		return 0;
+	} else {
+		unsigned int cmd = get_u16(payload, 1);
+
+		if (cmd == plen - 5) {
+			switch (payload[5]) {
+			case 0x01:
+				/* Client: hello or Server:hello */
+			return IPP2P_EDK * 100 + 1;
+				case 0x4c:
+				/* Client: Hello-Answer */
+				return IPP2P_EDK * 100 + 9;
+			}
+		}
+		return 0;
+	}
+}
+
+/* fast check for Direct Connect send command */
+static unsigned int
+search_dc(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0x24) {
+		return 0;
+	} else {
+		if (memcmp(&payload[1], "Send|", 5) == 0)
+			return IPP2P_DATA_DC * 100;
+		else
+			return 0;
+	}
+}
+
+/* intensive but slower check for all direct connect packets */
+static unsigned int
+search_all_dc(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen < 7)
+		return 0;
+	if (payload[0] == 0x24 && payload[plen-1] == 0x7c) {
+		const unsigned char *t = &payload[1];
+
+		/* Client-Hub-Protocol */
+		if (memcmp(t, "Lock ", 5) == 0)
+			return IPP2P_DC * 100 + 1;
+
+		/*
+		 * Client-Client-Protocol, some are already recognized by
+		 * client-hub (like lock)
+		 */
+		if (plen >= 9 && memcmp(t, "MyNick ", 7) == 0)
+			return IPP2P_DC * 100 + 38;
+	}
+	return 0;
+}
+
+/* check for mute */
+static unsigned int
+search_mute(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen == 209 || plen == 345 || plen == 473 || plen == 609 ||
+	    plen == 1121) {
+		//printk(KERN_DEBUG "size hit: %u", size);
+		if (memcmp(payload,"PublicKey: ", 11) == 0) {
+			return IPP2P_MUTE * 100 + 0;
+			/*
+			if (memcmp(t + size - 14, "\x0aEndPublicKey\x0a", 14) == 0)
+				printk(KERN_DEBUG "end pubic key hit: %u", size);
+			*/
+		}
+	}
+	return 0;
+}
+
+/* check for xdcc */
+static unsigned int
+search_xdcc(const unsigned char *payload, const unsigned int plen)
+{
+	/* search in small packets only */
+	if (plen > 20 && plen < 200 && payload[plen-1] == 0x0a &&
+	    payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0)
+	{
+		uint16_t x = 10;
+		const uint16_t end = plen - 13;
+
+		/*
+		 * is seems to be a irc private massage, chedck for
+		 * xdcc command
+		 */
+		while (x < end)	{
+			if (payload[x] == ':')
+				if (memcmp(&payload[x+1], "xdcc send #", 11) == 0)
+					return IPP2P_XDCC * 100 + 0;
+			x++;
+		}
+	}
+	return 0;
+}
+
+/* search for waste */
+static unsigned int
+search_waste(const unsigned char *payload, const unsigned int plen)
+{
+	if (plen >= 9 && memcmp(payload, "GET.sha1:", 9) == 0)
+		return IPP2P_WASTE * 100 + 0;
+
+	return 0;
+}
+
+/*
+ * String signatures of the TCP detectors. All of them are searched for in a
+ * single pass over the payload; anchored ones count only at offset 0.
+ */
+enum {
+	IPP2S_GET_SLASH,
+	IPP2S_KAZAA_HASH,
+	IPP2S_KAZAA_GIVE,
+	IPP2S_KAZAA_USERNAME,
+	IPP2S_KAZAA_PEERENABLER,
+	IPP2S_DC_SEND,
+	IPP2S_DC_LOCK,
+	IPP2S_DC_MYNICK,
+	IPP2S_GNU_GET,
+	IPP2S_GNU_URIRES,
+	IPP2S_GNU_CONNECT,
+	IPP2S_GNU_REPLY,
+	IPP2S_GNU_XGNUTELLA,
+	IPP2S_GNU_XQUEUE,
+	IPP2S_BIT_HANDSHAKE,
+	IPP2S_BIT_INFOHASH,
+	IPP2S_BIT_PEERID,
+	IPP2S_BIT_PASSKEY,
+	IPP2S_APPLE,
+	IPP2S_MUTE,
+	IPP2S_WASTE,
+	IPP2S_XDCC_PRIVMSG,
+	IPP2S_XDCC_SEND,
+	IPP2S_MAX,
+};
+
+#define SIG(str, anchored) {(str), sizeof(str) - 1, (anchored)}
+#define S(name) (1U << IPP2S_ ## name)
+
+static const struct {
+	const char *str;
+	unsigned int len;
+	bool anchored;
+} ipp2p_sigs[] = {
+	[IPP2S_GET_SLASH]         = SIG("GET /", true),
+	[IPP2S_KAZAA_HASH]        = SIG("GET /.hash=", true),
+	[IPP2S_KAZAA_GIVE]        = SIG("GIVE ", true),
+	[IPP2S_KAZAA_USERNAME]    = SIG("\r\nX-Kazaa-Username: ", false),
+	[IPP2S_KAZAA_PEERENABLER] = SIG("\r\nUser-Agent: PeerEnabler/", false),
+	[IPP2S_DC_SEND]           = SIG("$Send|", true),
+	[IPP2S_DC_LOCK]           = SIG("$Lock ", true),
+	[IPP2S_DC_MYNICK]         = SIG("$MyNick ", true),
+	[IPP2S_GNU_GET]           = SIG("GET /get/", true),
+	[IPP2S_GNU_URIRES]        = SIG("GET /uri-res/", true),
+	[IPP2S_GNU_CONNECT]       = SIG("GNUTELLA CONNECT/", true),
+	[IPP2S_GNU_REPLY]         = SIG("GNUTELLA/", true),
+	[IPP2S_GNU_XGNUTELLA]     = SIG("\r\nX-Gnutella-", false),
+	[IPP2S_GNU_XQUEUE]        = SIG("\r\nX-Queue:", false),
+	[IPP2S_BIT_HANDSHAKE]     = SIG("\x13" "BitTorrent protocol", true),
+	[IPP2S_BIT_INFOHASH]      = SIG("info_hash=", false),
+	[IPP2S_BIT_PEERID]        = SIG("peer_id=", false),
+	[IPP2S_BIT_PASSKEY]       = SIG("passkey=", false),
+	[IPP2S_APPLE]             = SIG("ajprot", true),
+	[IPP2S_MUTE]              = SIG("PublicKey: ", true),
+	[IPP2S_WASTE]             = SIG("GET.sha1:", true),
+	[IPP2S_XDCC_PRIVMSG]      = SIG("PRIVMSG ", true),
+	[IPP2S_XDCC_SEND]         = SIG(":xdcc send #", false),
+};
+
+/*
+ * @whole is set for detectors that look at the payload length or at its
+ * last bytes. They are skipped when only the start of the payload could be
+ * looked at, where they would judge a different packet.
+ *
+ * @lead lists the first payload bytes a detector can possibly match on
+ * (NULL: any).
+ *
+ * A detector is only worth calling if, for one of its @need entries, any
+ * signature of @first and (if nonzero) any signature of @then were found.
+ * An empty list means the detector has no string signature to go by.
+ * These are necessary conditions only; the detector still does the actual
+ * (positional) checks.
+ */
+struct ipp2p_need {
+	uint32_t first, then;
+};
+
+#define WHOLE  true
+#define PREFIX false
+
+static const struct {
+	unsigned int command;
+	unsigned int packet_len;
+	bool whole;
+	unsigned int (*function_name)(const unsigned char *, const unsigned int);
+	const char *lead;
+	struct ipp2p_need need[2];
+} matchlist[] = {
+	{IPP2P_EDK,         20, WHOLE,  search_all_edk, "\xe3"},
+	{IPP2P_DATA_KAZAA, 200, WHOLE,  search_kazaa, "G", /* exp */
+		{{S(KAZAA_HASH)}}},
+	{IPP2P_DATA_EDK,    60, PREFIX, search_edk, "\xe3"}, /* exp */
+	{IPP2P_DATA_DC,     26, PREFIX, search_dc, "$", /* exp */
+		{{S(DC_SEND)}}},
+	{IPP2P_DC,           5, WHOLE,  search_all_dc, "$",
+		{{S(DC_LOCK) | S(DC_MYNICK)}}},
+	{IPP2P_DATA_GNU,    40, WHOLE,  search_gnu, "G", /* exp */
+		{{S(GNU_GET) | S(GNU_URIRES)}}},
+	{IPP2P_GNU,          5, WHOLE,  search_all_gnu, "G",
+		{{S(GNU_CONNECT) | S(GNU_REPLY)},
+		 {S(GNU_GET) | S(GNU_URIRES), S(GNU_XGNUTELLA) | S(GNU_XQUEUE)}}},
+	{IPP2P_KAZAA,        5, WHOLE,  search_all_kazaa, "G",
+		{{S(KAZAA_GIVE)},
+		 {S(GET_SLASH), S(KAZAA_USERNAME) | S(KAZAA_PEERENABLER)}}},
+	/* packet_len 20 leaves the plen <= 20 branch (lead byte 0) unused */
+	{IPP2P_BIT,         20, PREFIX, search_bittorrent, "\x13G",
+		{{S(BIT_HANDSHAKE)},
+		 {S(GET_SLASH), S(BIT_INFOHASH) | S(BIT_PEERID) | S(BIT_PASSKEY)}}},
+	{IPP2P_APPLE,        5, PREFIX, search_apple, "a",
+		{{S(APPLE)}}},
+	{IPP2P_SOUL,         5, WHOLE,  search_soul},
+	{IPP2P_WINMX,        2, WHOLE,  search_winmx, "SG8"},
+	{IPP2P_ARES,         5, WHOLE,  search_ares},
+	{IPP2P_MUTE,       200, WHOLE,  search_mute, "P",
+		{{S(MUTE)}}},
+	{IPP2P_WASTE,        5, PREFIX, search_waste, "G",
+		{{S(WASTE)}}},
+	{IPP2P_XDCC,         5, WHOLE,  search_xdcc, "P",
+		{{S(XDCC_PRIVMSG), S(XDCC_SEND)}}},
+	{0},
+};
+
+#undef S
+#undef SIG
+
+static const struct {
+	unsigned int command;
+	unsigned int packet_len;
+	bool whole;
+	unsigned int (*function_name)(const unsigned char *, const unsigned int);
+	const char *lead;
+} udp_list[] = {
+	{IPP2P_KAZAA, 14, WHOLE,  udp_search_kazaa},
+	{IPP2P_BIT,   23, WHOLE,  udp_search_bit},
+	{IPP2P_GNU,   11, PREFIX, udp_search_gnu, "G"},
+	{IPP2P_EDK,    9, WHOLE,  udp_search_edk, "\xe3\xe4"},
+	{IPP2P_DC,    12, WHOLE,  udp_search_directconnect, "$"},
+	{0},
+};
+
+#undef PREFIX
+#undef WHOLE
+
+static const char *const ipp2p_names[] = {
+	[IPP2N_EDK]        = "edk",
+	[IPP2N_DATA_KAZAA] = "kazaa-data",
+	[IPP2N_DATA_EDK]   = "edk-data",
+	[IPP2N_DATA_DC]    = "dc-data",
+	[IPP2N_DC]         = "dc",
+	[IPP2N_DATA_GNU]   = "gnu-data",
+	[IPP2N_GNU]        = "gnu",
+	[IPP2N_KAZAA]      = "kazaa",
+	[IPP2N_BIT]        = "bit",
+	[IPP2N_APPLE]      = "apple",
+	[IPP2N_SOUL]       = "soul",
+	[IPP2N_WINMX]      = "winmx",
+	[IPP2N_ARES]       = "ares",
+	[IPP2N_MUTE]       = "mute",
+	[IPP2N_WASTE]      = "waste",
+	[IPP2N_XDCC]       = "xdcc",
+};
+
+/*
+ * Detector counters, indexed like matchlist and udp_list.
+ * @calls:	times the detector was run
+ * @hits:	times it returned a match
+ * @bytes:	payload bytes handed to it
+ */
+struct ipp2p_counter {
+	uint64_t calls, hits, bytes;
+};
+
+struct ipp2p_stats {
+	struct ipp2p_counter tcp[ARRAY_SIZE(matchlist)];
+	struct ipp2p_counter udp[ARRAY_SIZE(udp_list)];
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Per-rule search state.
+ * @tcp_lead:	first payload byte -> enabled TCP detectors (matchlist
+ * 		indices) that can match
+ * @udp_lead:	the same for udp_list
+ * @tcp_scan:	TCP detectors that depend on the automaton's result
+ *
+ * Aho-Corasick automaton over the signatures needed by a rule, stored as a
+ * complete DFA on an alphabet reduced to the bytes occurring in them.
+ * @gate:	anchored signatures that make it worthwhile to look at the
+ * 		payload beyond its first few bytes
+ * @class:	byte -> alphabet index (0 for bytes in no signature)
+ * @out:	unanchored signatures ending in a state, including suffixes
+ * @term:	anchored signature spelled by the path to a state
+ * @delta:	@nstates rows of @nclasses transitions
+ */
+struct ipp2p_matcher {
+	uint32_t tcp_lead[256], udp_lead[256], tcp_scan;
+	uint32_t gate;
+	unsigned int nstates, nclasses;
+	uint8_t class[256];
+	struct ipp2p_state {
+		uint32_t out, term;
+		unsigned int depth;
+	} *state;
+	uint16_t *delta;
+};
+
+static bool ipp2p_need_met(const struct ipp2p_need *need, uint32_t found)
+{
+	unsigned int i;
+
+	if (need[0].first == 0)
+		return true;
+	for (i = 0; i < ARRAY_SIZE(matchlist[0].need); ++i)
+		if (need[i].first & found &&
+		    (need[i].then == 0 || need[i].then & found))
+			return true;
+	return false;
+}
+
+static void ipp2p_lead_fill(uint32_t *table, unsigned int idx, const char *lead)
+{
+	unsigned int c;
+
+	if (lead == NULL) {
+		for (c = 0; c < 256; ++c)
+			table[c] |= 1U << idx;
+		return;
+	}
+	for (; *lead != '\0'; ++lead)
+		table[(uint8_t)*lead] |= 1U << idx;
+}
+
+static struct ipp2p_matcher *ipp2p_matcher_build(unsigned int cmd)
+{
+	unsigned int i, j, nstates = 1, nclasses = 1, used = 1, head, tail;
+	struct ipp2p_matcher *m;
+	uint32_t sigs = 0, gate = 0;
+	uint8_t class[256] = {};
+	uint16_t *queue, *fail;
+
+	BUILD_BUG_ON(ARRAY_SIZE(matchlist) - 1 > 32);
+	BUILD_BUG_ON(ARRAY_SIZE(udp_list) - 1 > 32);
+	for (i = 0; matchlist[i].command != 0; ++i) {
+		if ((cmd & matchlist[i].command) != matchlist[i].command)
+			continue;
+		for (j = 0; j < ARRAY_SIZE(matchlist[i].need); ++j) {
+			sigs |= matchlist[i].need[j].first |
+			        matchlist[i].need[j].then;
+			if (matchlist[i].need[j].then != 0)
+				gate |= matchlist[i].need[j].first;
+		}
+	}
+
+	for (i = 0; i < IPP2S_MAX; ++i) {
+		if (!(sigs & (1U << i)))
+			continue;
+		nstates += ipp2p_sigs[i].len;
+		for (j = 0; j < ipp2p_sigs[i].len; ++j) {
+			uint8_t c = ipp2p_sigs[i].str[j];
+			if (class[c] == 0)
+				class[c] = nclasses++;
+		}
+	}
+
+	m = kvzalloc(sizeof(*m) + nstates * sizeof(*m->state) +
+	             nstates * nclasses * sizeof(*m->delta), GFP_KERNEL);
+	if (m == NULL)
+		return NULL;
+	queue = kmalloc_array(2 * nstates, sizeof(*queue), GFP_KERNEL);
+	if (queue == NULL) {
+		kvfree(m);
+		return NULL;
+	}
+	fail = queue + nstates;
+
+	for (i = 0; matchlist[i].command != 0; ++i) {
+		if ((cmd & matchlist[i].command) != matchlist[i].command)
+			continue;
+		ipp2p_lead_fill(m->tcp_lead, i, matchlist[i].lead);
+		if (matchlist[i].need[0].first != 0)
+			m->tcp_scan |= 1U << i;
+	}
+	for (i = 0; udp_list[i].command != 0; ++i)
+		if ((cmd & udp_list[i].command) == udp_list[i].command)
+			ipp2p_lead_fill(m->udp_lead, i, udp_list[i].lead);
+
+	m->gate     = gate;
+	m->nclasses = nclasses;
+	m->state    = (void *)(m + 1);
+	m->delta    = (void *)(m->state + nstates);
+	memcpy(m->class, class, sizeof(class));
+
+	/* Trie. No edge leads back to the root, so 0 means "no edge" here. */
+	for (i = 0; i < IPP2S_MAX; ++i) {
+		unsigned int s = 0;
+
+		if (!(sigs & (1U << i)))
+			continue;
+		for (j = 0; j < ipp2p_sigs[i].len; ++j) {
+			uint16_t *t = &m->delta[s * nclasses +
+			              class[(uint8_t)ipp2p_sigs[i].str[j]]];
+			if (*t == 0) {
+				*t = used++;
+				m->state[*t].depth = j + 1;
+			}
+			s = *t;
+		}
+		if (ipp2p_sigs[i].anchored)
+			m->state[s].term |= 1U << i;
+		else
+			m->state[s].out |= 1U << i;
+	}
+	m->nstates = used;
+
+	/* Failure links, folded into the transition table in BFS order. */
+	head = tail = 0;
+	for (j = 0; j < nclasses; ++j) {
+		uint16_t t = m->delta[j];
+		if (t != 0) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		unsigned int s = queue[head++];
+
+		for (j = 0; j < nclasses; ++j) {
+			uint16_t *t = &m->delta[s * nclasses + j];
+			uint16_t f = m->delta[fail[s] * nclasses + j];
+
+			if (*t == 0) {
+				*t = f;
+				continue;
+			}
+			fail[*t] = f;
+			m->state[*t].out |= m->state[f].out;
+			queue[tail++] = *t;
+		}
+	}
+
+	kfree(queue);
+	return m;
+}
+
+/*
+ * Returns the set of signatures found in the payload. Scanning stops after
+ * the anchored prefix if nothing found there warrants looking any further.
+ */
+static uint32_t
+ipp2p_scan(const struct ipp2p_matcher *m, const unsigned char *payload,
+           unsigned int plen)
+{
+	unsigned int i, s = 0, nclasses = m->nclasses;
+	bool anchored = true;
+	uint32_t found = 0;
+
+	for (i = 0; i < plen; ++i) {
+		s = m->delta[s * nclasses + m->class[payload[i]]];
+		found |= m->state[s].out;
+		if (anchored) {
+			if (m->state[s].depth == i + 1)
+				found |= m->state[s].term;
+			else
+				anchored = false;
+		}
+		if (!anchored && !(found & m->gate))
+			break;
+	}
+	return found;
+}
+
+/*
+ * Run the detectors for the first @plen bytes of a TCP payload of @total
+ * bytes. Returns the detector's result and its matchlist index in @idx.
+ * Every detector run is accounted in @st.
+ */
+static unsigned int
+ipp2p_search_tcp(const struct ipp2p_matcher *m, const unsigned char *payload,
+                 unsigned int plen, unsigned int total, unsigned int *idx,
+                 struct ipp2p_stats *st)
+{
+	uint32_t todo = m->tcp_lead[payload[0]], found = 0;
+	unsigned int i, result;
+
+	if (todo & m->tcp_scan)
+		found = ipp2p_scan(m, payload, plen);
+
+	for (; todo != 0; todo &= todo - 1) {
+		i = __ffs(todo);
+		if (plen <= matchlist[i].packet_len ||
+		    (plen < total && matchlist[i].whole) ||
+		    !ipp2p_need_met(matchlist[i].need, found))
+			continue;
+		result = matchlist[i].function_name(payload, plen);
+		u64_stats_update_begin(&st->syncp);
+		++st->tcp[i].calls;
+		st->tcp[i].bytes += plen;
+		st->tcp[i].hits += result != 0;
+		u64_stats_update_end(&st->syncp);
+		if (result != 0) {
+			*idx = i;
+			return result;
+		}
+	}
+	return 0;
+}
+
+/* The same for UDP; @idx is the udp_list index. */
+static unsigned int
+ipp2p_search_udp(const struct ipp2p_matcher *m, const unsigned char *payload,
+                 unsigned int plen, unsigned int total, unsigned int *idx,
+                 struct ipp2p_stats *st)
+{
+	uint32_t todo = m->udp_lead[payload[0]];
+	unsigned int i, result;
+
+	for (; todo != 0; todo &= todo - 1) {
+		i = __ffs(todo);
+		if (plen <= udp_list[i].packet_len ||
+		    (plen < total && udp_list[i].whole))
+			continue;
+		result = udp_list[i].function_name(payload, plen);
+		u64_stats_update_begin(&st->syncp);
+		++st->udp[i].calls;
+		st->udp[i].bytes += plen;
+		st->udp[i].hits += result != 0;
+		u64_stats_update_end(&st->syncp);
+		if (result != 0) {
+			*idx = i;
+			return result;
+		}
+	}
+	return 0;
+}
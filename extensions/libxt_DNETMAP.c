@@ -5,6 +5,8 @@
  * Svenning Soerensen <svenning@post5.tele.dk>
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <netdb.h>
 #include <string.h>
@@ -30,6 +32,7 @@ static void DNETMAP_help(void)
 	printf(MODULENAME " target options:\n"
 	       "  --%s address[/mask]\n"
 	       "    Network subnet to map to. If not specified, all existing prefixes are used.\n"
+	       "    IPv6 bindings are between /64 networks, the subnet is a /48 to /64.\n"
 	       "  --%s\n"
 	       "    Reuse entry for given prenat-ip from any prefix despite bindings ttl < 0.\n"
 	       "  --%s seconds\n"
@@ -121,10 +124,45 @@ static void parse_prefix(char *arg, struct nf_nat_range *range)
 	range->max_addr.ip = range->min_addr.ip | ~netmask;
 }
 
-static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
-			 const void *entry, struct xt_entry_target **target)
+/* Parses IPv6 network address, /48 to /64 */
+static void parse_prefix6(char *arg, struct nf_nat_range *range)
+{
+	const struct in6_addr *ip;
+	unsigned int bits = 64, i, n;
+	u_int32_t netmask;
+	char *slash;
+
+	range->flags |= NF_NAT_RANGE_MAP_IPS;
+	slash = strchr(arg, '/');
+	if (slash)
+		*slash = '\0';
+
+	ip = xtables_numeric_to_ip6addr(arg);
+	if (ip == NULL || ip->s6_addr[0] == 0xff)
+		xtables_error(PARAMETER_PROBLEM, "Bad IPv6 address \"%s\"\n",
+			      arg);
+	range->min_addr.in6 = *ip;
+	if (slash && !xtables_strtoui(slash + 1, NULL, &bits, 48, 64))
+		xtables_error(PARAMETER_PROBLEM,
+			      "Prefix length must be /48 to /64\n");
+
+	for (i = 0; i < 4; ++i) {
+		n = bits > 32 ? 32 : bits;
+		bits -= n;
+		netmask = bits2netmask(n);
+		if (range->min_addr.ip6[i] & ~netmask) {
+			if (slash)
+				*slash = '/';
+			xtables_error(PARAMETER_PROBLEM,
+				      "Bad network address \"%s\"\n", arg);
+		}
+		range->max_addr.ip6[i] = range->min_addr.ip6[i] | ~netmask;
+	}
+}
+
+static int DNETMAP_parse(int c, bool invert, unsigned int *flags,
+			 struct xt_DNETMAP_tginfo *tginfo, uint8_t nfproto)
 {
-	struct xt_DNETMAP_tginfo *tginfo = (void *)(*target)->data;
 	struct nf_nat_range *mr = &tginfo->prefix;
 	char *end;
 
@@ -136,7 +174,10 @@ static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
 				  invert);
 
 		/* TO-DO use xtables_ipparse_any instead? */
-		parse_prefix(optarg, mr);
+		if (nfproto == NFPROTO_IPV6)
+			parse_prefix6(optarg, mr);
+		else
+			parse_prefix(optarg, mr);
 		*flags |= XT_DNETMAP_PREFIX;
 		tginfo->flags |= XT_DNETMAP_PREFIX;
 		return 1;
@@ -176,15 +217,46 @@ static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
 	}
 }
 
-static void DNETMAP_print_addr(const void *ip,
-			       const struct xt_entry_target *target,
-			       int numeric)
+static int DNETMAP_parse4(int c, char **argv, int invert, unsigned int *flags,
+			  const void *entry, struct xt_entry_target **target)
+{
+	return DNETMAP_parse(c, invert, flags, (void *)(*target)->data,
+	       NFPROTO_IPV4);
+}
+
+static int DNETMAP_parse6(int c, char **argv, int invert, unsigned int *flags,
+			  const void *entry, struct xt_entry_target **target)
+{
+	return DNETMAP_parse(c, invert, flags, (void *)(*target)->data,
+	       NFPROTO_IPV6);
+}
+
+static void DNETMAP_print_addr6(const struct nf_nat_range *r)
+{
+	int bits = 0, n, i;
+
+	for (i = 0; i < 4; ++i) {
+		n = netmask2bits(~(r->min_addr.ip6[i] ^ r->max_addr.ip6[i]));
+		if (n < 0)
+			break;
+		bits += n;
+		if (n < 32)
+			break;
+	}
+	printf("%s/%d", xtables_ip6addr_to_numeric(&r->min_addr.in6), bits);
+}
+
+static void DNETMAP_print_addr(const struct xt_DNETMAP_tginfo *tginfo,
+			       uint8_t nfproto)
 {
-	struct xt_DNETMAP_tginfo *tginfo = (void *)&target->data;
 	const struct nf_nat_range *r = &tginfo->prefix;
 	struct in_addr a;
 	int bits;
 
+	if (nfproto == NFPROTO_IPV6) {
+		DNETMAP_print_addr6(r);
+		return;
+	}
 	a = r->min_addr.in;
 	printf("%s", xtables_ipaddr_to_numeric(&a));
 	a.s_addr = ~(r->min_addr.ip ^ r->max_addr.ip);
@@ -195,14 +267,14 @@ static void DNETMAP_print_addr(const void *ip,
 		printf("/%d", bits);
 }
 
-static void DNETMAP_save(const void *ip, const struct xt_entry_target *target)
+static void DNETMAP_save(const struct xt_DNETMAP_tginfo *tginfo,
+			 uint8_t nfproto)
 {
-	struct xt_DNETMAP_tginfo *tginfo = (void *)&target->data;
 	const __u8 *flags = &tginfo->flags;
 
 	if (*flags & XT_DNETMAP_PREFIX) {
 		printf(" --%s ", DNETMAP_opts[0].name);
-		DNETMAP_print_addr(ip, target, 0);
+		DNETMAP_print_addr(tginfo, nfproto);
 	}
 
 	if (*flags & XT_DNETMAP_REUSE)
@@ -219,27 +291,61 @@ static void DNETMAP_save(const void *ip, const struct xt_entry_target *target)
 		printf(" --ttl %i ", tginfo->ttl);
 }
 
-static void DNETMAP_print(const void *ip, const struct xt_entry_target *target,
-			  int numeric)
+static void DNETMAP_save4(const void *ip, const struct xt_entry_target *target)
+{
+	DNETMAP_save((const void *)target->data, NFPROTO_IPV4);
+}
+
+static void DNETMAP_save6(const void *ip, const struct xt_entry_target *target)
+{
+	DNETMAP_save((const void *)target->data, NFPROTO_IPV6);
+}
+
+static void DNETMAP_print4(const void *ip, const struct xt_entry_target *target,
+			   int numeric)
+{
+	printf(" -j DNETMAP");
+	DNETMAP_save4(ip, target);
+}
+
+static void DNETMAP_print6(const void *ip, const struct xt_entry_target *target,
+			   int numeric)
 {
 	printf(" -j DNETMAP");
-	DNETMAP_save(ip, target);
-}
-
-static struct xtables_target dnetmap_tg_reg = {
-	.name          = MODULENAME,
-	.version       = XTABLES_VERSION,
-	.family        = NFPROTO_IPV4,
-	.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
-	.userspacesize = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
-	.help          = DNETMAP_help,
-	.parse         = DNETMAP_parse,
-	.print         = DNETMAP_print,
-	.save          = DNETMAP_save,
-	.extra_opts    = DNETMAP_opts,
+	DNETMAP_save6(ip, target);
+}
+
+static struct xtables_target dnetmap_tg_reg[] = {
+	{
+		.name          = MODULENAME,
+		.version       = XTABLES_VERSION,
+		.revision      = 1,
+		.family        = NFPROTO_IPV4,
+		.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.userspacesize = offsetof(struct xt_DNETMAP_tginfo, p),
+		.help          = DNETMAP_help,
+		.parse         = DNETMAP_parse4,
+		.print         = DNETMAP_print4,
+		.save          = DNETMAP_save4,
+		.extra_opts    = DNETMAP_opts,
+	},
+	{
+		.name          = MODULENAME,
+		.version       = XTABLES_VERSION,
+		.revision      = 1,
+		.family        = NFPROTO_IPV6,
+		.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.userspacesize = offsetof(struct xt_DNETMAP_tginfo, p),
+		.help          = DNETMAP_help,
+		.parse         = DNETMAP_parse6,
+		.print         = DNETMAP_print6,
+		.save          = DNETMAP_save6,
+		.extra_opts    = DNETMAP_opts,
+	},
 };
 
 static void _init(void)
 {
-	xtables_register_target(&dnetmap_tg_reg);
+	xtables_register_targets(dnetmap_tg_reg,
+		sizeof(dnetmap_tg_reg) / sizeof(*dnetmap_tg_reg));
 }
@@ -7,6 +7,7 @@
  *	Free Software Foundation.
  */
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <getopt.h>
@@ -20,12 +21,18 @@ enum {
 	F_TARPIT   = 1 << 0,
 	F_HONEYPOT = 1 << 1,
 	F_RESET    = 1 << 2,
+	F_LIMIT    = 1 << 3,
+	F_BURST    = 1 << 4,
+	F_SRCMASK  = 1 << 5,
 };
 
 static const struct option tarpit_tg_opts[] = {
-	{.name = "tarpit",   .has_arg = false, .val = 't'},
-	{.name = "honeypot", .has_arg = false, .val = 'h'},
-	{.name = "reset",    .has_arg = false, .val = 'r'},
+	{.name = "tarpit",        .has_arg = false, .val = 't'},
+	{.name = "honeypot",      .has_arg = false, .val = 'h'},
+	{.name = "reset",         .has_arg = false, .val = 'r'},
+	{.name = "reply-limit",   .has_arg = true,  .val = 'l'},
+	{.name = "reply-burst",   .has_arg = true,  .val = 'b'},
+	{.name = "reply-srcmask", .has_arg = true,  .val = 'm'},
 	{NULL},
 };
 
@@ -35,13 +42,17 @@ static void tarpit_tg_help(void)
 		"TARPIT target options:\n"
 		"  --tarpit      Enable classic 0-window tarpit (default)\n"
 		"  --honeypot    Enable honeypot option\n"
-		"  --reset       Enable inline resets\n");
+		"  --reset       Enable inline resets\n"
+		"  --reply-limit rate     Send at most rate replies per second and CPU\n"
+		"  --reply-burst n        Replies that can be sent at once (default: rate)\n"
+		"  --reply-srcmask len    Keep a budget per source prefix of that length\n");
 }
 
 static int tarpit_tg_parse(int c, char **argv, int invert, unsigned int *flags,
                            const void *entry, struct xt_entry_target **target)
 {
 	struct xt_tarpit_tginfo *info = (void *)(*target)->data;
+	unsigned int n;
 
 	switch (c) {
 	case 't':
@@ -56,15 +67,47 @@ static int tarpit_tg_parse(int c, char **argv, int invert, unsigned int *flags,
 		info->variant = XTTARPIT_RESET;
 		*flags |= F_RESET;
 		return true;
+	case 'l':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--reply-limit",
+			*flags & F_LIMIT);
+		if (!xtables_strtoui(optarg, NULL, &n, 1, UINT32_MAX))
+			xtables_param_act(XTF_BAD_VALUE, "TARPIT",
+				"--reply-limit", optarg);
+		info->rate = n;
+		*flags |= F_LIMIT;
+		return true;
+	case 'b':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--reply-burst",
+			*flags & F_BURST);
+		if (!xtables_strtoui(optarg, NULL, &n, 1, UINT32_MAX))
+			xtables_param_act(XTF_BAD_VALUE, "TARPIT",
+				"--reply-burst", optarg);
+		info->burst = n;
+		*flags |= F_BURST;
+		return true;
+	case 'm':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--reply-srcmask",
+			*flags & F_SRCMASK);
+		if (!xtables_strtoui(optarg, NULL, &n, 0, 128))
+			xtables_param_act(XTF_BAD_VALUE, "TARPIT",
+				"--reply-srcmask", optarg);
+		info->srcmask = n;
+		*flags |= F_SRCMASK;
+		return true;
 	}
 	return false;
 }
 
 static void tarpit_tg_check(unsigned int flags)
 {
-	if (flags == (F_TARPIT | F_HONEYPOT | F_RESET))
+	if ((flags & (F_TARPIT | F_HONEYPOT | F_RESET)) ==
+	    (F_TARPIT | F_HONEYPOT | F_RESET))
 		xtables_error(PARAMETER_PROBLEM,
 			"TARPIT: only one action can be used at a time");
+	if ((flags & (F_BURST | F_SRCMASK)) && !(flags & F_LIMIT))
+		xtables_error(PARAMETER_PROBLEM,
+			"TARPIT: --reply-burst and --reply-srcmask need "
+			"--reply-limit");
 }
 
 static void tarpit_tg_save(const void *ip,
@@ -83,6 +126,12 @@ static void tarpit_tg_save(const void *ip,
 		printf(" --reset ");
 		break;
 	}
+	if (info->rate != 0)
+		printf(" --reply-limit %u ", info->rate);
+	if (info->burst != 0)
+		printf(" --reply-burst %u ", info->burst);
+	if (info->srcmask != 0)
+		printf(" --reply-srcmask %u ", info->srcmask);
 }
 
 static void tarpit_tg_print(const void *ip,
@@ -95,9 +144,10 @@ static void tarpit_tg_print(const void *ip,
 static struct xtables_target tarpit_tg_reg = {
 	.version       = XTABLES_VERSION,
 	.name          = "TARPIT",
+	.revision      = 1,
 	.family        = NFPROTO_UNSPEC,
 	.size          = XT_ALIGN(sizeof(struct xt_tarpit_tginfo)),
-	.userspacesize = XT_ALIGN(sizeof(struct xt_tarpit_tginfo)),
+	.userspacesize = offsetof(struct xt_tarpit_tginfo, limit),
 	.help          = tarpit_tg_help,
 	.parse         = tarpit_tg_parse,
 	.final_check   = tarpit_tg_check,
@@ -9,6 +9,7 @@
  *	Free Software Foundation.
  */
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <netdb.h>
 #include <string.h>
@@ -20,6 +21,13 @@
 #include "compat_user.h"
 #define param_act(t, s, f) xtables_param_act((t), "ipp2p", (s), (f))
 
+enum {
+	FL_CACHE_MASK    = 1 << 16,
+	FL_CACHE_PACKETS = 1 << 17,
+	FL_MAX_BYTES     = 1 << 18,
+	FL_PROTOCOLS     = FL_CACHE_MASK - 1,
+};
+
 static void ipp2p_mt_help(void)
 {
 	printf(
@@ -37,6 +45,11 @@ static void ipp2p_mt_help(void)
 	"  --mute   [tcp]      All known Mute packets\n"
 	"  --waste  [tcp]      All known Waste packets\n"
 	"  --xdcc   [tcp]      All known XDCC packets (only xdcc login)\n\n"
+	"Verdict caching:\n"
+	"  --cache-mask value  Remember the verdict of a flow in these connmark bits\n"
+	"  --cache-packets n   Inspect at most n payload packets per flow (default 8)\n\n"
+	"Inspection limit:\n"
+	"  --max-bytes n       Inspect at most n payload bytes per packet\n\n"
 	, IPP2P_VERSION);
 }
 
@@ -54,6 +67,9 @@ static const struct option ipp2p_mt_opts[] = {
 	{.name = "waste", .has_arg = false, .val = 'h'},
 	{.name = "xdcc",  .has_arg = false, .val = 'i'},
 	{.name = "debug", .has_arg = false, .val = 'j'},
+	{.name = "cache-mask",    .has_arg = true, .val = 'k'},
+	{.name = "cache-packets", .has_arg = true, .val = 'l'},
+	{.name = "max-bytes",     .has_arg = true, .val = 'm'},
 	{NULL},
 };
 
@@ -61,6 +77,7 @@ static int ipp2p_mt_parse(int c, char **argv, int invert, unsigned int *flags,
                           const void *entry, struct xt_entry_match **match)
 {
 	struct ipt_p2p_info *info = (struct ipt_p2p_info *)(*match)->data;
+	unsigned int value;
 
 	switch (c) {
 	case '2':		/*cmd: edk*/
@@ -165,6 +182,35 @@ static int ipp2p_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 		info->debug = 1;
 		break;
 
+	case 'k':		/*cmd: cache-mask*/
+		param_act(XTF_ONLY_ONCE, "--cache-mask", *flags & FL_CACHE_MASK);
+		param_act(XTF_NO_INVERT, "--cache-mask", invert);
+		if (!xtables_strtoui(optarg, NULL, &value, 1, ~0U))
+			param_act(XTF_BAD_VALUE, "--cache-mask", optarg);
+		*flags |= FL_CACHE_MASK;
+		info->cache_mask = value;
+		if (!(*flags & FL_CACHE_PACKETS))
+			info->cache_packets = 8;
+		break;
+
+	case 'l':		/*cmd: cache-packets*/
+		param_act(XTF_ONLY_ONCE, "--cache-packets", *flags & FL_CACHE_PACKETS);
+		param_act(XTF_NO_INVERT, "--cache-packets", invert);
+		if (!xtables_strtoui(optarg, NULL, &value, 1, ~0U))
+			param_act(XTF_BAD_VALUE, "--cache-packets", optarg);
+		*flags |= FL_CACHE_PACKETS;
+		info->cache_packets = value;
+		break;
+
+	case 'm':		/*cmd: max-bytes*/
+		param_act(XTF_ONLY_ONCE, "--max-bytes", *flags & FL_MAX_BYTES);
+		param_act(XTF_NO_INVERT, "--max-bytes", invert);
+		if (!xtables_strtoui(optarg, NULL, &value, 1, ~0U))
+			param_act(XTF_BAD_VALUE, "--max-bytes", optarg);
+		*flags |= FL_MAX_BYTES;
+		info->max_bytes = value;
+		break;
+
 	default:
 //		xtables_error(PARAMETER_PROBLEM,
 //		"\nipp2p-parameter problem: for ipp2p usage type: iptables -m ipp2p --help\n");
@@ -175,9 +221,12 @@ static int ipp2p_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 
 static void ipp2p_mt_check(unsigned int flags)
 {
-	if (!flags)
+	if (!(flags & FL_PROTOCOLS))
 		xtables_error(PARAMETER_PROBLEM,
 			"\nipp2p-parameter problem: for ipp2p usage type: iptables -m ipp2p --help\n");
+	if ((flags & FL_CACHE_PACKETS) && !(flags & FL_CACHE_MASK))
+		xtables_error(PARAMETER_PROBLEM,
+			"ipp2p: --cache-packets requires --cache-mask");
 }
 
 static const char *const ipp2p_cmds[] = {
@@ -212,6 +261,11 @@ ipp2p_mt_print1(const void *entry, const struct xt_entry_match *match,
 
 	if (info->debug != 0)
 		printf(" --debug ");
+	if (info->cache_mask != 0)
+		printf(" --cache-mask 0x%x --cache-packets %u ",
+		       info->cache_mask, info->cache_packets);
+	if (info->max_bytes != 0)
+		printf(" --max-bytes %u ", info->max_bytes);
 }
 
 static void ipp2p_mt_print(const void *entry,
@@ -229,10 +283,10 @@ static void ipp2p_mt_save(const void *entry, const struct xt_entry_match *match)
 static struct xtables_match ipp2p_mt_reg = {
 	.version       = XTABLES_VERSION,
 	.name          = "ipp2p",
-	.revision      = 1,
+	.revision      = 2,
 	.family        = NFPROTO_UNSPEC,
 	.size          = XT_ALIGN(sizeof(struct ipt_p2p_info)),
-	.userspacesize = XT_ALIGN(sizeof(struct ipt_p2p_info)),
+	.userspacesize = offsetof(struct ipt_p2p_info, matcher),
 	.help          = ipp2p_mt_help,
 	.parse         = ipp2p_mt_parse,
 	.final_check   = ipp2p_mt_check,
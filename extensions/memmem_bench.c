@@ -0,0 +1,201 @@
+/*
+ *	memmem_bench - time HX_memmem over packet-sized payloads
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License, either
+ *	version 2 of the License, or any later version.
+ *
+ *	Compares compat_memmem (the code behind HX_memmem) against the former
+ *	byte-by-byte memcmp loop and the C library's memmem, on random text
+ *	payloads of (by default) 1500 bytes, some of which contain the needle.
+ *	All three must agree on every payload.
+ */
+#define _GNU_SOURCE 1
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "compat_memmem.h"
+
+typedef void *(*memmem_fn)(const void *, size_t, const void *, size_t);
+
+static void *naive_memmem(const void *space, size_t spacesize,
+    const void *point, size_t pointsize)
+{
+	size_t i;
+
+	if (pointsize > spacesize)
+		return NULL;
+	for (i = 0; i <= spacesize - pointsize; ++i)
+		if (memcmp(space + i, point, pointsize) == 0)
+			return (void *)space + i;
+	return NULL;
+}
+
+static void *libc_memmem(const void *space, size_t spacesize,
+    const void *point, size_t pointsize)
+{
+	return memmem(space, spacesize, point, pointsize);
+}
+
+static void *fast_memmem(const void *space, size_t spacesize,
+    const void *point, size_t pointsize)
+{
+	return compat_memmem(space, spacesize, point, pointsize);
+}
+
+static const struct {
+	const char *name;
+	memmem_fn fn;
+} mb_impl[] = {
+	{"naive",  naive_memmem},
+	{"compat", fast_memmem},
+	{"libc",   libc_memmem},
+};
+
+/* what xt_ipp2p looks for, plus a short and a long one */
+static const char *const mb_needles[] = {
+	"info_hash=", "peer_id=", "passkey=", "&", "X-Gnutella-Content-URN:",
+};
+
+static unsigned int mb_count = 1000, mb_length = 1500, mb_rounds = 200;
+static unsigned int mb_percent = 25;
+
+/* HTTP-ish text: letters, digits and a few separators */
+static unsigned char *make_payloads(void)
+{
+	static const char alphabet[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"0123456789/&=?.:-_ \r\n";
+	unsigned char *buf = malloc((size_t)mb_count * mb_length);
+	size_t i;
+
+	if (buf == NULL)
+		return NULL;
+	for (i = 0; i < (size_t)mb_count * mb_length; ++i)
+		buf[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+	return buf;
+}
+
+static void plant(unsigned char *buf, const char *needle)
+{
+	size_t len = strlen(needle);
+	unsigned int i;
+
+	for (i = 0; i < mb_count; ++i) {
+		if ((unsigned int)rand() % 100 >= mb_percent ||
+		    len > mb_length)
+			continue;
+		memcpy(buf + (size_t)i * mb_length +
+		       rand() % (mb_length - len + 1), needle, len);
+	}
+}
+
+static bool verify(const unsigned char *buf, const char *needle)
+{
+	size_t len = strlen(needle);
+	unsigned int i, j;
+
+	for (i = 0; i < mb_count; ++i) {
+		const unsigned char *p = buf + (size_t)i * mb_length;
+		void *want = naive_memmem(p, mb_length, needle, len);
+
+		for (j = 1; j < sizeof(mb_impl) / sizeof(*mb_impl); ++j) {
+			if (mb_impl[j].fn(p, mb_length, needle, len) == want)
+				continue;
+			fprintf(stderr, "%s disagrees on payload %u, "
+			        "needle \"%s\"\n", mb_impl[j].name, i, needle);
+			return false;
+		}
+	}
+	return true;
+}
+
+static double run(memmem_fn fn, const unsigned char *buf, const char *needle)
+{
+	struct timespec start, stop;
+	size_t len = strlen(needle);
+	unsigned int round, i, found = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < mb_rounds; ++round)
+		for (i = 0; i < mb_count; ++i)
+			found += fn(buf + (size_t)i * mb_length, mb_length,
+			        needle, len) != NULL;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	/* keep the calls from being optimized out */
+	if (found == ~0U)
+		printf("\n");
+	return ((stop.tv_sec - start.tv_sec) * 1e9 +
+	       (stop.tv_nsec - start.tv_nsec)) / mb_rounds / mb_count;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+	"Usage: %s [-c payloads] [-l length] [-n rounds] [-p percent]\n"
+	"  -c payloads  Number of payloads (default 1000)\n"
+	"  -l length    Payload length (default 1500)\n"
+	"  -n rounds    Passes over all payloads (default 200)\n"
+	"  -p percent   Share of payloads containing the needle (default 25)\n",
+	argv0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *buf;
+	unsigned int i, j;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:l:n:p:")) != -1) {
+		switch (c) {
+		case 'c':
+			mb_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			mb_length = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			mb_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			mb_percent = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(*argv);
+			return EXIT_FAILURE;
+		}
+	}
+	if (mb_count == 0 || mb_length == 0 || mb_rounds == 0) {
+		usage(*argv);
+		return EXIT_FAILURE;
+	}
+
+	printf("%u payloads of %u bytes, %u%% with the needle, "
+	       "ns per call:\n%-26s", mb_count, mb_length, mb_percent, "");
+	for (j = 0; j < sizeof(mb_impl) / sizeof(*mb_impl); ++j)
+		printf(" %10s", mb_impl[j].name);
+	printf("\n");
+
+	for (i = 0; i < sizeof(mb_needles) / sizeof(*mb_needles); ++i) {
+		srand(i);
+		buf = make_payloads();
+		if (buf == NULL) {
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+		plant(buf, mb_needles[i]);
+		if (!verify(buf, mb_needles[i])) {
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		printf("%-26s", mb_needles[i]);
+		for (j = 0; j < sizeof(mb_impl) / sizeof(*mb_impl); ++j)
+			printf(" %10.1f", run(mb_impl[j].fn, buf, mb_needles[i]));
+		printf("\n");
+		free(buf);
+	}
+	return EXIT_SUCCESS;
+}
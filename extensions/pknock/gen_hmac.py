@@ -6,12 +6,19 @@ import struct
 import socket
 from time import time
 
-def gen_hmac(secret, ip):
+def gen_hmac(secret, ip, nonce = ''):
     epoch_mins = (long)(time()/60)
     s = hmac.HMAC(secret, digestmod = SHA256)
-    s.update(socket.inet_aton(socket.gethostbyname(ip)))
+    if ':' in ip:
+        s.update(socket.inet_pton(socket.AF_INET6, ip))
+    else:
+        s.update(socket.inet_aton(socket.gethostbyname(ip)))
     s.update(struct.pack("i", epoch_mins)) # "i" is for integer
-    print s.hexdigest()
+    if nonce:
+        s.update(nonce)
+        print s.hexdigest() + ':' + nonce
+    else:
+        print s.hexdigest()
 
 if __name__ == '__main__':
-	gen_hmac(sys.argv[1], sys.argv[2])
+	gen_hmac(*sys.argv[1:4])
@@ -1,6 +1,10 @@
 #!/bin/bash
-if [ "$#" -ne 4 ]; then
-    echo "usage: $0 <IP src> <IP dst> <PORT dst> <secret>"
+if [ "$#" -ne 4 -a "$#" -ne 5 ]; then
+    echo "usage: $0 <IP src> <IP dst> <PORT dst> <secret> [nonce]"
     exit 1
 fi
-python gen_hmac.py "$4" "$1" | socat - "udp-sendto:$2:$3,bind=$1"
+case "$2" in
+*:*) dest="udp6-sendto:[$2]:$3,bind=[$1]";;
+*)   dest="udp-sendto:$2:$3,bind=$1";;
+esac
+python gen_hmac.py "$4" "$1" "$5" | socat - "$dest"
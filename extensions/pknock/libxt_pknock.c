@@ -8,6 +8,7 @@
  * This program is released under the terms of GNU GPL version 2.
  */
 #include <getopt.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -327,10 +328,10 @@ static void pknock_mt_save(const void *ip, const struct xt_entry_match *match)
 static struct xtables_match pknock_mt_reg = {
 	.name		= "pknock",
 	.version	= XTABLES_VERSION,
-	.revision      = 1,
-	.family        = NFPROTO_IPV4,
+	.revision      = 2,
+	.family        = NFPROTO_UNSPEC,
 	.size          = XT_ALIGN(sizeof(struct xt_pknock_mtinfo)),
-	.userspacesize = XT_ALIGN(sizeof(struct xt_pknock_mtinfo)),
+	.userspacesize = offsetof(struct xt_pknock_mtinfo, hmac),
 	.help          = pknock_mt_help,
 	.parse         = pknock_mt_parse,
 	.final_check   = pknock_mt_check,
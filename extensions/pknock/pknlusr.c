@@ -1,5 +1,7 @@
+#define _GNU_SOURCE 1
 #include <sys/socket.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,34 +20,119 @@
 #define MAX_GROUP_ID \
 	(sizeof((struct sockaddr_nl){0}.nl_groups) * CHAR_BIT)
 
+enum {
+	/* messages per recvmmsg() */
+	RECV_BATCH = 16,
+	RECV_BUF_SIZE = NLMSG_SPACE(sizeof(struct cn_msg) +
+	                XT_PKNOCK_NL_BATCH * sizeof(struct xt_pknock_nl_msg)),
+	/* asked for, the kernel caps it at net.core.rmem_max */
+	RCVBUF_SIZE = 1 << 20,
+};
+
+static bool machine_output;
+
+static void usage(const char *argv0)
+{
+	char *prog = strdup(argv0);
+
+	if (prog == NULL) {
+		perror("strdup()");
+		return;
+	}
+	fprintf(stderr, "%s [ -m ] [ group-id ]\n", basename(prog));
+	free(prog);
+}
+
+static void print_event(const struct xt_pknock_nl_msg *msg)
+{
+	char ipbuf[INET6_ADDRSTRLEN], name[sizeof(msg->rule_name)+1];
+	const char *ip;
+
+	if (msg->peer_ip != 0)
+		ip = inet_ntop(AF_INET, &msg->peer_ip, ipbuf, sizeof(ipbuf));
+	else
+		ip = inet_ntop(AF_INET6, msg->peer_ip6, ipbuf, sizeof(ipbuf));
+	memcpy(name, msg->rule_name, sizeof(msg->rule_name));
+	name[sizeof(msg->rule_name)] = '\0';
+	if (machine_output)
+		printf("knock\t%s\t%s\n", name, ip);
+	else
+		printf("rule_name: %s - ip %s\n", name, ip);
+}
+
+static void print_lost(unsigned int count)
+{
+	if (machine_output)
+		printf("lost\t%u\n", count);
+	else
+		fprintf(stderr, "%u events lost in the kernel\n", count);
+}
+
+static void print_overrun(void)
+{
+	if (machine_output)
+		printf("overrun\n");
+	else
+		fprintf(stderr, "receive buffer overrun, events lost\n");
+}
+
+/* One datagram: netlink messages of a cn_msg with a batch of events each */
+static void handle_datagram(const void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh;
+	const struct cn_msg *cn_msg;
+	const struct xt_pknock_nl_msg *ev;
+	unsigned int i;
+
+	for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn_msg)))
+			continue;
+		cn_msg = NLMSG_DATA(nlh);
+		if (cn_msg->len > nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*cn_msg)))
+			continue;
+		if (cn_msg->id.idx != XT_PKNOCK_CN_IDX ||
+		    cn_msg->id.val != XT_PKNOCK_CN_VAL)
+			continue;
+		if (cn_msg->ack != 0)
+			print_lost(cn_msg->ack);
+		ev = (const void *)cn_msg->data;
+		for (i = 0; i < cn_msg->len / sizeof(*ev); ++i)
+			print_event(&ev[i]);
+	}
+}
+
 int main(int argc, char **argv)
 {
-	int status;
+	static char bufs[RECV_BATCH][RECV_BUF_SIZE];
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	int status, c, i;
 	unsigned int group_id = DEFAULT_GROUP_ID;
 	struct sockaddr_nl local_addr = {.nl_family = AF_NETLINK};
-	int sock_fd;
-	size_t nlmsg_size;
-	struct nlmgrhdr *nlmsg;
-	struct cn_msg *cn_msg;
-	struct xt_pknock_nl_msg *pknock_msg;
-
-	if (argc > 2) {
-		char *prog = strdup(argv[0]);
-		if (prog == NULL) {
-			perror("strdup()");
-		} else {
-			fprintf(stderr, "%s [ group-id ]\n", basename(prog));
-			free(prog);
+	int sock_fd, rcvbuf = RCVBUF_SIZE;
+
+	while ((c = getopt(argc, argv, "m")) != -1) {
+		switch (c) {
+		case 'm':
+			machine_output = true;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	if (argc - optind > 1) {
+		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	if (argc == 2) {
+	if (argc - optind == 1) {
 		long n;
 		char *end;
 
 		errno = 0;
-		n = strtol(argv[1], &end, 10);
+		n = strtol(argv[optind], &end, 10);
 		if (*end || (errno && (n == LONG_MIN || n == LONG_MAX)) ||
 		    n < MIN_GROUP_ID || n > MAX_GROUP_ID) {
 			fputs("Group ID invalid.\n", stderr);
@@ -59,6 +146,8 @@ int main(int argc, char **argv)
 		perror("socket()");
 		exit(EXIT_FAILURE);
 	}
+	/* Best effort; bursts beyond it show up as overruns. */
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
 	local_addr.nl_groups = 1U << (group_id - 1);
 	status = bind(sock_fd, (struct sockaddr *)&local_addr, sizeof(local_addr));
@@ -67,33 +156,36 @@ int main(int argc, char **argv)
 		goto err_close_sock;
 	}
 
-	nlmsg_size = NLMSG_SPACE(sizeof(*cn_msg) + sizeof(*pknock_msg));
-	nlmsg = malloc(nlmsg_size);
-	if (!nlmsg) {
-		perror("malloc()");
-		goto err_close_sock;
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RECV_BATCH; ++i) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len  = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	while(1) {
-		const char *ip;
-		char ipbuf[INET_ADDRSTRLEN];
-
-		memset(nlmsg, 0, nlmsg_size);
-		status = recv(sock_fd, nlmsg, nlmsg_size, 0);
+	while (1) {
+		/* Waits for one message, then takes what else is queued. */
+		status = recvmmsg(sock_fd, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
 		if (status < 0) {
-			perror("recv()");
-			goto err_free_msg;
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				print_overrun();
+				fflush(stdout);
+				continue;
+			}
+			perror("recvmmsg()");
+			goto err_close_sock;
 		}
-		if (status == 0)
-			break;
-		cn_msg = NLMSG_DATA(nlmsg);
-		pknock_msg = (struct xt_pknock_nl_msg *)(cn_msg->data);
-		ip = inet_ntop(AF_INET, &pknock_msg->peer_ip, ipbuf, sizeof(ipbuf));
-		printf("rule_name: %s - ip %s\n", pknock_msg->rule_name, ip);
+		for (i = 0; i < status; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				fputs("truncated message\n", stderr);
+			handle_datagram(bufs[i], msgs[i].msg_len);
+		}
+		fflush(stdout);
 	}
 
-err_free_msg:
-	free(nlmsg);
 err_close_sock:
 	close(sock_fd);
 	exit(status == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
@@ -11,24 +11,31 @@
 #include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/in.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
 #include <linux/spinlock.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
-#include <linux/proc_fs.h>
-#include <linux/spinlock.h>
 #include <linux/jiffies.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
 #include <linux/seq_file.h>
-#include <linux/connector.h>
 #include <linux/netfilter/x_tables.h>
+#include <net/ipv6.h>
+#include <crypto/algapi.h>
 #include <crypto/hash.h>
 #include "xt_pknock.h"
 #include "compat_xtables.h"
+#if IS_ENABLED(CONFIG_CONNECTOR)
+#	include "compat_cnbatch.h"
+#endif
 
 enum status {
 	ST_INIT = 1,
@@ -37,12 +44,18 @@ enum status {
 };
 
 /**
+ * Peers are looked up under RCU and changed under their rule's lock.
+ *
+ * @gc_node:	in the rule's expiry wheel, unless the peer never expires
+ * @addr:	IPv4 peers are stored as v4-mapped addresses
  * @timestamp:	seconds, but not since epoch (uses jiffies/HZ)
  * @login_sec: seconds at login since the epoch
  */
 struct peer {
-	struct list_head head;
-	__be32 ip;
+	struct rhash_head node;
+	struct rcu_head rcu;
+	struct list_head gc_node;
+	struct in6_addr addr;
 	uint32_t accepted_knock_count;
 	unsigned long timestamp;
 	unsigned long login_sec;
@@ -51,75 +64,143 @@ struct peer {
 };
 
 /**
- * @timer:	garbage collector timer
+ * An SPA token already used. Only tokens of the current minute pass the
+ * HMAC check, so a slot of any other minute is free.
+ *
+ * @minute:	minutes since the epoch the token was made for
+ * @digest:	leading bytes of its HMAC
+ */
+struct spa_token {
+	uint32_t minute;
+	uint8_t digest[16];
+};
+
+enum {
+	PKNOCK_GC_SLOTS = 64,
+	PKNOCK_GC_BATCH = 64,
+};
+
+/**
+ * @lock:	serializes peer updates, token use and the expiry wheel
+ * @gc_work:	garbage collector, runs when the next wheel slot is due
+ * @gc_wheel:	peers by the second (jiffies/HZ) they expire, modulo
+ *		PKNOCK_GC_SLOTS; later ones wait in the farthest slot
+ * @gc_next:	second of the next slot to expire
+ * @gc_when:	second @gc_work is queued for, if @gc_armed
+ * @gc_peers:	peers in the wheel
+ * @peers:	peers by IP address
  * @max_time:	max matching time between ports
+ * @tokens:	open-addressed set of 2 * spa_tokens slots
+ * @tokens_minute: minute of the tokens in the set
+ * @tokens_used:	tokens recorded during @tokens_minute
  */
 struct xt_pknock_rule {
 	struct list_head head;
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	int rule_name_len;
 	unsigned int ref_count;
-	struct timer_list timer;
-	struct list_head *peer_head;
+	spinlock_t lock;
+	struct delayed_work gc_work;
+	struct list_head gc_wheel[PKNOCK_GC_SLOTS];
+	unsigned long gc_next, gc_when;
+	unsigned int gc_peers;
+	bool gc_armed;
+	struct rhashtable peers;
 	struct proc_dir_entry *status_proc;
 	unsigned long max_time;
 	unsigned long autoclose_time;
+	struct spa_token *tokens;
+	uint32_t tokens_minute;
+	unsigned int tokens_used;
+};
+
+/**
+ * Which secret, if any, an SPA packet carries.
+ */
+enum spa {
+	SPA_NONE = 0,
+	SPA_OPEN,
+	SPA_CLOSE,
 };
 
 /**
  * @port:	destination port
+ * @spa:	result of the HMAC check, done before taking the rule's lock
+ * @token:	for SPA packets, what to remember the token by
  */
 struct transport_data {
 	uint8_t proto;
 	uint16_t port;
 	int payload_len;
 	const unsigned char *payload;
+	enum spa spa;
+	struct spa_token token;
+};
+
+/**
+ * HMAC state of an SPA match, keyed with its secrets at checkentry.
+ *
+ * @open:	keyed with open_secret
+ * @close:	keyed with close_secret
+ * @desc:	per-CPU descriptors, large enough for either transform
+ * @size:	digest size
+ */
+struct xt_pknock_hmac {
+	struct crypto_shash *open, *close;
+	struct shash_desc __percpu *desc;
+	unsigned int size;
 };
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("J. Federico Hernandez Scarso, Luis A. Floreani");
 MODULE_DESCRIPTION("netfilter match for Port Knocking and SPA");
 MODULE_ALIAS("ipt_pknock");
+MODULE_ALIAS("ip6t_pknock");
 
 enum {
-	DEFAULT_GC_EXPIRATION_TIME = 65000, /* in msecs */
 	DEFAULT_RULE_HASH_SIZE  = 8,
 	DEFAULT_PEER_HASH_SIZE  = 16,
+	PKNOCK_MAX_DIGEST_SIZE  = 64,
+	PKNOCK_MAX_NONCE_LEN    = 32,
+	DEFAULT_SPA_TOKENS      = 128,
+	DEFAULT_NL_FLUSH_INTERVAL = 10, /* in msecs */
 };
 
-#define hashtable_for_each_safe(pos, n, head, size, i)	\
-	for ((i) = 0; (i) < (size); ++(i)) \
-		list_for_each_safe((pos), (n), (&head[(i)]))
-#define pk_debug(msg, peer) pr_debug("(S) peer: %pI4 - %s.\n", &((peer)->ip), msg)
+#define pk_debug(msg, peer) pr_debug("(S) peer: %pI6c - %s.\n", &((peer)->addr), msg)
 
 static uint32_t ipt_pknock_hash_rnd;
 static unsigned int rule_hashsize	= DEFAULT_RULE_HASH_SIZE;
 static unsigned int peer_hashsize	= DEFAULT_PEER_HASH_SIZE;
-static unsigned int gc_expir_time = DEFAULT_GC_EXPIRATION_TIME;
+static unsigned int spa_tokens		= DEFAULT_SPA_TOKENS;
 static int nl_multicast_group		= -1;
+static unsigned int nl_flush_interval	= DEFAULT_NL_FLUSH_INTERVAL;
 static struct list_head *rule_hashtable;
 static struct proc_dir_entry *pde;
-static DEFINE_SPINLOCK(list_lock);
+static DEFINE_MUTEX(list_lock);
 
-static struct {
-	const char *algo;
-	struct crypto_shash *tfm;
-	unsigned int size;
-	struct shash_desc desc;
-} crypto = {
-	.algo	= "hmac(sha256)",
-	.tfm	= NULL,
-	.size	= 0
+#if IS_ENABLED(CONFIG_CONNECTOR)
+static struct compat_cnbatch nl_batch;
+#endif
+
+static const char pknock_hmac_algo[] = "hmac(sha256)";
+
+static const struct rhashtable_params peer_params = {
+	.head_offset         = offsetof(struct peer, node),
+	.key_offset          = offsetof(struct peer, addr),
+	.key_len             = sizeof(struct in6_addr),
+	.automatic_shrinking = true,
 };
 
 module_param(rule_hashsize, int, S_IRUGO);
 MODULE_PARM_DESC(rule_hashsize, "Buckets in rule hash table (default: 8)");
 module_param(peer_hashsize, int, S_IRUGO);
-MODULE_PARM_DESC(peer_hashsize, "Buckets in peer hash table (default: 16)");
-module_param(gc_expir_time, int, S_IRUGO);
-MODULE_PARM_DESC(gc_expir_time, "Time until garbage collection after valid knock packet (default: 65000 msec)");
+MODULE_PARM_DESC(peer_hashsize, "Initial buckets in peer hash table (default: 16)");
+module_param(spa_tokens, uint, S_IRUGO);
+MODULE_PARM_DESC(spa_tokens, "SPA logins per rule and minute (default: 128)");
 module_param(nl_multicast_group, int, S_IRUGO);
 MODULE_PARM_DESC(nl_multicast_group, "Netlink multicast group number for pknock messages");
+module_param(nl_flush_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(nl_flush_interval, "Max delay of batched netlink messages, 0 to send each at once (default: 10 msec)");
 
 /**
  * Calculates a value from 0 to max from a hash of the arguments.
@@ -175,48 +256,47 @@ status_itoa(enum status status)
 
 /**
  * @s
- * @pos
- * @return: private value used by the iterator
- */
-static void *
-pknock_seq_start(struct seq_file *s, loff_t *pos)
-{
-	const struct xt_pknock_rule *rule = s->private;
-
-	spin_lock_bh(&list_lock);
-	if (*pos >= peer_hashsize)
-		return NULL;
-	return rule->peer_head + *pos;
-}
-
-/**
- * @s
- * @v
- * @pos
- * @return: next value for the iterator
- */
-static void *
-pknock_seq_next(struct seq_file *s, void *v, loff_t *pos)
-{
-	const struct xt_pknock_rule *rule = s->private;
-
-	++*pos;
-	if (*pos >= peer_hashsize)
-		return NULL;
-	return rule->peer_head + *pos;
-}
-
-/**
- * @s
- * @v
+ * @rule
+ * @peer
  */
 static void
-pknock_seq_stop(struct seq_file *s, void *v)
+pknock_seq_show_peer(struct seq_file *s, const struct xt_pknock_rule *rule,
+    const struct peer *peer)
 {
-	spin_unlock_bh(&list_lock);
+	unsigned long time;
+
+	if (ipv6_addr_v4mapped(&peer->addr))
+		seq_printf(s, "src=%pI4 ", &peer->addr.s6_addr32[3]);
+	else
+		seq_printf(s, "src=%pI6c ", &peer->addr);
+	seq_printf(s, "proto=%s ", (peer->proto == IPPROTO_TCP) ?
+                                        "TCP" : "UDP");
+	seq_printf(s, "status=%s ", status_itoa(peer->status));
+	seq_printf(s, "accepted_knock_count=%lu ",
+		(unsigned long)peer->accepted_knock_count);
+	if (peer->status == ST_MATCHING) {
+		time = 0;
+		if (time_before(jiffies / HZ, peer->timestamp +
+		    rule->max_time))
+			time = peer->timestamp + rule->max_time -
+			       jiffies / HZ;
+		seq_printf(s, "expir_time=%lu [secs] ", time);
+	}
+	if (peer->status == ST_ALLOWED && rule->autoclose_time != 0) {
+		unsigned long x = ktime_get_seconds();
+		unsigned long y = peer->login_sec + rule->autoclose_time * 60;
+		time = 0;
+		if (time_before(x, y))
+			time = y - x;
+		seq_printf(s, "autoclose_time=%lu [secs] ", time);
+	}
+	seq_printf(s, "\n");
 }
 
 /**
+ * Lists the peers of a rule. A resize of the table during the walk may
+ * show a peer twice.
+ *
  * @s
  * @v
  * @return: 0 if OK
@@ -224,49 +304,25 @@ pknock_seq_stop(struct seq_file *s, void *v)
 static int
 pknock_seq_show(struct seq_file *s, void *v)
 {
-	const struct list_head *pos, *n;
+	struct xt_pknock_rule *rule = s->private;
+	struct rhashtable_iter iter;
 	const struct peer *peer;
-	unsigned long time;
-	const struct list_head *peer_head = v;
-	const struct xt_pknock_rule *rule = s->private;
-
-	list_for_each_safe(pos, n, peer_head) {
-		peer = list_entry(pos, struct peer, head);
-		seq_printf(s, "src=%pI4 ", &peer->ip);
-		seq_printf(s, "proto=%s ", (peer->proto == IPPROTO_TCP) ?
-                                                "TCP" : "UDP");
-		seq_printf(s, "status=%s ", status_itoa(peer->status));
-		seq_printf(s, "accepted_knock_count=%lu ",
-			(unsigned long)peer->accepted_knock_count);
-		if (peer->status == ST_MATCHING) {
-			time = 0;
-			if (time_before(jiffies / HZ, peer->timestamp +
-			    rule->max_time))
-				time = peer->timestamp + rule->max_time -
-				       jiffies / HZ;
-			seq_printf(s, "expir_time=%lu [secs] ", time);
-		}
-		if (peer->status == ST_ALLOWED && rule->autoclose_time != 0) {
-			unsigned long x = ktime_get_seconds();
-			unsigned long y = peer->login_sec + rule->autoclose_time * 60;
-			time = 0;
-			if (time_before(x, y))
-				time = y - x;
-			seq_printf(s, "autoclose_time=%lu [secs] ", time);
+
+	rhashtable_walk_enter(&rule->peers, &iter);
+	rhashtable_walk_start(&iter);
+	while ((peer = rhashtable_walk_next(&iter)) != NULL) {
+		if (IS_ERR(peer)) {
+			if (PTR_ERR(peer) == -EAGAIN)
+				continue;
+			break;
 		}
-		seq_printf(s, "\n");
+		pknock_seq_show_peer(s, rule, peer);
 	}
-
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
 	return 0;
 }
 
-static const struct seq_operations pknock_seq_ops = {
-	.start = pknock_seq_start,
-	.next = pknock_seq_next,
-	.stop = pknock_seq_stop,
-	.show = pknock_seq_show
-};
-
 /**
  * @inode
  * @file
@@ -274,34 +330,16 @@ static const struct seq_operations pknock_seq_ops = {
 static int
 pknock_proc_open(struct inode *inode, struct file *file)
 {
-	int ret = seq_open(file, &pknock_seq_ops);
-	if (ret == 0) {
-		struct seq_file *sf = file->private_data;
-		sf->private = pde_data(inode);
-	}
-	return ret;
+	return single_open(file, pknock_seq_show, pde_data(inode));
 }
 
 static const struct proc_ops pknock_proc_ops = {
 	.proc_open    = pknock_proc_open,
 	.proc_read    = seq_read,
 	.proc_lseek   = seq_lseek,
-	.proc_release = seq_release,
+	.proc_release = single_release,
 };
 
-/**
- * It updates the rule timer to execute garbage collector.
- *
- * @rule
- */
-static void update_rule_gc_timer(struct xt_pknock_rule *rule)
-{
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
-	rule->timer.expires = jiffies + msecs_to_jiffies(gc_expir_time);
-	add_timer(&rule->timer);
-}
-
 /**
  * @peer
  * @autoclose_time
@@ -332,50 +370,152 @@ is_interknock_time_exceeded(const struct peer *peer, unsigned int max_time)
 }
 
 /**
+ * Whether the garbage collector may remove the peer: its (inter-knock)
+ * max_time or autoclose_time passed.
+ *
+ * @rule
  * @peer
- * @return: 1 has logged, 0 otherwise
  */
 static inline bool
-has_logged_during_this_minute(const struct peer *peer)
+peer_expired(const struct xt_pknock_rule *rule, const struct peer *peer)
+{
+	if (peer->status == ST_ALLOWED)
+		return autoclose_time_passed(peer, rule->autoclose_time);
+	return is_interknock_time_exceeded(peer, rule->max_time);
+}
+
+/**
+ * Queues the garbage collector for a second, unless it already is for an
+ * earlier one. Must be called with the rule's lock held.
+ *
+ * @rule
+ * @when: in jiffies/HZ
+ */
+static void arm_peer_gc(struct xt_pknock_rule *rule, unsigned long when)
+{
+	unsigned long now = jiffies;
+
+	if (rule->gc_armed && !time_after(rule->gc_when, when))
+		return;
+	rule->gc_armed = true;
+	rule->gc_when  = when;
+	mod_delayed_work(system_wq, &rule->gc_work,
+		time_after(when * HZ, now) ? when * HZ - now : 0);
+}
+
+/**
+ * (Re)files the peer in the expiry wheel, by the second it is due to
+ * expire. Must be called with the rule's lock held, after each change
+ * of the peer's status or times.
+ *
+ * @rule
+ * @peer
+ */
+static void schedule_peer_gc(struct xt_pknock_rule *rule, struct peer *peer)
+{
+	unsigned long now = jiffies / HZ, when;
+	long left;
+
+	if (peer->status != ST_ALLOWED) {
+		when = peer->timestamp + rule->max_time + 1;
+	} else if (rule->autoclose_time != 0) {
+		left = peer->login_sec + rule->autoclose_time * 60 -
+		       ktime_get_seconds();
+		when = now + max(left, 0L) + 1;
+	} else {
+		/* Stays until closed */
+		if (!list_empty(&peer->gc_node)) {
+			list_del_init(&peer->gc_node);
+			--rule->gc_peers;
+		}
+		return;
+	}
+
+	if (list_empty(&peer->gc_node)) {
+		if (rule->gc_peers++ == 0)
+			rule->gc_next = now;
+	} else {
+		list_del(&peer->gc_node);
+	}
+	if (time_before(when, rule->gc_next))
+		when = rule->gc_next;
+	else if (when - rule->gc_next >= PKNOCK_GC_SLOTS)
+		when = rule->gc_next + PKNOCK_GC_SLOTS - 1;
+	list_add_tail(&peer->gc_node, &rule->gc_wheel[when % PKNOCK_GC_SLOTS]);
+	arm_peer_gc(rule, when);
+}
+
+/**
+ * It removes a peer matching status. Must be called with the rule's lock
+ * held; lockless readers may still see the peer until a grace period has
+ * passed.
+ *
+ * @rule
+ * @peer
+ */
+static void remove_peer(struct xt_pknock_rule *rule, struct peer *peer)
 {
-	uint64_t x, y;
 	if (peer == NULL)
-		return 0;
-	x = ktime_get_seconds();
-	y = peer->login_sec;
-	return do_div(y, 60) == do_div(x, 60);
+		return;
+	if (rhashtable_remove_fast(&rule->peers, &peer->node, peer_params) != 0)
+		return;
+	if (!list_empty(&peer->gc_node)) {
+		list_del(&peer->gc_node);
+		--rule->gc_peers;
+	}
+	kfree_rcu(peer, rcu);
 }
 
 /**
- * Garbage collector. It removes the old entries after tis timers have expired.
+ * Garbage collector. It empties the wheel slots that are due, removing
+ * the peers whose timers have expired and refiling the others. The rule's
+ * lock is dropped every PKNOCK_GC_BATCH peers.
  *
- * @r: rule
+ * @work
  */
-static void peer_gc(struct timer_list *tl)
+static void peer_gc(struct work_struct *work)
 {
-	unsigned int i;
-	struct xt_pknock_rule *rule = from_timer(rule, tl, timer);
+	struct xt_pknock_rule *rule = container_of(to_delayed_work(work),
+	                              struct xt_pknock_rule, gc_work);
+	unsigned long now = jiffies / HZ;
 	struct peer *peer;
-	struct list_head *pos, *n;
+	unsigned int i, n = 0;
+	LIST_HEAD(due);
 
 	pr_debug("(S) running %s\n", __func__);
-	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
-		peer = list_entry(pos, struct peer, head);
-
-		/*
-		 * Remove any peer whose (inter-knock) max_time
-		 * or autoclose_time passed.
-		 */
-		if ((peer->status != ST_ALLOWED &&
-		    is_interknock_time_exceeded(peer, rule->max_time)) ||
-		    (peer->status == ST_ALLOWED &&
-		    autoclose_time_passed(peer, rule->autoclose_time)))
-		{
+	spin_lock_bh(&rule->lock);
+	rule->gc_armed = false;
+	for (i = 0; i < PKNOCK_GC_SLOTS && !time_after(rule->gc_next, now);
+	     ++i, ++rule->gc_next)
+		list_splice_tail_init(&rule->gc_wheel[rule->gc_next %
+		                      PKNOCK_GC_SLOTS], &due);
+	/* After a full turn, every slot has been emptied */
+	if (!time_after(rule->gc_next, now))
+		rule->gc_next = now + 1;
+
+	/* The packet path may refile or remove peers while we are unlocked. */
+	while (!list_empty(&due)) {
+		peer = list_first_entry(&due, struct peer, gc_node);
+		if (peer_expired(rule, peer)) {
 			pk_debug("GC-DELETED", peer);
-			list_del(pos);
-			kfree(peer);
+			remove_peer(rule, peer);
+		} else {
+			schedule_peer_gc(rule, peer);
+		}
+		if (++n % PKNOCK_GC_BATCH == 0) {
+			spin_unlock_bh(&rule->lock);
+			cond_resched();
+			spin_lock_bh(&rule->lock);
 		}
 	}
+
+	for (i = 0; i < PKNOCK_GC_SLOTS && rule->gc_peers != 0; ++i)
+		if (!list_empty(&rule->gc_wheel[(rule->gc_next + i) %
+		    PKNOCK_GC_SLOTS])) {
+			arm_peer_gc(rule, rule->gc_next + i);
+			break;
+		}
+	spin_unlock_bh(&rule->lock);
 }
 
 /**
@@ -392,28 +532,8 @@ rulecmp(const struct xt_pknock_mtinfo *info, const struct xt_pknock_rule *rule)
 }
 
 /**
- * Search the rule and returns a pointer if it exists.
- *
- * @info
- * @return: rule or NULL
- */
-static struct xt_pknock_rule *search_rule(const struct xt_pknock_mtinfo *info)
-{
-	struct xt_pknock_rule *rule;
-	struct list_head *pos, *n;
-	unsigned int hash = pknock_hash(info->rule_name, info->rule_name_len,
-					ipt_pknock_hash_rnd, rule_hashsize);
-
-	list_for_each_safe(pos, n, &rule_hashtable[hash]) {
-		rule = list_entry(pos, struct xt_pknock_rule, head);
-		if (rulecmp(info, rule))
-			return rule;
-	}
-	return NULL;
-}
-
-/**
- * It adds a rule to list only if it doesn't exist.
+ * It adds a rule to list only if it doesn't exist, and points the match
+ * at it.
  *
  * @info
  * @return: 1 success, 0 failure
@@ -421,16 +541,20 @@ static struct xt_pknock_rule *search_rule(const struct xt_pknock_mtinfo *info)
 static bool
 add_rule(struct xt_pknock_mtinfo *info)
 {
+	struct rhashtable_params params;
 	struct xt_pknock_rule *rule;
 	struct list_head *pos, *n;
+	unsigned int i;
 	unsigned int hash = pknock_hash(info->rule_name, info->rule_name_len,
                                 ipt_pknock_hash_rnd, rule_hashsize);
 
+	mutex_lock(&list_lock);
 	list_for_each_safe(pos, n, &rule_hashtable[hash]) {
 		rule = list_entry(pos, struct xt_pknock_rule, head);
 		if (!rulecmp(info, rule))
 			continue;
 		++rule->ref_count;
+		info->rule = rule;
 
 		if (info->option & XT_PKNOCK_OPENSECRET) {
 			rule->max_time       = info->max_time;
@@ -440,12 +564,13 @@ add_rule(struct xt_pknock_mtinfo *info)
 			pr_debug("add_rule() (AC) rule found: %s - "
 				"ref_count: %d\n",
 				rule->rule_name, rule->ref_count);
+		mutex_unlock(&list_lock);
 		return true;
 	}
 
 	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
 	if (rule == NULL)
-		return false;
+		goto out_unlock;
 
 	INIT_LIST_HEAD(&rule->head);
 	strncpy(rule->rule_name, info->rule_name, info->rule_name_len);
@@ -453,95 +578,91 @@ add_rule(struct xt_pknock_mtinfo *info)
 	rule->ref_count      = 1;
 	rule->max_time       = info->max_time;
 	rule->autoclose_time = info->autoclose_time;
-	rule->peer_head      = alloc_hashtable(peer_hashsize);
-	if (rule->peer_head == NULL)
+	spin_lock_init(&rule->lock);
+	rule->tokens = kvzalloc(2 * spa_tokens * sizeof(*rule->tokens),
+	               GFP_KERNEL);
+	if (rule->tokens == NULL)
 		goto out;
-	timer_setup(&rule->timer, peer_gc, 0);
+	params = peer_params;
+	params.nelem_hint = peer_hashsize;
+	if (rhashtable_init(&rule->peers, &params) != 0)
+		goto out_tokens;
+	INIT_DELAYED_WORK(&rule->gc_work, peer_gc);
+	for (i = 0; i < ARRAY_SIZE(rule->gc_wheel); ++i)
+		INIT_LIST_HEAD(&rule->gc_wheel[i]);
+	rule->gc_next = jiffies / HZ;
 	rule->status_proc = proc_create_data(info->rule_name, 0, pde,
 	                    &pknock_proc_ops, rule);
 	if (rule->status_proc == NULL)
-		goto out;
+		goto out_peers;
 
 	list_add(&rule->head, &rule_hashtable[hash]);
+	info->rule = rule;
+	mutex_unlock(&list_lock);
 	pr_debug("(A) rule_name: %s - created.\n", rule->rule_name);
 	return true;
+ out_peers:
+	rhashtable_destroy(&rule->peers);
+ out_tokens:
+	kvfree(rule->tokens);
  out:
-	kfree(rule->peer_head);
 	kfree(rule);
+ out_unlock:
+	mutex_unlock(&list_lock);
 	return false;
 }
 
+static void free_peer(void *ptr, void *arg)
+{
+	struct peer *peer = ptr;
+
+	pk_debug("DELETED", peer);
+	kfree(peer);
+}
+
 /**
- * It removes a rule only if it exists.
+ * It drops the match's reference to its rule, removing the rule with the
+ * last one.
  *
  * @info
  */
 static void
 remove_rule(struct xt_pknock_mtinfo *info)
 {
-	struct xt_pknock_rule *rule = NULL;
-	struct list_head *pos, *n;
-	struct peer *peer;
-	unsigned int i;
-	int found = 0;
-	unsigned int hash = pknock_hash(info->rule_name, info->rule_name_len,
-                                ipt_pknock_hash_rnd, rule_hashsize);
+	struct xt_pknock_rule *rule = info->rule;
 
-	if (list_empty(&rule_hashtable[hash]))
+	mutex_lock(&list_lock);
+	if (--rule->ref_count != 0) {
+		mutex_unlock(&list_lock);
 		return;
-
-	list_for_each_safe(pos, n, &rule_hashtable[hash]) {
-		rule = list_entry(pos, struct xt_pknock_rule, head);
-		if (rulecmp(info, rule)) {
-			found = 1;
-			rule->ref_count--;
-			break;
-		}
 	}
-	if (!found) {
-		pr_debug("(N) rule not found: %s.\n", info->rule_name);
-		return;
-	}
-	if (rule == NULL || rule->ref_count != 0)
-		return;
-
-	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
-		peer = list_entry(pos, struct peer, head);
-		pk_debug("DELETED", peer);
-		list_del(pos);
-		kfree(peer);
-	}
-
+	list_del(&rule->head);
+	/* before a rule of the same name can be added again */
 	if (rule->status_proc != NULL)
-		remove_proc_entry(info->rule_name, pde);
+		remove_proc_entry(rule->rule_name, pde);
+	mutex_unlock(&list_lock);
+
 	pr_debug("(D) rule deleted: %s.\n", rule->rule_name);
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
-	list_del(&rule->head);
-	kfree(rule->peer_head);
+	cancel_delayed_work_sync(&rule->gc_work);
+	/* No match refers to the rule anymore, so neither to its peers. */
+	rhashtable_free_and_destroy(&rule->peers, free_peer, NULL);
+	kvfree(rule->tokens);
 	kfree(rule);
 }
 
 /**
  * If peer status exist in the list it returns peer status, if not it returns NULL.
+ * The caller must be in an RCU read-side section (as the packet path is)
+ * or hold the rule's lock.
  *
  * @rule
- * @ip
+ * @addr
  * @return: peer or NULL
  */
-static struct peer *get_peer(struct xt_pknock_rule *rule, __be32 ip)
+static struct peer *
+get_peer(struct xt_pknock_rule *rule, const struct in6_addr *addr)
 {
-	struct peer *peer;
-	struct list_head *pos, *n;
-	unsigned int hash;
-
-	hash = pknock_hash(&ip, sizeof(ip), ipt_pknock_hash_rnd, peer_hashsize);
-	list_for_each_safe(pos, n, &rule->peer_head[hash]) {
-		peer = list_entry(pos, struct peer, head);
-		if (peer->ip == ip)
-			return peer;
-	}
-	return NULL;
+	return rhashtable_lookup_fast(&rule->peers, addr, peer_params);
 }
 
 /**
@@ -563,14 +684,14 @@ static void reset_knock_status(struct peer *peer)
  * @proto
  * @return: peer or NULL
  */
-static struct peer *new_peer(__be32 ip, uint8_t proto)
+static struct peer *new_peer(const struct in6_addr *addr, uint8_t proto)
 {
 	struct peer *peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
 
 	if (peer == NULL)
 		return NULL;
-	INIT_LIST_HEAD(&peer->head);
-	peer->ip	= ip;
+	INIT_LIST_HEAD(&peer->gc_node);
+	peer->addr	= *addr;
 	peer->proto	= proto;
 	peer->timestamp = jiffies/HZ;
 	peer->login_sec = 0;
@@ -579,29 +700,29 @@ static struct peer *new_peer(__be32 ip, uint8_t proto)
 }
 
 /**
- * It adds a new peer matching status to the list.
+ * It adds a new peer matching status to the list. Must be called with the
+ * rule's lock held.
  *
- * @peer
  * @rule
+ * @addr
+ * @proto
+ * @return: peer or NULL
  */
-static void add_peer(struct peer *peer, struct xt_pknock_rule *rule)
+static struct peer *
+add_peer(struct xt_pknock_rule *rule, const struct in6_addr *addr,
+    uint8_t proto)
 {
-	unsigned int hash = pknock_hash(&peer->ip, sizeof(peer->ip),
-                                ipt_pknock_hash_rnd, peer_hashsize);
-	list_add(&peer->head, &rule->peer_head[hash]);
-}
+	struct peer *peer = new_peer(addr, proto);
 
-/**
- * It removes a peer matching status.
- *
- * @peer
- */
-static void remove_peer(struct peer *peer)
-{
 	if (peer == NULL)
-		return;
-	list_del(&peer->head);
-	kfree(peer);
+		return NULL;
+	if (rhashtable_insert_fast(&rule->peers, &peer->node,
+	    peer_params) != 0) {
+		kfree(peer);
+		return NULL;
+	}
+	schedule_peer_gc(rule, peer);
+	return peer;
 }
 
 /**
@@ -651,33 +772,46 @@ is_allowed(const struct peer *peer)
 	return peer != NULL && peer->status == ST_ALLOWED;
 }
 
+#if IS_ENABLED(CONFIG_CONNECTOR)
+static int nl_batch_alloc(void)
+{
+	static const struct cb_id id = {XT_PKNOCK_CN_IDX, XT_PKNOCK_CN_VAL};
+
+	return compat_cnbatch_alloc(&nl_batch, &id, nl_multicast_group,
+	       XT_PKNOCK_NL_BATCH, sizeof(struct xt_pknock_nl_msg),
+	       nl_flush_interval);
+}
+
+static inline void nl_batch_free(void)
+{
+	compat_cnbatch_free(&nl_batch);
+}
+#else
+static inline int nl_batch_alloc(void) { return 0; }
+static inline void nl_batch_free(void) {}
+#endif
+
 /**
- * Sends a message to user space through netlink sockets.
+ * Queues an event for user space. It goes out with the next connector
+ * message of this CPU, once XT_PKNOCK_NL_BATCH events have gathered or
+ * nl_flush_interval has passed. Must be called with BH disabled.
  *
  * @info
  * @peer
- * @return: 1 success, 0 otherwise
  */
-static bool
+static void
 msg_to_userspace_nl(const struct xt_pknock_mtinfo *info,
-                const struct peer *peer, int multicast_group)
+                const struct peer *peer)
 {
 #if IS_ENABLED(CONFIG_CONNECTOR)
-	struct cn_msg *m;
-	struct xt_pknock_nl_msg msg;
+	struct xt_pknock_nl_msg *msg = compat_cnbatch_reserve(&nl_batch);
 
-	m = kzalloc(sizeof(*m) + sizeof(msg), GFP_ATOMIC);
-	if (m == NULL)
-		return false;
-	m->len = sizeof(msg);
-
-	msg.peer_ip = peer->ip;
-	scnprintf(msg.rule_name, info->rule_name_len + 1, info->rule_name);
-	memcpy(m + 1, &msg, m->len);
-	cn_netlink_send(m, 0, multicast_group, GFP_ATOMIC);
-	kfree(m);
+	if (ipv6_addr_v4mapped(&peer->addr))
+		msg->peer_ip = peer->addr.s6_addr32[3];
+	memcpy(msg->peer_ip6, &peer->addr, sizeof(msg->peer_ip6));
+	memcpy(msg->rule_name, info->rule_name, info->rule_name_len);
+	compat_cnbatch_commit(&nl_batch);
 #endif
-	return true;
 }
 
 /**
@@ -699,100 +833,177 @@ crypt_to_hex(char *out, const char *crypt, unsigned int size)
 }
 
 /**
- * Checks that the payload has the hmac(secret+ipsrc+epoch_min).
+ * Checks that the payload has the hmac(secret+ipsrc+epoch_min[+nonce]).
+ * BH is disabled while the per-CPU descriptor is in use: under nft_compat,
+ * matches may also run in process context.
  *
- * @secret
- * @secret_len
- * @ipsrc
- * @payload
- * @payload_len
+ * @hmac
+ * @tfm: keyed with the secret
+ * @ipsrc: 4 bytes of it go into the HMAC for IPv4, 16 for IPv6
+ * @payload: hex digest, then optionally ':' and the nonce
+ * @nonce_len: length of the nonce, 0 if none
+ * @token: gets the minute and the leading HMAC bytes on success
  * @return: 1 success, 0 failure
  */
 static bool
-has_secret(const unsigned char *secret, unsigned int secret_len, uint32_t ipsrc,
-    const unsigned char *payload, unsigned int payload_len)
+has_secret(const struct xt_pknock_hmac *hmac, struct crypto_shash *tfm,
+    const struct in6_addr *ipsrc, const unsigned char *payload,
+    unsigned int nonce_len, struct spa_token *token)
 {
-	char result[64] = ""; // 64 bytes * 8 = 512 bits
-	char *hexresult;
-	unsigned int hexa_size;
-	int ret;
-	bool fret = false;
+	struct shash_desc *desc;
+	char result[PKNOCK_MAX_DIGEST_SIZE];
+	char hexresult[2 * PKNOCK_MAX_DIGEST_SIZE];
+	uint32_t data[5], *p = data;
 	uint64_t x;
-	unsigned int epoch_min;
+	int ret;
 
-	if (payload_len == 0)
+	/* 4 or 16 bytes IP, 4 bytes minutes since the epoch */
+	if (ipv6_addr_v4mapped(ipsrc)) {
+		*p++ = (__force uint32_t)ipsrc->s6_addr32[3];
+	} else {
+		memcpy(p, ipsrc, sizeof(*ipsrc));
+		p += sizeof(*ipsrc) / sizeof(*p);
+	}
+	x = ktime_get_seconds();
+	do_div(x, 60);
+	*p++ = x;
+
+	local_bh_disable();
+	desc = this_cpu_ptr(hmac->desc);
+	desc->tfm = tfm;
+	ret = crypto_shash_init(desc);
+	if (ret == 0)
+		ret = crypto_shash_update(desc, (const void *)data,
+		      (p - data) * sizeof(*p));
+	if (ret == 0 && nonce_len != 0)
+		ret = crypto_shash_update(desc,
+		      payload + hmac->size * 2 + 1, nonce_len);
+	if (ret == 0)
+		ret = crypto_shash_final(desc, result);
+	local_bh_enable();
+	if (ret != 0) {
+		pr_debug("HMAC computation failed ret=%d\n", ret);
 		return false;
+	}
+	crypt_to_hex(hexresult, result, hmac->size);
+	if (crypto_memneq(hexresult, payload, hmac->size * 2)) {
+		pr_debug("secret match failed\n");
+		return false;
+	}
+	token->minute = x;
+	memcpy(token->digest, result, min_t(unsigned int, hmac->size,
+	       sizeof(token->digest)));
+	return true;
+}
+
+/**
+ * Checks an SPA packet for the one secret that can be of use: the close
+ * secret for a peer already let in, else the open secret.
+ *
+ * @info
+ * @ipsrc
+ * @hdr
+ * @allowed: whether the peer is let in
+ */
+static enum spa
+check_spa(const struct xt_pknock_mtinfo *info, const struct in6_addr *ipsrc,
+    struct transport_data *hdr, bool allowed)
+{
+	const struct xt_pknock_hmac *hmac = info->hmac;
+	unsigned int hexa_len = hmac->size * 2, nonce_len = 0;
 
 	/*
 	 * hexa:  4bits
 	 * ascii: 8bits
 	 * hexa = ascii * 2
+	 *
+	 * + 1 cause we MUST add NULL in the payload; a nonce, which lets
+	 * a peer make more than one token per minute, goes before it.
 	 */
-	hexa_size = crypto.size * 2;
+	if (hdr->payload_len > hexa_len + 2 &&
+	    hdr->payload[hexa_len] == ':')
+		nonce_len = hdr->payload_len - hexa_len - 2;
+	else if (hdr->payload_len != hexa_len + 1)
+		return SPA_NONE;
+	if (nonce_len > PKNOCK_MAX_NONCE_LEN)
+		return SPA_NONE;
+
+	if (allowed)
+		return has_secret(hmac, hmac->close, ipsrc, hdr->payload,
+		       nonce_len, &hdr->token) ? SPA_CLOSE : SPA_NONE;
+	return has_secret(hmac, hmac->open, ipsrc, hdr->payload, nonce_len,
+	       &hdr->token) ? SPA_OPEN : SPA_NONE;
+}
+
+/**
+ * Records the SPA token of a packet, so that it cannot be replayed. Must be
+ * called with the rule's lock held.
+ *
+ * Only tokens of the current minute get here, so the set is emptied when
+ * the minute changes, and a slot of any other minute is free. It holds
+ * spa_tokens tokens in twice as many slots; the HMAC bytes are as good a
+ * hash as any, and nobody without the secret can choose them.
+ *
+ * @rule
+ * @token
+ * @return: 1 if the token is new, 0 if used before or the set is full
+ */
+static bool
+use_spa_token(struct xt_pknock_rule *rule, const struct spa_token *token)
+{
+	unsigned int size = 2 * spa_tokens, i;
+	struct spa_token *slot;
+	uint32_t hash;
 
-	/* + 1 cause we MUST add NULL in the payload */
-	if (payload_len != hexa_size + 1)
+	/* Checked against the previous minute just before it ended */
+	if ((int32_t)(token->minute - rule->tokens_minute) < 0)
 		return false;
-	hexresult = kzalloc(hexa_size, GFP_ATOMIC);
-	if (hexresult == NULL)
+	if (token->minute != rule->tokens_minute) {
+		rule->tokens_minute = token->minute;
+		rule->tokens_used   = 0;
+	}
+	if (rule->tokens_used >= spa_tokens) {
+		pr_debug("rule %s: out of SPA tokens for this minute\n",
+		         rule->rule_name);
 		return false;
-	x = ktime_get_seconds();
-	epoch_min = do_div(x, 60);
-
-	ret = crypto_shash_setkey(crypto.tfm, secret, secret_len);
-	if (ret != 0) {
-		printk("crypto_hash_setkey() failed ret=%d\n", ret);
-		goto out;
 	}
 
-	/*
-	 * The third parameter is the number of bytes INSIDE the sg!
-	 * 4 bytes IP (32 bits) +
-	 * 4 bytes int epoch_min (32 bits)
-	 */
-	if ((ret = crypto_shash_update(&crypto.desc, (const void *)&ipsrc, sizeof(ipsrc))) != 0 ||
-	    (ret = crypto_shash_update(&crypto.desc, (const void *)&epoch_min, sizeof(epoch_min))) != 0 ||
-	    (ret = crypto_shash_final(&crypto.desc, result)) != 0) {
-		printk("crypto_shash_update/final() failed ret=%d\n", ret);
-		goto out;
+	memcpy(&hash, token->digest, sizeof(hash));
+	for (i = hash % size; ; i = (i + 1) % size) {
+		slot = &rule->tokens[i];
+		if (slot->minute != token->minute)
+			break;
+		if (memcmp(slot->digest, token->digest,
+		    sizeof(slot->digest)) == 0)
+			return false;
 	}
-	crypt_to_hex(hexresult, result, crypto.size);
-	if (memcmp(hexresult, payload, hexa_size) != 0)
-		pr_debug("secret match failed\n");
-	else
-		fret = true;
- out:
-	kfree(hexresult);
-	return fret;
+	*slot = *token;
+	++rule->tokens_used;
+	return true;
 }
 
 /**
  * If the peer pass the security policy.
  *
  * @peer
- * @info
- * @payload
- * @payload_len
+ * @rule
+ * @hdr
  * @return: 1 if pass security, 0 otherwise
  */
 static bool
-pass_security(struct peer *peer, const struct xt_pknock_mtinfo *info,
-        const unsigned char *payload, unsigned int payload_len)
+pass_security(struct peer *peer, struct xt_pknock_rule *rule,
+        const struct transport_data *hdr)
 {
 	if (is_allowed(peer))
 		return true;
-
-	/* The peer can't log more than once during the same minute. */
-	if (has_logged_during_this_minute(peer)) {
-		pk_debug("DENIED (anti-spoof protection)", peer);
+	/* Check for OPEN secret */
+	if (hdr->spa != SPA_OPEN)
+		return false;
+	if (!use_spa_token(rule, &hdr->token)) {
+		pk_debug("DENIED (replayed token)", peer);
 		return false;
 	}
-	/* Check for OPEN secret */
-	if (has_secret(info->open_secret,
-					info->open_secret_len, peer->ip,
-					payload, payload_len))
-		return true;
-	return false;
+	return true;
 }
 
 /**
@@ -817,7 +1028,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 		pk_debug("DIDN'T MATCH", peer);
 		/* Peer must start the sequence from scratch. */
 		if (info->option & XT_PKNOCK_STRICT)
-			remove_peer(peer);
+			remove_peer(rule, peer);
 		return false;
 	}
 
@@ -825,20 +1036,19 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 	if (info->option & XT_PKNOCK_OPENSECRET ) {
 		if (hdr->proto != IPPROTO_UDP && hdr->proto != IPPROTO_UDPLITE)
 			return false;
-		if (!pass_security(peer, info, hdr->payload, hdr->payload_len))
+		if (!pass_security(peer, rule, hdr))
 			return false;
 	}
 
-	/* Update the gc timer when there is a state change. */
-	update_rule_gc_timer(rule);
 	++peer->accepted_knock_count;
 
 	if (is_last_knock(peer, info)) {
 		peer->status = ST_ALLOWED;
 		pk_debug("ALLOWED", peer);
 		peer->login_sec = ktime_get_seconds();
+		schedule_peer_gc(rule, peer);
 		if (nl_multicast_group > 0)
-			msg_to_userspace_nl(info, peer, nl_multicast_group);
+			msg_to_userspace_nl(info, peer);
 		return true;
 	}
 
@@ -852,35 +1062,32 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 			pr_debug("max_time: %ld - time: %ld\n",
 					peer->timestamp + info->max_time,
 					time);
-			remove_peer(peer);
+			remove_peer(rule, peer);
 			return false;
 		}
 		peer->timestamp = time;
 	}
 	pk_debug("MATCHING", peer);
 	peer->status = ST_MATCHING;
+	schedule_peer_gc(rule, peer);
 	return false;
 }
 
 /**
  * Make the peer no more ALLOWED sending a payload with a special secret for
- * closure.
+ * closure. Must be called with the rule's lock held.
  *
  * @peer
- * @info
- * @payload
- * @payload_len
+ * @rule
+ * @hdr
  * @return: 1 if close knock, 0 otherwise
  */
 static bool
-is_close_knock(const struct peer *peer, const struct xt_pknock_mtinfo *info,
-		const unsigned char *payload, unsigned int payload_len)
+is_close_knock(const struct peer *peer, struct xt_pknock_rule *rule,
+    const struct transport_data *hdr)
 {
 	/* Check for CLOSE secret. */
-	if (has_secret(info->close_secret,
-				info->close_secret_len, peer->ip,
-				payload, payload_len))
-	{
+	if (hdr->spa == SPA_CLOSE && use_spa_token(rule, &hdr->token)) {
 		pk_debug("BLOCKED", peer);
 		return true;
 	}
@@ -891,16 +1098,32 @@ static bool pknock_mt(const struct sk_buff *skb,
     struct xt_action_param *par)
 {
 	const struct xt_pknock_mtinfo *info = par->matchinfo;
-	struct xt_pknock_rule *rule;
-	struct peer *peer;
-	const struct iphdr *iph = ip_hdr(skb);
-	unsigned int hdr_len = 0;
+	struct xt_pknock_rule *rule = info->rule;
+	struct peer *peer = NULL;
+	unsigned char _payload[2 * PKNOCK_MAX_DIGEST_SIZE + 2 +
+	                       PKNOCK_MAX_NONCE_LEN];
+	unsigned int hdr_len = 0, thoff = par->thoff;
+	struct in6_addr saddr;
 	__be16 _ports[2];
 	const __be16 *pptr;
-	struct transport_data hdr = {0, 0, 0, NULL};
+	struct transport_data hdr = {0, 0, 0, NULL, SPA_NONE, {0}};
 	bool ret = false;
 
-	pptr = skb_header_pointer(skb, par->thoff, sizeof _ports, &_ports);
+	if (xt_family(par) == NFPROTO_IPV6) {
+		/* par->thoff is only set for rules with -p */
+		int off = 0, proto = ipv6_find_hdr(skb, &off, -1, NULL, NULL);
+
+		if (proto < 0)
+			return false;
+		thoff = off;
+		hdr.proto = proto;
+		saddr = ipv6_hdr(skb)->saddr;
+	} else {
+		hdr.proto = ip_hdr(skb)->protocol;
+		ipv6_addr_set_v4mapped(ip_hdr(skb)->saddr, &saddr);
+	}
+
+	pptr = skb_header_pointer(skb, thoff, sizeof _ports, &_ports);
 	if (pptr == NULL) {
 		/* We've been asked to examine this packet, and we
 		 * can't. Hence, no choice but to drop.
@@ -910,88 +1133,151 @@ static bool pknock_mt(const struct sk_buff *skb,
 	}
 
 	hdr.port = ntohs(pptr[1]);
-	hdr.proto = iph->protocol;
 
 	switch (hdr.proto) {
 	case IPPROTO_TCP:
 		break;
 	case IPPROTO_UDP:
 	case IPPROTO_UDPLITE:
-		hdr_len = (iph->ihl * 4) + sizeof(struct udphdr);
+		hdr_len = thoff + sizeof(struct udphdr);
 		break;
 	default:
 		pr_debug("IP payload protocol is neither tcp nor udp.\n");
 		return false;
 	}
 
-	spin_lock_bh(&list_lock);
-
-	/* Searches a rule from the list depending on info structure options. */
-	rule = search_rule(info);
-	if (rule == NULL) {
-		printk(KERN_INFO PKNOCK "The rule %s doesn't exist.\n",
-						info->rule_name);
-		goto out;
+	if (hdr.proto == IPPROTO_UDP || hdr.proto == IPPROTO_UDPLITE) {
+		/* An SPA payload is a hex digest, a nonce and a NUL at most. */
+		hdr.payload_len = skb->len - hdr_len;
+		if (hdr.payload_len > 0 && hdr.payload_len <= sizeof(_payload))
+			hdr.payload = skb_header_pointer(skb, hdr_len,
+			              hdr.payload_len, _payload);
+		/*
+		 * Keep the HMAC computation out of the lock, and to packets
+		 * to the knock port. Should the peer change state meanwhile,
+		 * the packet just counts as one without a secret.
+		 */
+		if (info->option & XT_PKNOCK_OPENSECRET && hdr.payload != NULL &&
+		    hdr.port == info->port[0])
+			hdr.spa = check_spa(info, &saddr, &hdr,
+			          is_allowed(get_peer(rule, &saddr)));
 	}
 
 	/* Gives the peer matching status added to rule depending on ip src. */
-	peer = get_peer(rule, iph->saddr);
 	if (info->option & XT_PKNOCK_CHECKIP) {
+		/* Lockless; the rule's lock only guards against writers. */
+		peer = get_peer(rule, &saddr);
 		ret = is_allowed(peer);
-		goto out;
-	}
-	if (iph->protocol == IPPROTO_UDP || iph->protocol == IPPROTO_UDPLITE) {
-		hdr.payload = (void *)iph + hdr_len;
-		hdr.payload_len = skb->len - hdr_len;
-	}
-
-	/* Sets, updates, removes or checks the peer matching status. */
-	if (info->option & XT_PKNOCK_KNOCKPORT) {
+	} else if (info->option & XT_PKNOCK_KNOCKPORT) {
+		/* Sets, updates, removes or checks the peer matching status. */
+		spin_lock_bh(&rule->lock);
+		peer = get_peer(rule, &saddr);
 		ret = is_allowed(peer);
-		if (ret != 0) {
+		if (ret) {
 			if (info->option & XT_PKNOCK_CLOSESECRET &&
-			    (iph->protocol == IPPROTO_UDP ||
-			    iph->protocol == IPPROTO_UDPLITE))
+			    (hdr.proto == IPPROTO_UDP ||
+			    hdr.proto == IPPROTO_UDPLITE) &&
+			    is_close_knock(peer, rule, &hdr))
 			{
-				if (is_close_knock(peer, info, hdr.payload, hdr.payload_len))
-				{
-					reset_knock_status(peer);
-					ret = false;
-				}
+				reset_knock_status(peer);
+				schedule_peer_gc(rule, peer);
+				ret = false;
 			}
-			goto out;
+		} else {
+			if (is_first_knock(peer, info, hdr.port))
+				peer = add_peer(rule, &saddr, hdr.proto);
+			if (peer != NULL)
+				update_peer(peer, info, rule, &hdr);
 		}
-
-		if (is_first_knock(peer, info, hdr.port)) {
-			peer = new_peer(iph->saddr, iph->protocol);
-			add_peer(peer, rule);
-		}
-		if (peer == NULL)
-			goto out;
-		update_peer(peer, info, rule, &hdr);
+		spin_unlock_bh(&rule->lock);
 	}
 
-out:
 	/* Handle cur.peer matching and deletion after autoclose_time passed */
 	if (ret && autoclose_time_passed(peer, rule->autoclose_time)) {
 		pk_debug("AUTOCLOSE TIME PASSED => BLOCKED", peer);
 		ret = false;
-		if (iph->protocol == IPPROTO_TCP ||
-		    !has_logged_during_this_minute(peer))
-			remove_peer(peer);
+		spin_lock_bh(&rule->lock);
+		remove_peer(rule, peer);
+		spin_unlock_bh(&rule->lock);
 	}
 
 	if (ret)
 		pk_debug("PASS OK", peer);
-	spin_unlock_bh(&list_lock);
 	return ret;
 }
 
 #define RETURN_ERR(err) do { pr_err(err); return -EINVAL; } while (false)
 
+static void hmac_free(struct xt_pknock_hmac *hmac)
+{
+	if (hmac == NULL)
+		return;
+	free_percpu(hmac->desc);
+	if (!IS_ERR_OR_NULL(hmac->close))
+		crypto_free_shash(hmac->close);
+	if (!IS_ERR_OR_NULL(hmac->open))
+		crypto_free_shash(hmac->open);
+	kfree(hmac);
+}
+
+/**
+ * Allocates the HMAC transforms of an SPA match and keys them.
+ *
+ * @info
+ * @return: 0 success, negative errno otherwise
+ */
+static int hmac_alloc(struct xt_pknock_mtinfo *info)
+{
+	struct xt_pknock_hmac *hmac;
+	unsigned int descsize;
+	int ret;
+
+	hmac = kzalloc(sizeof(*hmac), GFP_KERNEL);
+	if (hmac == NULL)
+		return -ENOMEM;
+	hmac->open  = crypto_alloc_shash(pknock_hmac_algo, 0, 0);
+	hmac->close = crypto_alloc_shash(pknock_hmac_algo, 0, 0);
+	if (IS_ERR(hmac->open) || IS_ERR(hmac->close)) {
+		pr_err("failed to load transform for %s\n", pknock_hmac_algo);
+		ret = IS_ERR(hmac->open) ? PTR_ERR(hmac->open) :
+		      PTR_ERR(hmac->close);
+		goto out;
+	}
+
+	hmac->size = crypto_shash_digestsize(hmac->open);
+	if (hmac->size > PKNOCK_MAX_DIGEST_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = crypto_shash_setkey(hmac->open, info->open_secret,
+	      info->open_secret_len);
+	if (ret == 0)
+		ret = crypto_shash_setkey(hmac->close, info->close_secret,
+		      info->close_secret_len);
+	if (ret != 0) {
+		pr_err("crypto_shash_setkey() failed ret=%d\n", ret);
+		goto out;
+	}
+
+	descsize = max(crypto_shash_descsize(hmac->open),
+	           crypto_shash_descsize(hmac->close));
+	hmac->desc = __alloc_percpu(sizeof(struct shash_desc) + descsize,
+	             __alignof__(struct shash_desc));
+	if (hmac->desc == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	info->hmac = hmac;
+	return 0;
+ out:
+	hmac_free(hmac);
+	return ret;
+}
+
 static int pknock_mt_check(const struct xt_mtchk_param *par)
 {
 	struct xt_pknock_mtinfo *info = par->matchinfo;
+	int ret;
 
 	/* Singleton. */
 	if (rule_hashtable == NULL) {
@@ -1037,9 +1323,18 @@ static int pknock_mt_check(const struct xt_mtchk_param *par)
 	    memcmp(info->open_secret, info->close_secret,
 	    info->open_secret_len) == 0)
 		RETURN_ERR("opensecret & closesecret cannot be equal.\n");
-	if (!add_rule(info))
+
+	info->hmac = NULL;
+	if (info->option & XT_PKNOCK_OPENSECRET) {
+		ret = hmac_alloc(info);
+		if (ret < 0)
+			return ret;
+	}
+	if (!add_rule(info)) {
+		hmac_free(info->hmac);
 		/* should ENOMEM here */
 		RETURN_ERR("add_rule() error in checkentry() function.\n");
+	}
 	return 0;
 }
 
@@ -1048,60 +1343,79 @@ static void pknock_mt_destroy(const struct xt_mtdtor_param *par)
 	struct xt_pknock_mtinfo *info = par->matchinfo;
 	/* Removes a rule only if it exits and ref_count is equal to 0. */
 	remove_rule(info);
+	hmac_free(info->hmac);
 }
 
-static struct xt_match xt_pknock_mt_reg __read_mostly = {
-	.name		= "pknock",
-	.revision   = 1,
-	.family		= NFPROTO_IPV4,
-	.matchsize  = sizeof(struct xt_pknock_mtinfo),
-	.match      = pknock_mt,
-	.checkentry = pknock_mt_check,
-	.destroy    = pknock_mt_destroy,
-	.me			= THIS_MODULE
+static struct xt_match xt_pknock_mt_reg[] __read_mostly = {
+	{
+		.name       = "pknock",
+		.revision   = 2,
+		.family     = NFPROTO_IPV4,
+		.matchsize  = sizeof(struct xt_pknock_mtinfo),
+		.match      = pknock_mt,
+		.checkentry = pknock_mt_check,
+		.destroy    = pknock_mt_destroy,
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "pknock",
+		.revision   = 2,
+		.family     = NFPROTO_IPV6,
+		.matchsize  = sizeof(struct xt_pknock_mtinfo),
+		.match      = pknock_mt,
+		.checkentry = pknock_mt_check,
+		.destroy    = pknock_mt_destroy,
+		.me         = THIS_MODULE,
+	},
 };
 
 static int __init xt_pknock_mt_init(void)
 {
+	int ret;
+
 #if !IS_ENABLED(CONFIG_CONNECTOR)
 	if (nl_multicast_group != -1)
 		pr_info("CONFIG_CONNECTOR not present; "
 		        "netlink messages disabled\n");
 #endif
 
-	if (gc_expir_time < DEFAULT_GC_EXPIRATION_TIME)
-		gc_expir_time = DEFAULT_GC_EXPIRATION_TIME;
-	if (request_module(crypto.algo) < 0) {
-		pr_err("request_module('%s') error.\n",
-                        crypto.algo);
+	if (spa_tokens == 0)
+		spa_tokens = 1;
+	if (!crypto_has_shash(pknock_hmac_algo, 0, 0)) {
+		pr_err("no transform for %s\n", pknock_hmac_algo);
 		return -ENXIO;
 	}
 
-	crypto.tfm = crypto_alloc_shash(crypto.algo, 0, 0);
-	if (IS_ERR(crypto.tfm)) {
-		pr_err("failed to load transform for %s\n",
-						crypto.algo);
-		return PTR_ERR(crypto.tfm);
+	if (nl_multicast_group > 0) {
+		ret = nl_batch_alloc();
+		if (ret < 0)
+			return ret;
 	}
 
-	crypto.size = crypto_shash_digestsize(crypto.tfm);
-	crypto.desc.tfm = crypto.tfm;
-
 	pde = proc_mkdir("xt_pknock", init_net.proc_net);
 	if (pde == NULL) {
 		pr_err("proc_mkdir() error in _init().\n");
-		return -ENXIO;
+		ret = -ENXIO;
+		goto out_batch;
 	}
-	return xt_register_match(&xt_pknock_mt_reg);
+	ret = xt_register_matches(xt_pknock_mt_reg,
+	      ARRAY_SIZE(xt_pknock_mt_reg));
+	if (ret < 0)
+		goto out_proc;
+	return 0;
+ out_proc:
+	remove_proc_entry("xt_pknock", init_net.proc_net);
+ out_batch:
+	nl_batch_free();
+	return ret;
 }
 
 static void __exit xt_pknock_mt_exit(void)
 {
 	remove_proc_entry("xt_pknock", init_net.proc_net);
-	xt_unregister_match(&xt_pknock_mt_reg);
+	xt_unregister_matches(xt_pknock_mt_reg, ARRAY_SIZE(xt_pknock_mt_reg));
+	nl_batch_free();
 	kfree(rule_hashtable);
-	if (crypto.tfm != NULL)
-		crypto_free_shash(crypto.tfm);
 }
 
 module_init(xt_pknock_mt_init);
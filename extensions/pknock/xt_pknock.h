@@ -25,8 +25,16 @@ enum {
 	XT_PKNOCK_MAX_PORTS      = 15,
 	XT_PKNOCK_MAX_BUF_LEN    = 31,
 	XT_PKNOCK_MAX_PASSWD_LEN = 31,
+
+	XT_PKNOCK_NL_BATCH = 32,
+	/* cn_msg.id of the events; the index is shared by Xtables-addons */
+	XT_PKNOCK_CN_IDX = 0x78746100,
+	XT_PKNOCK_CN_VAL = 1,
 };
 
+struct xt_pknock_hmac;
+struct xt_pknock_rule;
+
 struct xt_pknock_mtinfo {
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	uint32_t			rule_name_len;
@@ -39,9 +47,22 @@ struct xt_pknock_mtinfo {
 	uint16_t	port[XT_PKNOCK_MAX_PORTS]; /* port[,port,port,...] */
 	uint32_t	max_time;	/* max matching time between ports */
 	uint32_t autoclose_time;
+
+	/* Used internally by the kernel */
+	struct xt_pknock_hmac *hmac __attribute__((aligned(8)));
+	struct xt_pknock_rule *rule __attribute__((aligned(8)));
 };
 
+/*
+ * Events are sent in batches: a connector message carries up to
+ * XT_PKNOCK_NL_BATCH of these, cn_msg.len bytes in all. cn_msg.ack is the
+ * number of events the kernel failed to send before that message.
+ *
+ * @peer_ip:	0 for IPv6 peers
+ * @peer_ip6:	IPv4 peers as v4-mapped addresses
+ */
 struct xt_pknock_nl_msg {
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	__be32 peer_ip;
+	__be32 peer_ip6[4];
 };
@@ -1,4 +1,5 @@
-/* DNETMAP - dynamic two-way 1:1 NAT mapping of IPv4 network addresses.
+/* DNETMAP - dynamic two-way 1:1 NAT mapping of IPv4 network addresses,
+ * and of IPv6 /64 networks.
  * The mapping can be applied to source (POSTROUTING|OUTPUT)
  * or destination (PREROUTING),
  */
@@ -23,74 +24,273 @@
 #ifdef CONFIG_NF_NAT
 #include <linux/inet.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/netdevice.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/proc_fs.h>
+#include <linux/rhashtable.h>
 #include <linux/seq_file.h>
+#include <linux/timer.h>
 #include <linux/uidgid.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <net/netfilter/nf_nat.h>
 #include "compat_xtables.h"
 #include "xt_DNETMAP.h"
+#if IS_ENABLED(CONFIG_CONNECTOR)
+#	include "compat_cnbatch.h"
+#endif
+#if IS_ENABLED(CONFIG_IP6_NF_NAT)
+#	define WITH_IPV6 1
+#endif
 
 static unsigned int default_ttl = 600;
 static unsigned int proc_perms = S_IRUGO | S_IWUSR;
 static unsigned int proc_uid;
 static unsigned int proc_gid;
-static unsigned int default_hash_size = 256;
-static unsigned int hash_size = 256;
 static unsigned int disable_log;
 static unsigned int whole_prefix = 1;
+static int nl_multicast_group = -1;
+static unsigned int nl_flush_interval = 10;
 module_param(default_ttl, uint, S_IRUSR);
 MODULE_PARM_DESC(default_ttl,
 		 " default ttl value to be used if rule doesn't specify any (default: 600)");
-module_param(hash_size, uint, S_IRUSR);
-MODULE_PARM_DESC(hash_size,
-		 " hash size for ip lists, needs to be power of 2 (default: 256)");
 module_param(disable_log, uint, S_IRUSR);
 MODULE_PARM_DESC(disable_log,
 		 " disables logging of bind/timeout events (default: 0)");
 module_param(whole_prefix, uint, S_IRUSR);
 MODULE_PARM_DESC(whole_prefix,
 		 " use network and broadcast addresses of specified prefix for bindings (default: 1)");
+module_param(nl_multicast_group, int, S_IRUSR);
+MODULE_PARM_DESC(nl_multicast_group,
+		 " netlink connector group for binding events instead of klog (default: none)");
+module_param(nl_flush_interval, uint, S_IRUSR);
+MODULE_PARM_DESC(nl_flush_interval,
+		 " max delay of batched binding events in msec, 0 to send each at once (default: 10)");
 
 static unsigned int jtimeout;
 
+/* commands taken per write() to a prefix file */
+#define DNETMAP_WRITE_MAX (64 * 1024)
+/* "ffff:ffff:ffff:ffff::/64" */
+#define DNETMAP_KEY_STRLEN 32
+/* /64 networks of an IPv6 prefix, at most: a /48 */
+#define DNETMAP_MAX_NETS6 (1 << 16)
+/* how often timed-out bindings are released */
+#define DNETMAP_EXPIRE_INTERVAL HZ
+
+/*
+ * Bindings are between hash keys: an IPv6 key stands for a /64, the upper
+ * half of the address. An IPv4 key is the address behind 0xffffffff, which
+ * no unicast /64 starts with. 0 stands for no address.
+ */
+union dnetmap_key {
+	__be32 w[2];
+	u64 key;
+};
+
+static inline u64 dnetmap_key4(__be32 addr)
+{
+	union dnetmap_key k = {.w = {htonl(~0U), addr}};
+
+	return k.key;
+}
+
+static inline u64 dnetmap_key6(const struct in6_addr *addr)
+{
+	union dnetmap_key k = {.w = {addr->s6_addr32[0], addr->s6_addr32[1]}};
+
+	return k.key;
+}
+
+static inline __be32 dnetmap_key_ip(u64 key)
+{
+	union dnetmap_key k = {.key = key};
+
+	return k.w[1];
+}
+
+/* puts the /64 of the key in the upper half of the address */
+static inline void dnetmap_key_ip6(struct in6_addr *addr, u64 key)
+{
+	union dnetmap_key k = {.key = key};
+
+	addr->s6_addr32[0] = k.w[0];
+	addr->s6_addr32[1] = k.w[1];
+}
+
+static inline bool dnetmap_key_is6(u64 key)
+{
+	union dnetmap_key k = {.key = key};
+
+	return k.w[0] != htonl(~0U);
+}
+
+static void dnetmap_key_to_inet(union nf_inet_addr *addr, u64 key)
+{
+	memset(addr, 0, sizeof(*addr));
+	if (key == 0)
+		return;
+	if (dnetmap_key_is6(key))
+		dnetmap_key_ip6(&addr->in6, key);
+	else
+		addr->ip = dnetmap_key_ip(key);
+}
+
+static u64 dnetmap_inet_to_key(__u8 family, const union nf_inet_addr *addr)
+{
+	return family == NFPROTO_IPV6 ? dnetmap_key6(&addr->in6) :
+	       dnetmap_key4(addr->ip);
+}
+
+/* the address with the network of the key, and the host part it had */
+static void dnetmap_key_map(union nf_inet_addr *addr, __u8 family, u64 key)
+{
+	if (family == NFPROTO_IPV6)
+		dnetmap_key_ip6(&addr->in6, key);
+	else
+		addr->ip = dnetmap_key_ip(key);
+}
+
+static char *dnetmap_key_str(char *buf, u64 key)
+{
+	struct in6_addr a = {};
+	__be32 ip;
+
+	if (!dnetmap_key_is6(key)) {
+		ip = dnetmap_key_ip(key);
+		snprintf(buf, DNETMAP_KEY_STRLEN, "%pI4", &ip);
+	} else {
+		dnetmap_key_ip6(&a, key);
+		snprintf(buf, DNETMAP_KEY_STRLEN, "%pI6c/64", &a);
+	}
+	return buf;
+}
+
+#if IS_ENABLED(CONFIG_CONNECTOR)
+static struct compat_cnbatch nl_batch;
+
+static int dnetmap_nl_alloc(void)
+{
+	static const struct cb_id id = {XT_DNETMAP_CN_IDX, XT_DNETMAP_CN_VAL};
+
+	return compat_cnbatch_alloc(&nl_batch, &id, nl_multicast_group,
+	       XT_DNETMAP_NL_BATCH, sizeof(struct xt_DNETMAP_event),
+	       nl_flush_interval);
+}
+
+static inline void dnetmap_nl_free(void)
+{
+	compat_cnbatch_free(&nl_batch);
+}
+#else
+static inline int dnetmap_nl_alloc(void) { return 0; }
+static inline void dnetmap_nl_free(void) {}
+#endif
+
+/*
+ * Reports a binding event: queued for the netlink group if there is one,
+ * where it goes out with the next message of this CPU, else to klog unless
+ * disable_log is set. Must be called with BH disabled.
+ */
+static void dnetmap_event(__u8 type, u64 prenat_key, u64 postnat_key)
+{
+	char prenat[DNETMAP_KEY_STRLEN], postnat[DNETMAP_KEY_STRLEN];
+#if IS_ENABLED(CONFIG_CONNECTOR)
+	struct xt_DNETMAP_event *ev;
+
+	if (nl_batch.cpu != NULL) {
+		ev = compat_cnbatch_reserve(&nl_batch);
+		ev->time   = ktime_get_real_ns();
+		ev->type   = type;
+		ev->family = dnetmap_key_is6(postnat_key) ?
+		             NFPROTO_IPV6 : NFPROTO_IPV4;
+		dnetmap_key_to_inet(&ev->prenat_addr, prenat_key);
+		dnetmap_key_to_inet(&ev->postnat_addr, postnat_key);
+		compat_cnbatch_commit(&nl_batch);
+		return;
+	}
+#endif
+	if (disable_log)
+		return;
+	dnetmap_key_str(prenat, prenat_key);
+	dnetmap_key_str(postnat, postnat_key);
+	switch (type) {
+	case XT_DNETMAP_EV_BIND:
+		pr_info("add binding %s -> %s\n", prenat, postnat);
+		break;
+	case XT_DNETMAP_EV_TIMEOUT:
+		pr_info("timeout binding %s -> %s\n", prenat, postnat);
+		break;
+	case XT_DNETMAP_EV_REMOVE:
+		pr_info("remove binding %s -> %s\n", prenat, postnat);
+		break;
+	case XT_DNETMAP_EV_STATIC:
+		pr_info("adding static binding %s:%s\n", prenat, postnat);
+		break;
+	}
+}
+
+/*
+ * Entries live as long as their prefix, and are in the postnat hash all
+ * that time; bound ones are in the prenat hash too. Both are looked up
+ * under RCU; everything else about them changes under the netns lock.
+ * A rebound entry moves within the prenat hash without waiting for
+ * readers, so they check the key of what they find.
+ *
+ * @lru_list:	in the free list of the prefix while unbound, in its LRU
+ *		list while dynamically bound, in neither while static
+ * @prenat_key:	0 while unbound
+ * @stamp:	expiry; the packet path refreshes it without the lock
+ * @lru_stamp:	@stamp when the entry took its place in the LRU list
+ */
 struct dnetmap_entry {
-	struct list_head list, glist, grlist, lru_list;
-	__be32 prenat_addr, postnat_addr;
+	struct list_head list, lru_list;
+	struct rhash_head glist, grlist;
+	u64 prenat_key, postnat_key;
 	__u8 flags;
-	unsigned long stamp;
+	unsigned long stamp, lru_stamp;
 	struct dnetmap_prefix *prefix;
 };
 
 struct dnetmap_prefix {
 	struct nf_nat_range prefix;
-	char prefix_str[20];
+	__u8 family;
+	char prefix_str[INET6_ADDRSTRLEN + 4];
 #ifdef CONFIG_PROC_FS
-	char proc_str_data[20], proc_str_stat[25];
+	char proc_str_data[INET6_ADDRSTRLEN + 4];
+	char proc_str_stat[INET6_ADDRSTRLEN + 9];
 #endif
 	struct list_head elist; // element list head
 	struct list_head list;	// prefix list
 	__u8 flags;
 	unsigned int refcnt;
-	/* lru entry list */
-	struct list_head lru_list;
+	unsigned int nr_entries;
+	/* unbound entries, and dynamically bound ones by age */
+	struct list_head free_list, lru_list;
 	/* pointer do dnetmap_net */
 	struct dnetmap_net *dnetmap;
 };
 
+/*
+ * @lock:	serializes binding changes; the prefix list is only used by
+ *		rule setup and teardown, under dnetmap_mutex; rules keep
+ *		their prefix in the target info
+ */
 struct dnetmap_net {
+	spinlock_t lock;
 	struct list_head prefixes;
 #ifdef CONFIG_PROC_FS
 	struct proc_dir_entry *xt_dnetmap;
 #endif
-	/* global hash */
-	struct list_head *dnetmap_iphash;
+	/* global hashes, by prenat and by postnat key */
+	struct rhashtable prenat_hash, postnat_hash;
+	/* releases timed-out bindings, while there are dynamic ones */
+	struct delayed_work expire_work;
 };
 
 static int dnetmap_net_id;
@@ -99,136 +299,241 @@ static inline struct dnetmap_net *dnetmap_pernet(struct net *net)
 	return net_generic(net, dnetmap_net_id);
 }
 
-static DEFINE_SPINLOCK(dnetmap_lock);
 static DEFINE_MUTEX(dnetmap_mutex);
 
+static const struct rhashtable_params dnetmap_prenat_params = {
+	.head_offset         = offsetof(struct dnetmap_entry, glist),
+	.key_offset          = offsetof(struct dnetmap_entry, prenat_key),
+	.key_len             = sizeof(u64),
+	.automatic_shrinking = true,
+};
+
+static const struct rhashtable_params dnetmap_postnat_params = {
+	.head_offset         = offsetof(struct dnetmap_entry, grlist),
+	.key_offset          = offsetof(struct dnetmap_entry, postnat_key),
+	.key_len             = sizeof(u64),
+	.automatic_shrinking = true,
+};
+
 #ifdef CONFIG_PROC_FS
 static const struct proc_ops dnetmap_tg_fops, dnetmap_stat_proc_fops;
 #endif
 
-static inline unsigned int dnetmap_entry_hash(const __be32 addr)
+static struct dnetmap_entry *
+dnetmap_entry_lookup(struct dnetmap_net *dnetmap_net, const u64 key)
 {
-	return ntohl(addr) & (hash_size - 1);
+	struct dnetmap_entry *e;
+
+	e = rhashtable_lookup_fast(&dnetmap_net->prenat_hash, &key,
+	                           dnetmap_prenat_params);
+	/* it may have been rebound since */
+	if (e == NULL || READ_ONCE(e->prenat_key) != key)
+		return NULL;
+	return e;
 }
 
 static struct dnetmap_entry *
-dnetmap_entry_lookup(struct dnetmap_net *dnetmap_net, const __be32 addr)
+dnetmap_entry_rlookup(struct dnetmap_net *dnetmap_net, const u64 key)
 {
 	struct dnetmap_entry *e;
-	unsigned int h = dnetmap_entry_hash(addr);
 
-	list_for_each_entry(e, &dnetmap_net->dnetmap_iphash[h], glist)
-		if (memcmp(&e->prenat_addr, &addr, sizeof(addr)) == 0)
-			return e;
-	return NULL;
+	e = rhashtable_lookup_fast(&dnetmap_net->postnat_hash, &key,
+	                           dnetmap_postnat_params);
+	if (e == NULL || READ_ONCE(e->prenat_key) == 0)
+		return NULL;
+	return e;
 }
 
-static struct dnetmap_entry *
-dnetmap_entry_rlookup(struct dnetmap_net *dnetmap_net, const __be32 addr)
+/*
+ * The prenat key of an entry found by postnat key, or 0. Where 64-bit
+ * loads may tear, the key is only trusted once it finds the entry.
+ */
+static u64 dnetmap_entry_prenat(struct dnetmap_net *dnetmap_net,
+				struct dnetmap_entry *e)
+{
+	u64 key = READ_ONCE(e->prenat_key);
+
+#if BITS_PER_LONG < 64
+	if (key != 0 && dnetmap_entry_lookup(dnetmap_net, key) != e)
+		return 0;
+#endif
+	return key;
+}
+
+/* Both need the netns lock. */
+static int dnetmap_entry_bind(struct dnetmap_net *dnetmap_net,
+			      struct dnetmap_entry *e, u64 prenat_key)
+{
+	char buf[DNETMAP_KEY_STRLEN];
+	int ret;
+
+	WRITE_ONCE(e->prenat_key, prenat_key);
+	ret = rhashtable_insert_fast(&dnetmap_net->prenat_hash, &e->glist,
+	                             dnetmap_prenat_params);
+	if (ret != 0) {
+		WRITE_ONCE(e->prenat_key, 0);
+		pr_info("cannot bind %s: error %d\n",
+		        dnetmap_key_str(buf, prenat_key), ret);
+	}
+	return ret;
+}
+
+static void dnetmap_entry_unbind(struct dnetmap_net *dnetmap_net,
+				 struct dnetmap_entry *e)
+{
+	rhashtable_remove_fast(&dnetmap_net->prenat_hash, &e->glist,
+	                       dnetmap_prenat_params);
+	WRITE_ONCE(e->prenat_key, 0);
+}
+
+/*
+ * Puts an unbound entry at the end of the free list of its prefix, making
+ * a static entry dynamic. Needs the netns lock.
+ */
+static void dnetmap_entry_release(struct dnetmap_entry *e)
+{
+	if (e->flags & XT_DNETMAP_STATIC) {
+		WRITE_ONCE(e->flags, e->flags & ~XT_DNETMAP_STATIC);
+		list_add_tail(&e->lru_list, &e->prefix->free_list);
+	} else {
+		list_move_tail(&e->lru_list, &e->prefix->free_list);
+	}
+}
+
+/*
+ * Releases the timed-out dynamic bindings of a prefix. The packet path
+ * refreshes stamps without reordering the LRU list, so refreshed entries
+ * found at its head are moved to the tail; the walk ends at the first
+ * entry that is neither. Needs the netns lock.
+ */
+static void dnetmap_prefix_expire(struct dnetmap_prefix *p)
 {
 	struct dnetmap_entry *e;
-	unsigned int h = dnetmap_entry_hash(addr);
+	unsigned long stamp;
+	unsigned int n;
+
+	for (n = 0; n < p->nr_entries && !list_empty(&p->lru_list); ++n) {
+		e = list_first_entry(&p->lru_list, struct dnetmap_entry,
+		                     lru_list);
+		stamp = READ_ONCE(e->stamp);
+		if (!time_before(jiffies, stamp)) {
+			dnetmap_event(XT_DNETMAP_EV_TIMEOUT, e->prenat_key,
+			              e->postnat_key);
+			dnetmap_entry_unbind(p->dnetmap, e);
+			dnetmap_entry_release(e);
+			continue;
+		}
+		if (stamp == e->lru_stamp)
+			break;
+		e->lru_stamp = stamp;
+		list_move_tail(&e->lru_list, &p->lru_list);
+	}
+}
 
-	list_for_each_entry(e, &dnetmap_net->dnetmap_iphash[hash_size + h],
-	    grlist)
-		if (memcmp(&e->postnat_addr, &addr, sizeof(addr)) == 0)
-			return e;
-	return NULL;
+static void dnetmap_expire_work(struct work_struct *work)
+{
+	struct dnetmap_net *dnetmap_net =
+		container_of(to_delayed_work(work), struct dnetmap_net,
+		             expire_work);
+	struct dnetmap_prefix *p;
+	bool bound = false;
+
+	mutex_lock(&dnetmap_mutex);
+	list_for_each_entry(p, &dnetmap_net->prefixes, list) {
+		spin_lock_bh(&dnetmap_net->lock);
+		dnetmap_prefix_expire(p);
+		bound |= !list_empty(&p->lru_list);
+		spin_unlock_bh(&dnetmap_net->lock);
+	}
+	mutex_unlock(&dnetmap_mutex);
+
+	/* new dynamic bindings schedule it again */
+	if (bound)
+		schedule_delayed_work(&dnetmap_net->expire_work,
+		                      DNETMAP_EXPIRE_INTERVAL);
 }
 
-static int
-dnetmap_addr_in_prefix(struct dnetmap_net *dnetmap_net, const __be32 addr,
-	struct dnetmap_prefix *p)
+/* entry of the prefix for a postnat key, bound or not */
+static struct dnetmap_entry *
+dnetmap_prefix_entry(const struct dnetmap_prefix *p, const u64 key)
 {
 	struct dnetmap_entry *e;
 
-	list_for_each_entry(e, &p->elist, list)
-		if (memcmp(&e->postnat_addr, &addr, sizeof(addr)) == 0)
-			return 1;
-	return 0;
+	e = rhashtable_lookup_fast(&p->dnetmap->postnat_hash, &key,
+	                           dnetmap_postnat_params);
+	return e != NULL && e->prefix == p ? e : NULL;
 }
 
+/* Needs dnetmap_mutex. */
 static struct dnetmap_prefix *
-dnetmap_prefix_lookup(struct dnetmap_net *dnetmap_net,
+dnetmap_prefix_lookup(struct dnetmap_net *dnetmap_net, __u8 family,
 		      const struct nf_nat_range *mr)
 {
 	struct dnetmap_prefix *p;
 
 	list_for_each_entry(p, &dnetmap_net->prefixes, list)
-		if (memcmp(&p->prefix, mr, sizeof(*mr)) == 0)
+		if (p->family == family &&
+		    memcmp(&p->prefix, mr, sizeof(*mr)) == 0)
 			return p;
 	return NULL;
 }
 
+/* Takes the (unbound) entries of a prefix out of the hash and frees them. */
+static void dnetmap_prefix_free_entries(struct dnetmap_net *dnetmap_net,
+					struct dnetmap_prefix *p)
+{
+	struct dnetmap_entry *e, *next;
+
+	list_for_each_entry(e, &p->elist, list)
+		rhashtable_remove_fast(&dnetmap_net->postnat_hash, &e->grlist,
+		                       dnetmap_postnat_params);
+	/* wait for lookups that may still be looking at the entries */
+	synchronize_rcu();
+	list_for_each_entry_safe(e, next, &p->elist, list)
+		kfree(e);
+}
+
+/* Needs dnetmap_mutex. */
 static void dnetmap_prefix_destroy(struct dnetmap_net *dnetmap_net,
 				 struct dnetmap_prefix *p)
 {
-	struct dnetmap_entry *e, *next;
-	unsigned int i;
+	struct dnetmap_entry *e;
 
 #ifdef CONFIG_PROC_FS
 	remove_proc_entry(p->proc_str_data, dnetmap_net->xt_dnetmap);
 	remove_proc_entry(p->proc_str_stat, dnetmap_net->xt_dnetmap);
 #endif
 
-	for (i = 0; i < hash_size; i++) {
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->dnetmap_iphash[i], glist)
-			if (e->prefix == p)
-				list_del(&e->glist);
-
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->
-					 dnetmap_iphash[hash_size + i], grlist)
-			if (e->prefix == p)
-				list_del(&e->grlist);
-	}
-
-	list_for_each_entry_safe(e, next, &p->elist, list) {
-		list_del(&e->list);
-		if(! (e->flags & XT_DNETMAP_STATIC)) list_del(&e->lru_list);
-		kfree(e);
-	}
-
+	spin_lock_bh(&dnetmap_net->lock);
+	list_for_each_entry(e, &p->elist, list)
+		if (e->prenat_key != 0)
+			dnetmap_entry_unbind(dnetmap_net, e);
+	spin_unlock_bh(&dnetmap_net->lock);
 	list_del(&p->list);
+
+	dnetmap_prefix_free_entries(dnetmap_net, p);
 	kfree(p);
 }
 
-/* function clears bindings without destroying prefix */
+/* function clears bindings without destroying prefix; needs the netns lock */
 static void dnetmap_prefix_softflush(struct dnetmap_prefix *p)
 {
 	struct dnetmap_net *dnetmap_net = p->dnetmap;
-	struct dnetmap_entry *e, *next;
-	unsigned int i;
-
-	for (i = 0; i < hash_size; i++) {
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->dnetmap_iphash[i], glist)
-			if (e->prefix == p)
-				list_del(&e->glist);
+	struct dnetmap_entry *e;
 
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->
-					 dnetmap_iphash[hash_size + i], grlist)
-			if (e->prefix == p)
-				list_del(&e->grlist);
-	}
-	list_for_each_entry_safe(e, next, &p->elist, list) {
+	list_for_each_entry(e, &p->elist, list) {
+		if (e->prenat_key != 0)
+			dnetmap_entry_unbind(dnetmap_net, e);
 
 		/* make dynamic entry of any static entry */
-		if(e->flags & XT_DNETMAP_STATIC){
-			list_add_tail(&e->lru_list, &p->lru_list);
-			e->flags&=~XT_DNETMAP_STATIC;
-		}
-		e->stamp=jiffies-1;
-		e->prenat_addr=0;
+		dnetmap_entry_release(e);
 	}
 }
 
 static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(par->net);
-	const struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
+	struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
 	const struct nf_nat_range *mr = &tginfo->prefix;
 	struct dnetmap_prefix *p;
 	struct dnetmap_entry *e;
@@ -236,10 +541,12 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 	struct proc_dir_entry *pde_data, *pde_stat;
 #endif
 	int ret = -EINVAL;
-	__be32 a;
-	__u32 ip_min, ip_max, ip;
+	union dnetmap_key k;
+	unsigned int plen;
+	u64 n_min, n_max, n;
 
 	/* prefix not specified - no need to do anything */
+	tginfo->p = NULL;
 	if (!(tginfo->flags & XT_DNETMAP_PREFIX)) {
 		ret = 0;
 		return ret;
@@ -250,17 +557,38 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 		return -EINVAL;
 	}
 
+	if (par->family == NFPROTO_IPV6) {
+		/* multicast would clash with IPv4 keys, see dnetmap_key4() */
+		if (ipv6_addr_is_multicast(&mr->min_addr.in6)) {
+			pr_info("prefix must not be multicast\n");
+			return -EINVAL;
+		}
+		n_min = (u64)ntohl(mr->min_addr.ip6[0]) << 32 |
+		        ntohl(mr->min_addr.ip6[1]);
+		n_max = (u64)ntohl(mr->max_addr.ip6[0]) << 32 |
+		        ntohl(mr->max_addr.ip6[1]);
+		if (n_max < n_min || n_max - n_min >= DNETMAP_MAX_NETS6) {
+			pr_info("prefix must be a /48 or longer\n");
+			return -EINVAL;
+		}
+		plen = 64 - fls64(n_min ^ n_max);
+	} else {
+		n_min = ntohl(mr->min_addr.ip) + (whole_prefix == 0);
+		n_max = ntohl(mr->max_addr.ip) - (whole_prefix == 0);
+		plen = 33 - ffs(~((__u32)n_min ^ (__u32)n_max));
+	}
+
 	mutex_lock(&dnetmap_mutex);
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
+	p = dnetmap_prefix_lookup(dnetmap_net, par->family, mr);
 
 	if (p != NULL) {
 		p->refcnt++;
+		tginfo->p = p;
 		ret = 0;
 		goto out;
 	}
 
-	p = kzalloc(sizeof(*p) + sizeof(struct list_head) * hash_size * 2,
-		    GFP_KERNEL);
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
 	if (p == NULL) {
 		ret = -ENOMEM;
 		goto out;
@@ -269,36 +597,61 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 	p->flags = 0;
 	p->flags |= (tginfo->flags & XT_DNETMAP_PERSISTENT);
 	p->dnetmap = dnetmap_net;
+	p->family = par->family;
 	memcpy(&p->prefix, mr, sizeof(*mr));
 
+	INIT_LIST_HEAD(&p->free_list);
 	INIT_LIST_HEAD(&p->lru_list);
 	INIT_LIST_HEAD(&p->elist);
 
-	ip_min = ntohl(mr->min_addr.ip) + (whole_prefix == 0);
-	ip_max = ntohl(mr->max_addr.ip) - (whole_prefix == 0);
-
-	sprintf(p->prefix_str, "%pI4/%u", &mr->min_addr.ip,
-		33 - ffs(~(ip_min ^ ip_max)));
+	if (p->family == NFPROTO_IPV6) {
+		sprintf(p->prefix_str, "%pI6c/%u", &mr->min_addr.in6, plen);
+#ifdef CONFIG_PROC_FS
+		sprintf(p->proc_str_data, "%pI6c_%u", &mr->min_addr.in6, plen);
+		sprintf(p->proc_str_stat, "%pI6c_%u_stat", &mr->min_addr.in6,
+			plen);
+#endif
+	} else {
+		sprintf(p->prefix_str, "%pI4/%u", &mr->min_addr.ip, plen);
 #ifdef CONFIG_PROC_FS
-	sprintf(p->proc_str_data, "%pI4_%u", &mr->min_addr.ip,
-		33 - ffs(~(ip_min ^ ip_max)));
-	sprintf(p->proc_str_stat, "%pI4_%u_stat", &mr->min_addr.ip,
-		33 - ffs(~(ip_min ^ ip_max)));
+		sprintf(p->proc_str_data, "%pI4_%u", &mr->min_addr.ip, plen);
+		sprintf(p->proc_str_stat, "%pI4_%u_stat", &mr->min_addr.ip,
+			plen);
 #endif
+	}
 	printk(KERN_INFO KBUILD_MODNAME ": new prefix %s\n", p->prefix_str);
 
-	for (ip = ip_min; ip <= ip_max; ip++) {
-		a = htonl(ip);
-		e = kmalloc(sizeof(*e), GFP_ATOMIC);
-		if (e == NULL)
-			return 0;
-		e->postnat_addr = a;
-		e->prenat_addr = 0;
+	for (n = n_min; n <= n_max; n++) {
+		if (p->family == NFPROTO_IPV6) {
+			k.w[0] = htonl(n >> 32);
+			k.w[1] = htonl(n);
+		} else {
+			k.key = dnetmap_key4(htonl(n));
+		}
+		e = kmalloc(sizeof(*e), GFP_KERNEL);
+		if (e == NULL) {
+			ret = -ENOMEM;
+			goto out_entries;
+		}
+		e->postnat_key = k.key;
+		e->prenat_key = 0;
 		e->stamp = jiffies;
+		e->lru_stamp = e->stamp;
 		e->prefix = p;
 		e->flags = 0;
-		list_add_tail(&e->lru_list, &p->lru_list);
+		/* plain insert would not notice a duplicate key */
+		ret = rhashtable_lookup_insert_fast(&dnetmap_net->postnat_hash,
+		      &e->grlist, dnetmap_postnat_params);
+		if (ret != 0) {
+			if (ret == -EEXIST)
+				pr_info("prefix %s overlaps another one\n",
+				        p->prefix_str);
+			kfree(e);
+			goto out_entries;
+		}
+		list_add_tail(&e->lru_list, &p->free_list);
 		list_add_tail(&e->list, &p->elist);
+		++p->nr_entries;
 	}
 
 #ifdef CONFIG_PROC_FS
@@ -307,9 +660,8 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 				    dnetmap_net->xt_dnetmap,
 				    &dnetmap_tg_fops, p);
 	if (pde_data == NULL) {
-		kfree(p);
 		ret = -ENOMEM;
-		goto out;
+		goto out_entries;
 	}
 	proc_set_user(pde_data, make_kuid(&init_user_ns, proc_uid),
 	              make_kgid(&init_user_ns, proc_gid));
@@ -319,22 +671,110 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 		                    dnetmap_net->xt_dnetmap,
 		                    &dnetmap_stat_proc_fops, p);
 	if (pde_stat == NULL) {
-		kfree(p);
+		remove_proc_entry(p->proc_str_data, dnetmap_net->xt_dnetmap);
 		ret = -ENOMEM;
-		goto out;
+		goto out_entries;
 	}
 	proc_set_user(pde_stat, make_kuid(&init_user_ns, proc_uid),
 	              make_kgid(&init_user_ns, proc_gid));
 #endif
 
-	spin_lock_bh(&dnetmap_lock);
 	list_add_tail(&p->list, &dnetmap_net->prefixes);
-	spin_unlock_bh(&dnetmap_lock);
+	tginfo->p = p;
 	ret = 0;
 
 out:
 	mutex_unlock(&dnetmap_mutex);
 	return ret;
+out_entries:
+	dnetmap_prefix_free_entries(dnetmap_net, p);
+	kfree(p);
+	goto out;
+}
+
+/*
+ * Whether a binding found for the prenat address can be used as is by
+ * a rule: otherwise, it has timed out and belongs to another prefix.
+ */
+static inline bool
+dnetmap_entry_reusable(const struct dnetmap_entry *e,
+		       const struct dnetmap_prefix *p, __u8 tgflags)
+{
+	return (tgflags & XT_DNETMAP_REUSE) ||
+	       (READ_ONCE(e->flags) & XT_DNETMAP_STATIC) ||
+	       !time_before(READ_ONCE(e->stamp), jiffies) ||
+	       p == e->prefix;
+}
+
+static inline void
+dnetmap_entry_refresh(struct dnetmap_entry *e, __s32 jttl)
+{
+	/* don't reset ttl if flag is set or it is static entry */
+	if (jttl >= 0 && !(READ_ONCE(e->flags) & XT_DNETMAP_STATIC))
+		WRITE_ONCE(e->stamp, jiffies + jttl);
+}
+
+/*
+ * Creates a binding for the prenat key, under the netns lock.
+ * Returns the postnat key, or 0 if there is none to be had.
+ */
+static u64
+dnetmap_bind(struct dnetmap_net *dnetmap_net, struct dnetmap_prefix *p,
+	     const struct xt_DNETMAP_tginfo *tginfo, u64 prenat_key,
+	     __s32 jttl)
+{
+	char buf[DNETMAP_KEY_STRLEN];
+	struct dnetmap_entry *e;
+	u64 postnat_key = 0;
+
+	spin_lock_bh(&dnetmap_net->lock);
+
+	/* another CPU may have got here first */
+	e = dnetmap_entry_lookup(dnetmap_net, prenat_key);
+	if (e != NULL) {
+		if (dnetmap_entry_reusable(e, p, tginfo->flags)) {
+			dnetmap_entry_refresh(e, jttl);
+			postnat_key = e->postnat_key;
+			goto out;
+		}
+		/* timed out in another prefix, and not released yet */
+		dnetmap_event(XT_DNETMAP_EV_TIMEOUT, e->prenat_key,
+		              e->postnat_key);
+		dnetmap_entry_unbind(dnetmap_net, e);
+		dnetmap_entry_release(e);
+	} else if (tginfo->flags & XT_DNETMAP_STATIC) {
+		// finish if it's static only rule
+		goto out;
+	}
+	if (p == NULL)
+		goto out;
+
+	e = list_first_entry_or_null(&p->free_list, struct dnetmap_entry,
+	                             lru_list);
+	if (e == NULL) {
+		if (!disable_log && ! (p->flags & XT_DNETMAP_FULL) ){
+			printk(KERN_INFO KBUILD_MODNAME
+			       ": ip %s - no free adresses in prefix %s\n",
+			       dnetmap_key_str(buf, prenat_key), p->prefix_str);
+			p->flags |= XT_DNETMAP_FULL;
+		}
+		goto out;
+	}
+
+	p->flags &= ~XT_DNETMAP_FULL;
+
+	WRITE_ONCE(e->stamp, jiffies + jttl);
+	e->lru_stamp = e->stamp;
+	if (dnetmap_entry_bind(dnetmap_net, e, prenat_key) != 0)
+		goto out;
+	list_move_tail(&e->lru_list, &p->lru_list);
+	postnat_key = e->postnat_key;
+	dnetmap_event(XT_DNETMAP_EV_BIND, prenat_key, postnat_key);
+	schedule_delayed_work(&dnetmap_net->expire_work,
+	                      DNETMAP_EXPIRE_INTERVAL);
+ out:
+	spin_unlock_bh(&dnetmap_net->lock);
+	return postnat_key;
 }
 
 static unsigned int
@@ -343,7 +783,9 @@ dnetmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
 	struct net *net = dev_net(par->state->in ? par->state->in : par->state->out);
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
 	enum ip_conntrack_info ctinfo;
-	__be32 prenat_ip, postnat_ip, prenat_ip_prev;
+	union nf_inet_addr addr = {};
+	u64 prenat_key, postnat_key;
+	__u8 family = xt_family(par);
 	const struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
 	const struct nf_nat_range *mr = &tginfo->prefix;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
@@ -351,155 +793,89 @@ dnetmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
 #else
 	struct nf_nat_range newrange;
 #endif
+	struct dnetmap_prefix *p = tginfo->p;
 	struct dnetmap_entry *e;
-	struct dnetmap_prefix *p;
 	unsigned int hooknum = par->state->hook;
 	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
 	__s32 jttl = tginfo->flags & XT_DNETMAP_TTL ? tginfo->ttl * HZ : jtimeout;
 
+	if (family == NFPROTO_IPV6)
+		addr.in6 = hooknum == NF_INET_PRE_ROUTING ?
+		           ipv6_hdr(skb)->daddr : ipv6_hdr(skb)->saddr;
+	else
+		addr.ip = hooknum == NF_INET_PRE_ROUTING ?
+		          ip_hdr(skb)->daddr : ip_hdr(skb)->saddr;
+
 	/* in prerouting we try to map postnat-ip to prenat-ip */
 	if (hooknum == NF_INET_PRE_ROUTING) {
-		postnat_ip = ip_hdr(skb)->daddr;
-
-		spin_lock_bh(&dnetmap_lock);
-
-		e = dnetmap_entry_rlookup(dnetmap_net, postnat_ip);
+		postnat_key = dnetmap_inet_to_key(family, &addr);
+		if (family == NFPROTO_IPV6 && !dnetmap_key_is6(postnat_key))
+			return XT_CONTINUE;	/* multicast */
 
+		e = dnetmap_entry_rlookup(dnetmap_net, postnat_key);
 		if (e == NULL)
-			goto no_rev_map;	/* no binding found */
+			return XT_CONTINUE;	/* no binding found */
+		prenat_key = dnetmap_entry_prenat(dnetmap_net, e);
+		if (prenat_key == 0)
+			return XT_CONTINUE;	/* unbound meanwhile */
 
 		/* if prefix is specified, we check if
 		it matches lookedup entry */
-		if (tginfo->flags & XT_DNETMAP_PREFIX)
-			if (memcmp(mr, &e->prefix->prefix, sizeof(*mr)))
-				goto no_rev_map;
-		/* don't reset ttl if flag is set */
-		if (jttl >= 0 && (! (e->flags & XT_DNETMAP_STATIC) ) ) {
-			p = e->prefix;
-			e->stamp = jiffies + jttl;
-			list_move_tail(&e->lru_list, &p->lru_list);
-		}
-
-		spin_unlock_bh(&dnetmap_lock);
+		if (p != NULL && e->prefix != p)
+			return XT_CONTINUE;
+		dnetmap_entry_refresh(e, jttl);
 
+		dnetmap_key_map(&addr, family, prenat_key);
 		memset(&newrange, 0, sizeof(newrange));
 		newrange.flags = mr->flags | NF_NAT_RANGE_MAP_IPS;
-		newrange.min_addr.ip = e->prenat_addr;
-		newrange.max_addr.ip = e->prenat_addr;
+		newrange.min_addr = addr;
+		newrange.max_addr = addr;
 		newrange.min_proto = mr->min_proto;
 		newrange.max_proto = mr->max_proto;
 		return nf_nat_setup_info(ct, &newrange,
 					 HOOK2MANIP(hooknum));
 	}
 
-	prenat_ip = ip_hdr(skb)->saddr;
-	spin_lock_bh(&dnetmap_lock);
-
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
-	e = dnetmap_entry_lookup(dnetmap_net, prenat_ip);
-
-	if (e == NULL) {	/* need for new binding */
-
-		// finish if it's static only rule
-		if(tginfo->flags & XT_DNETMAP_STATIC)
-			goto no_free_ip;
-
-bind_new_prefix:
-		e = list_entry(p->lru_list.next, struct dnetmap_entry,
-			       lru_list);
-		if (e->prenat_addr != 0 && time_before(jiffies, e->stamp)) {
-			if (!disable_log && ! (p->flags & XT_DNETMAP_FULL) ){
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": ip %pI4 - no free adresses in prefix %s\n",
-				       &prenat_ip, p->prefix_str);
-				p->flags |= XT_DNETMAP_FULL;
-			}
-			goto no_free_ip;
-		}
+	prenat_key = dnetmap_inet_to_key(family, &addr);
+	if (family == NFPROTO_IPV6 && !dnetmap_key_is6(prenat_key))
+		return XT_CONTINUE;
+	e = dnetmap_entry_lookup(dnetmap_net, prenat_key);
 
-		p->flags &= ~XT_DNETMAP_FULL;
-		postnat_ip = e->postnat_addr;
-
-		if (e->prenat_addr != 0) {
-			prenat_ip_prev = e->prenat_addr;
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": timeout binding %pI4 -> %pI4\n",
-				       &prenat_ip_prev, &postnat_ip);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-		}
-
-		e->prenat_addr = prenat_ip;
-		e->stamp = jiffies + jttl;
-		list_move_tail(&e->lru_list, &p->lru_list);
-		list_add_tail(&e->glist,
-			      &dnetmap_net->
-			      dnetmap_iphash[dnetmap_entry_hash(prenat_ip)]);
-		list_add_tail(&e->grlist,
-			      &dnetmap_net->dnetmap_iphash[hash_size +
-							   dnetmap_entry_hash
-							   (postnat_ip)]);
-		if (!disable_log)
-			printk(KERN_INFO KBUILD_MODNAME
-			       ": add binding %pI4 -> %pI4\n",
-			       &prenat_ip, &postnat_ip);
+	if (e != NULL && dnetmap_entry_reusable(e, p, tginfo->flags)) {
+		/* the common case, without taking the lock */
+		dnetmap_entry_refresh(e, jttl);
+		postnat_key = e->postnat_key;
 	} else {
-
-		if (!(tginfo->flags & XT_DNETMAP_REUSE) && !(e->flags & XT_DNETMAP_STATIC))
-			if (time_before(e->stamp, jiffies) && p != e->prefix) {
-				if (!disable_log)
-					printk(KERN_INFO KBUILD_MODNAME
-					       ": timeout binding %pI4 -> %pI4\n",
-					       &e->prenat_addr, &e->postnat_addr);
-				list_del(&e->glist);
-				list_del(&e->grlist);
-				e->prenat_addr = 0;
-				goto bind_new_prefix;
-			}
-		/* don't reset ttl if flag is set
-		or it is static entry*/
-		if (jttl >= 0 && ! (e->flags & XT_DNETMAP_STATIC) ) {
-			e->stamp = jiffies + jttl;
-			p = e->prefix;
-			list_move_tail(&e->lru_list, &p->lru_list);
-		}
-		postnat_ip = e->postnat_addr;
+		postnat_key = dnetmap_bind(dnetmap_net, p, tginfo, prenat_key,
+		              jttl);
+		if (postnat_key == 0)
+			return XT_CONTINUE;
 	}
 
-	spin_unlock_bh(&dnetmap_lock);
-
+	/* an IPv6 host keeps its interface identifier */
+	dnetmap_key_map(&addr, family, postnat_key);
 	memset(&newrange, 0, sizeof(newrange));
 	newrange.flags = mr->flags | NF_NAT_RANGE_MAP_IPS;
-	newrange.min_addr.ip = postnat_ip;
-	newrange.max_addr.ip = postnat_ip;
+	newrange.min_addr = addr;
+	newrange.max_addr = addr;
 	newrange.min_proto = mr->min_proto;
 	newrange.max_proto = mr->max_proto;
 	return nf_nat_setup_info(ct, &newrange, HOOK2MANIP(par->state->hook));
-no_rev_map:
-no_free_ip:
-	spin_unlock_bh(&dnetmap_lock);
-	return XT_CONTINUE;
-
 }
 
 static void dnetmap_tg_destroy(const struct xt_tgdtor_param *par)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(par->net);
 	const struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
-	const struct nf_nat_range *mr = &tginfo->prefix;
-	struct dnetmap_prefix *p;
+	struct dnetmap_prefix *p = tginfo->p;
 
-	if (!(tginfo->flags & XT_DNETMAP_PREFIX))
+	if (p == NULL)
 		return;
 
 	mutex_lock(&dnetmap_mutex);
-	spin_lock_bh(&dnetmap_lock);
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
 	if (--p->refcnt == 0 && (! (p->flags & XT_DNETMAP_PERSISTENT) ) ) {
 		dnetmap_prefix_destroy(dnetmap_net, p);
 	}
-	spin_unlock_bh(&dnetmap_lock);
 	mutex_unlock(&dnetmap_mutex);
 }
 
@@ -509,16 +885,17 @@ struct dnetmap_iter_state {
 	unsigned int bucket;
 };
 
+/*
+ * The entry list of a prefix is fixed, and the prefix stays until its proc
+ * files are gone; the bindings may change while they are being printed.
+ */
 static void *dnetmap_seq_start(struct seq_file *seq, loff_t * pos)
-__acquires(dnetmap_lock)
 {
 	struct dnetmap_iter_state *st = seq->private;
 	const struct dnetmap_prefix *prefix = st->p;
 	struct dnetmap_entry *e;
 	loff_t p = *pos;
 
-	spin_lock_bh(&dnetmap_lock);
-
 	list_for_each_entry(e, &prefix->elist, list)
 		if (p-- == 0)
 			return e;
@@ -540,23 +917,28 @@ static void *dnetmap_seq_next(struct seq_file *seq, void *v, loff_t * pos)
 }
 
 static void dnetmap_seq_stop(struct seq_file *s, void *v)
-__releases(dnetmap_lock)
 {
-	spin_unlock_bh(&dnetmap_lock);
 }
 
 static int dnetmap_seq_show(struct seq_file *seq, void *v)
 {
 	const struct dnetmap_entry *e = v;
-
-	if((e->flags & XT_DNETMAP_STATIC) == 0){
-		seq_printf(seq, "%pI4 -> %pI4 --- ttl: %d lasthit: %lu\n",
-		           &e->prenat_addr, &e->postnat_addr,
-		           (int)(e->stamp - jiffies) / HZ,
-		           (e->stamp - jtimeout) / HZ);
+	char prenat[DNETMAP_KEY_STRLEN], postnat[DNETMAP_KEY_STRLEN];
+	u64 prenat_key = READ_ONCE(e->prenat_key);
+	unsigned long stamp = READ_ONCE(e->stamp);
+
+	/* unbound IPv4 entries have always shown as 0.0.0.0 */
+	if (prenat_key == 0 && !dnetmap_key_is6(e->postnat_key))
+		prenat_key = dnetmap_key4(0);
+	dnetmap_key_str(prenat, prenat_key);
+	dnetmap_key_str(postnat, e->postnat_key);
+	if((READ_ONCE(e->flags) & XT_DNETMAP_STATIC) == 0){
+		seq_printf(seq, "%s -> %s --- ttl: %d lasthit: %lu\n",
+		           prenat, postnat, (int)(stamp - jiffies) / HZ,
+		           (stamp - jtimeout) / HZ);
 	}else{
-		seq_printf(seq, "%pI4 -> %pI4 --- ttl: S lasthit: S\n",
-		           &e->prenat_addr, &e->postnat_addr);
+		seq_printf(seq, "%s -> %s --- ttl: S lasthit: S\n",
+		           prenat, postnat);
 	}
 	return 0;
 }
@@ -579,174 +961,199 @@ static int dnetmap_seq_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static ssize_t
-dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, loff_t *loff)
+/*
+ * Binds the entry to the prenat key, undoing any binding that either
+ * of them has. Needs the netns lock.
+ */
+static int dnetmap_entry_rebind(struct dnetmap_net *dnetmap_net,
+				struct dnetmap_entry *e, u64 prenat_key)
 {
-	struct dnetmap_prefix *p = pde_data(file_inode(file));
-	struct dnetmap_entry *e;
-	char buf[sizeof("+192.168.100.100:200.200.200.200")];
-	const char *c = buf;
-	const char *c2;
-	__be32 addr1,addr2;
-	bool add;
-	char str[25];
+	struct dnetmap_entry *e1;
 
-	if (size == 0)
+	if (e->prenat_key == prenat_key)
 		return 0;
-	if (size > sizeof(buf))
-		size = sizeof(buf);
-	if (copy_from_user(buf, input, size) != 0)
-		return -EFAULT;
-	if(strcspn(c,"\n") < size)
-		buf[strcspn(c,"\n")]='\0';
-
-	/* Strict protocol! */
-	if (*loff != 0)
-		return -ESPIPE;
-	switch (*c) {
-		case 'f': /* flush table */
-			if( strcmp(c,"flush") != 0 )
-				goto invalid_arg;
-			printk(KERN_INFO KBUILD_MODNAME ": flushing prefix %s\n", p->prefix_str);
-			spin_lock_bh(&dnetmap_lock);
-			dnetmap_prefix_softflush(p);
-			spin_unlock_bh(&dnetmap_lock);
-			return size;
-		case '-': /* remove address or attribute */
-			if( strcmp(c,"-persistent") == 0){
-				/* case if persistent flag is already unset */
-				if( ! (p->flags & XT_DNETMAP_PERSISTENT) ){
-					printk(KERN_INFO KBUILD_MODNAME ": prefix %s is not persistent already - doing nothing\n", p->prefix_str);
-					return size;
-				}
-				printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now non-persistent\n", p->prefix_str);
-				spin_lock_bh(&dnetmap_lock);
-				p->flags &= ~XT_DNETMAP_PERSISTENT;
-				spin_unlock_bh(&dnetmap_lock);
-				return size;
-			}
-			add = false;
-			break;
-		case '+': /* add address or attribute */
-			if( strcmp(c,"+persistent") == 0){
-				/* case if persistent flag is already unset */
-				if( p->flags & XT_DNETMAP_PERSISTENT ){
-					printk(KERN_INFO KBUILD_MODNAME ": prefix %s is persistent already - doing nothing\n", p->prefix_str);
-					return size;
-				}
-				printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now persistent\n", p->prefix_str);
-				spin_lock_bh(&dnetmap_lock);
-				p->flags |= XT_DNETMAP_PERSISTENT;
-				spin_unlock_bh(&dnetmap_lock);
-				return size;
-			}
-			add = true;
-			break;
-		default:
-			goto invalid_arg;
+	if (e->prenat_key != 0) {
+		dnetmap_event(XT_DNETMAP_EV_TIMEOUT, e->prenat_key,
+		              e->postnat_key);
+		dnetmap_entry_unbind(dnetmap_net, e);
 	}
 
-	spin_lock_bh(&dnetmap_lock);
+	// prenat ip may be bound to another address already
+	e1 = dnetmap_entry_lookup(dnetmap_net, prenat_key);
+	if (e1 != NULL) {
+		dnetmap_event(XT_DNETMAP_EV_REMOVE, e1->prenat_key,
+		              e1->postnat_key);
+		dnetmap_entry_unbind(dnetmap_net, e1);
+		dnetmap_entry_release(e1);
+	}
+	return dnetmap_entry_bind(dnetmap_net, e, prenat_key);
+}
 
-	// in case static entry is added we need to parse second ip addresses
-	if (add){
-		c2 = strchr(c,':');
-		if(c2 == NULL)
-			goto invalid_arg_unlock;
+/*
+ * Parses an address of the family of the prefix, up to @delim, into a key.
+ * Only the /64 of an IPv6 address counts.
+ */
+static int dnetmap_parse_key(const struct dnetmap_prefix *p, const char *c,
+			     int delim, const char **end, u64 *key)
+{
+	union nf_inet_addr a;
 
-		c++;
-		c2++;
+	if (p->family == NFPROTO_IPV6) {
+		if (!in6_pton(c, -1, (void *)&a.in6, delim, end))
+			return -EINVAL;
+		*key = dnetmap_key6(&a.in6);
+		return dnetmap_key_is6(*key) && *key != 0 ? 0 : -EINVAL;
+	}
+	if (!in4_pton(c, -1, (void *)&a.ip, delim, end))
+		return -EINVAL;
+	*key = dnetmap_key4(a.ip);
+	return 0;
+}
 
-		if( ! (in4_pton(c2,strlen(c2),(void *)&addr2, '\0', NULL) &&
-			  in4_pton(c,strlen(c),(void *)&addr1, ':', NULL)))
-			goto invalid_arg_unlock;
+/*
+ * Adds a static binding prenat:postnat, or "prenat postnat" for IPv6;
+ * needs the netns lock.
+ */
+static int dnetmap_static_add(struct dnetmap_prefix *p, const char *c)
+{
+	struct dnetmap_net *dnetmap_net = p->dnetmap;
+	int delim = p->family == NFPROTO_IPV6 ? ' ' : ':';
+	struct dnetmap_entry *e;
+	const char *c2;
+	u64 addr1, addr2;
 
-		// sanity check - prenat ip can't belong to postnat prefix
-		if ( dnetmap_addr_in_prefix(p->dnetmap, addr1, p)){
-			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - prenat ip can't belong to postnat prefix\n");
-			goto invalid_arg_unlock;
-		}
+	if (dnetmap_parse_key(p, c, delim, &c2, &addr1) != 0 || *c2 != delim ||
+	    dnetmap_parse_key(p, c2 + 1, '\0', NULL, &addr2) != 0)
+		return -EINVAL;
 
-		// make sure postnat ip belongs to postnat prefix
-		if ( ! dnetmap_addr_in_prefix(p->dnetmap, addr2, p)){
-			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - postnat ip must belong to postnat prefix\n");
-			goto invalid_arg_unlock;
-		}
+	// sanity check - prenat ip can't belong to postnat prefix
+	if (dnetmap_prefix_entry(p, addr1) != NULL) {
+		printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - prenat ip can't belong to postnat prefix\n");
+		return -EINVAL;
+	}
 
-		e = dnetmap_entry_rlookup(p->dnetmap,addr2);
-		if(e != NULL){
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": timeout binding %pI4 -> %pI4\n",
-				       &e->prenat_addr, &e->postnat_addr);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-		}else{
-			// find existing entry in prefix elist
-			list_for_each_entry(e, &p->elist, list)
-				if (memcmp(&e->postnat_addr, &addr2, sizeof(addr2)) == 0){
-					break;
-				}
-		}
+	// make sure postnat ip belongs to postnat prefix
+	e = dnetmap_prefix_entry(p, addr2);
+	if (e == NULL) {
+		printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - postnat ip must belong to postnat prefix\n");
+		return -EINVAL;
+	}
 
-		e->prenat_addr=addr1;
-		e->flags |= XT_DNETMAP_STATIC;
-		list_add_tail(&e->glist,
-			      &p->dnetmap->
-			      dnetmap_iphash[dnetmap_entry_hash(e->prenat_addr)]);
-		list_add_tail(&e->grlist,
-			      &p->dnetmap->dnetmap_iphash[hash_size +
-							   dnetmap_entry_hash
-							   (e->postnat_addr)]);
+	if (!(e->flags & XT_DNETMAP_STATIC))
 		list_del(&e->lru_list);
+	WRITE_ONCE(e->flags, e->flags | XT_DNETMAP_STATIC);
+	if (dnetmap_entry_rebind(dnetmap_net, e, addr1) != 0) {
+		dnetmap_entry_release(e);
+		return -EINVAL;
+	}
 
-		sprintf(str, "%pI4:%pI4", &addr1, &addr2);
-		printk(KERN_INFO KBUILD_MODNAME ": adding static binding %s\n", str);
+	dnetmap_event(XT_DNETMAP_EV_STATIC, addr1, addr2);
+	return 0;
+}
 
-	// case of removing binding
-	}else{
+/* Removes the binding of a prenat or postnat address; needs the netns lock. */
+static int dnetmap_static_del(struct dnetmap_prefix *p, const char *c)
+{
+	struct dnetmap_net *dnetmap_net = p->dnetmap;
+	struct dnetmap_entry *e;
+	u64 addr1;
 
-		c++;
-		if( ! in4_pton(c,strlen(c),(void *)&addr1, '\0', NULL))
-			goto invalid_arg_unlock;
-
-		e = dnetmap_entry_rlookup(p->dnetmap,addr1);
-		if(e == NULL) e = dnetmap_entry_lookup(p->dnetmap,addr1);
-
-		if(e != NULL){
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": remove binding %pI4 -> %pI4\n",
-				       &e->prenat_addr, &e->postnat_addr);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-			if(e->flags & XT_DNETMAP_STATIC){
-				list_add_tail(&e->lru_list,&p->lru_list);
-				e->flags &= ~XT_DNETMAP_STATIC;
-			}
-			e->prenat_addr=0;
-			e->stamp=jiffies-1;
-		}else{
-			goto invalid_arg_unlock;
+	if (dnetmap_parse_key(p, c, '\0', NULL, &addr1) != 0)
+		return -EINVAL;
+
+	e = dnetmap_entry_rlookup(dnetmap_net, addr1);
+	if (e == NULL)
+		e = dnetmap_entry_lookup(dnetmap_net, addr1);
+	if (e == NULL)
+		return -EINVAL;
+
+	dnetmap_event(XT_DNETMAP_EV_REMOVE, e->prenat_key, e->postnat_key);
+	dnetmap_entry_unbind(dnetmap_net, e);
+	dnetmap_entry_release(e);
+	return 0;
+}
+
+/* One command line written to a prefix file; needs the netns lock. */
+static int dnetmap_proc_cmd(struct dnetmap_prefix *p, const char *c)
+{
+	switch (*c) {
+	case 'f': /* flush table */
+		if (strcmp(c, "flush") != 0)
+			return -EINVAL;
+		printk(KERN_INFO KBUILD_MODNAME ": flushing prefix %s\n", p->prefix_str);
+		dnetmap_prefix_softflush(p);
+		return 0;
+	case '-': /* remove address or attribute */
+		if (strcmp(c, "-persistent") != 0)
+			return dnetmap_static_del(p, c + 1);
+		/* case if persistent flag is already unset */
+		if (!(p->flags & XT_DNETMAP_PERSISTENT)) {
+			printk(KERN_INFO KBUILD_MODNAME ": prefix %s is not persistent already - doing nothing\n", p->prefix_str);
+			return 0;
+		}
+		printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now non-persistent\n", p->prefix_str);
+		p->flags &= ~XT_DNETMAP_PERSISTENT;
+		return 0;
+	case '+': /* add address or attribute */
+		if (strcmp(c, "+persistent") != 0)
+			return dnetmap_static_add(p, c + 1);
+		if (p->flags & XT_DNETMAP_PERSISTENT) {
+			printk(KERN_INFO KBUILD_MODNAME ": prefix %s is persistent already - doing nothing\n", p->prefix_str);
+			return 0;
 		}
+		printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now persistent\n", p->prefix_str);
+		p->flags |= XT_DNETMAP_PERSISTENT;
+		return 0;
 	}
+	return -EINVAL;
+}
 
-	spin_unlock_bh(&dnetmap_lock);
-
-	/* Note we removed one above */
-	*loff += size + 1;
-	return size + 1;
+/*
+ * A write may carry any number of commands, one per line; they are all
+ * carried out under one hold of the lock. Up to the last newline is
+ * consumed, so a line split across writes is taken up by the next one.
+ * If a line is invalid, the write ends before it.
+ */
+static ssize_t
+dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, loff_t *loff)
+{
+	struct dnetmap_prefix *p = pde_data(file_inode(file));
+	char *buf, *line, *next, *end;
+	size_t done = 0;
+	int ret = 0;
 
-	invalid_arg_unlock:
-		spin_unlock_bh(&dnetmap_lock);
+	if (size == 0)
+		return 0;
+	if (size > DNETMAP_WRITE_MAX)
+		size = DNETMAP_WRITE_MAX;
+	buf = memdup_user_nul(input, size);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	end = strrchr(buf, '\n');
+	if (end != NULL)
+		size = end - buf + 1;
+
+	spin_lock_bh(&p->dnetmap->lock);
+	for (line = buf; done < size; line = next) {
+		next = strchrnul(line, '\n');
+		*next++ = '\0';
+		if (*line != '\0')
+			ret = dnetmap_proc_cmd(p, line);
+		if (ret < 0)
+			break;
+		done = next - buf;
+	}
+	spin_unlock_bh(&p->dnetmap->lock);
+	kfree(buf);
 
-	invalid_arg:
-		//printk(KERN_INFO KBUILD_MODNAME ": Need \"+prenat_ip:postnat_ip\", \"-ip\" or \"/\"\n");
+	if (ret < 0) {
 		printk(KERN_INFO KBUILD_MODNAME ": Error! Invalid option passed via procfs.\n");
-		return -EINVAL;
+		if (done == 0)
+			return ret;
+	}
+	return min(done, size);
 }
 
-
 static const struct proc_ops dnetmap_tg_fops = {
 	.proc_open    = dnetmap_seq_open,
 	.proc_read    = seq_read,
@@ -764,16 +1171,16 @@ static int dnetmap_stat_proc_show(struct seq_file *m, void *data)
 
 	used=used_static=all=sum_ttl=0;
 
-	spin_lock_bh(&dnetmap_lock);
+	spin_lock_bh(&p->dnetmap->lock);
 
 	list_for_each_entry(e, &p->elist, list) {
 
-		if (e->prenat_addr != 0){
+		if (e->prenat_key != 0){
 			if (e->flags & XT_DNETMAP_STATIC){
 				used_static++;
 			}else{
 				ttl = e->stamp - jiffies;
-				if (e->prenat_addr != 0 && ttl >= 0) {
+				if (e->prenat_key != 0 && ttl >= 0) {
 					used++;
 					sum_ttl += ttl;
 				}
@@ -785,7 +1192,7 @@ static int dnetmap_stat_proc_show(struct seq_file *m, void *data)
 	sum_ttl = used > 0 ? sum_ttl / (used * HZ) : 0;
 	seq_printf(m, "%u %u %u %ld %s\n", used, used_static, all, sum_ttl,(p->flags & XT_DNETMAP_PERSISTENT ? "persistent" : ""));
 
-	spin_unlock_bh(&dnetmap_lock);
+	spin_unlock_bh(&p->dnetmap->lock);
 
 	return 0;
 }
@@ -802,18 +1209,257 @@ static const struct proc_ops dnetmap_stat_proc_fops = {
 	.proc_release = single_release,
 };
 
+/*
+ * Binary dump of the bindings of all prefixes, a snapshot taken at open
+ * so that readers do not hold any lock. Writing such records back loads
+ * them, e.g. after a module reload or on a standby box.
+ */
+struct dnetmap_dump {
+	size_t len;
+	struct xt_DNETMAP_binding rec[];
+};
+
+static int dnetmap_dump_open(struct inode *inode, struct file *file)
+{
+	struct dnetmap_net *dnetmap_net = pde_data(inode);
+	const struct dnetmap_prefix *p;
+	const struct dnetmap_entry *e;
+	struct xt_DNETMAP_binding *b;
+	struct dnetmap_dump *d;
+	unsigned int n = 0;
+
+	if (!(file->f_mode & FMODE_READ))
+		return 0;
+
+	mutex_lock(&dnetmap_mutex);
+	list_for_each_entry(p, &dnetmap_net->prefixes, list)
+		n += p->nr_entries;
+	d = kvmalloc(sizeof(*d) + n * sizeof(*b), GFP_KERNEL);
+	if (d == NULL) {
+		mutex_unlock(&dnetmap_mutex);
+		return -ENOMEM;
+	}
+	b = d->rec;
+	list_for_each_entry(p, &dnetmap_net->prefixes, list) {
+		spin_lock_bh(&dnetmap_net->lock);
+		list_for_each_entry(e, &p->elist, list) {
+			if (e->prenat_key == 0)
+				continue;
+			memset(b, 0, sizeof(*b));
+			dnetmap_key_to_inet(&b->prenat_addr, e->prenat_key);
+			dnetmap_key_to_inet(&b->postnat_addr, e->postnat_key);
+			b->family = p->family;
+			b->flags  = e->flags & XT_DNETMAP_STATIC;
+			if (!(e->flags & XT_DNETMAP_STATIC))
+				b->ttl = (long)(e->stamp - jiffies) / HZ;
+			++b;
+		}
+		spin_unlock_bh(&dnetmap_net->lock);
+	}
+	mutex_unlock(&dnetmap_mutex);
+
+	d->len = (b - d->rec) * sizeof(*b);
+	file->private_data = d;
+	return 0;
+}
+
+static ssize_t dnetmap_dump_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	const struct dnetmap_dump *d = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, d->rec, d->len);
+}
+
+/*
+ * Loads one record; the postnat address must be part of a prefix. Needs
+ * dnetmap_mutex, which keeps the entries found in the hash from going
+ * away, and the netns lock.
+ */
+static int dnetmap_binding_load(struct dnetmap_net *dnetmap_net,
+				const struct xt_DNETMAP_binding *b)
+{
+	u64 prenat_key, postnat_key;
+	struct dnetmap_entry *e;
+	bool changed;
+	long ttl;
+
+	if (b->family != NFPROTO_IPV4 && b->family != NFPROTO_IPV6)
+		return -EINVAL;
+	prenat_key  = dnetmap_inet_to_key(b->family, &b->prenat_addr);
+	postnat_key = dnetmap_inet_to_key(b->family, &b->postnat_addr);
+	if (b->family == NFPROTO_IPV6 ? prenat_key == 0 ||
+	    !dnetmap_key_is6(prenat_key) : b->prenat_addr.ip == 0)
+		return -EINVAL;
+
+	e = rhashtable_lookup_fast(&dnetmap_net->postnat_hash,
+	    &postnat_key, dnetmap_postnat_params);
+	if (e == NULL || rhashtable_lookup_fast(&dnetmap_net->postnat_hash,
+	    &prenat_key, dnetmap_postnat_params) != NULL)
+		return -EINVAL;
+
+	if (b->flags & XT_DNETMAP_STATIC) {
+		if (!(e->flags & XT_DNETMAP_STATIC))
+			list_del(&e->lru_list);
+		WRITE_ONCE(e->flags, e->flags | XT_DNETMAP_STATIC);
+	} else {
+		if (e->flags & XT_DNETMAP_STATIC)
+			list_add(&e->lru_list, &e->prefix->lru_list);
+		else
+			list_move(&e->lru_list, &e->prefix->lru_list);
+		WRITE_ONCE(e->flags, e->flags & ~XT_DNETMAP_STATIC);
+		ttl = clamp_t(long, b->ttl, -INT_MAX / HZ, INT_MAX / HZ);
+		WRITE_ONCE(e->stamp, jiffies + ttl * HZ);
+		/*
+		 * The records do not come in LRU order. At the head of the
+		 * list, and marked as refreshed, the entry is either released
+		 * or put in its place by the next dnetmap_prefix_expire().
+		 */
+		e->lru_stamp = e->stamp - 1;
+	}
+
+	changed = e->prenat_key != prenat_key;
+	if (dnetmap_entry_rebind(dnetmap_net, e, prenat_key) != 0) {
+		dnetmap_entry_release(e);
+		return -EINVAL;
+	}
+	if (changed)
+		dnetmap_event(e->flags & XT_DNETMAP_STATIC ?
+		              XT_DNETMAP_EV_STATIC : XT_DNETMAP_EV_BIND,
+		              e->prenat_key, e->postnat_key);
+	return 0;
+}
+
+/* Whole records only; the ones that do not fit any prefix are skipped. */
+static ssize_t dnetmap_dump_write(struct file *file, const char __user *input,
+				  size_t size, loff_t *loff)
+{
+	struct dnetmap_net *dnetmap_net = pde_data(file_inode(file));
+	const struct xt_DNETMAP_binding *rec;
+	unsigned int n, i, loaded = 0;
+
+	if (size > DNETMAP_WRITE_MAX)
+		size = DNETMAP_WRITE_MAX;
+	n = size / sizeof(*rec);
+	if (n == 0)
+		return -EINVAL;
+	size = n * sizeof(*rec);
+	rec = memdup_user(input, size);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+
+	mutex_lock(&dnetmap_mutex);
+	spin_lock_bh(&dnetmap_net->lock);
+	for (i = 0; i < n; ++i)
+		if (dnetmap_binding_load(dnetmap_net, &rec[i]) == 0)
+			++loaded;
+	spin_unlock_bh(&dnetmap_net->lock);
+	mutex_unlock(&dnetmap_mutex);
+	kfree(rec);
+	if (loaded > 0)
+		schedule_delayed_work(&dnetmap_net->expire_work,
+		                      DNETMAP_EXPIRE_INTERVAL);
+
+	printk(KERN_INFO KBUILD_MODNAME ": loaded %u bindings, skipped %u\n",
+	       loaded, n - loaded);
+	return size;
+}
+
+static int dnetmap_dump_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct proc_ops dnetmap_dump_proc_fops = {
+	.proc_open    = dnetmap_dump_open,
+	.proc_read    = dnetmap_dump_read,
+	.proc_write   = dnetmap_dump_write,
+	.proc_lseek   = default_llseek,
+	.proc_release = dnetmap_dump_release,
+};
+
+/* for hash statistics: load factor and chain lengths */
+static void dnetmap_hash_show(struct seq_file *m, const char *name,
+			      struct rhashtable *ht)
+{
+	unsigned int chains[5] = {0}, nelems, size, len, max_len = 0, i;
+	struct bucket_table *tbl;
+	struct rhash_head *pos;
+
+	rcu_read_lock();
+	nelems = atomic_read(&ht->nelems);
+	tbl = rht_dereference_rcu(ht->tbl, ht);
+	size = tbl->size;
+	for (i = 0; i < size; ++i) {
+		len = 0;
+		rht_for_each_rcu(pos, tbl, i)
+			++len;
+		if (len > max_len)
+			max_len = len;
+		++chains[min_t(unsigned int, len, ARRAY_SIZE(chains) - 1)];
+	}
+	rcu_read_unlock();
+
+	seq_printf(m, "%s: entries %u buckets %u load %u.%02u max_chain %u "
+	           "chains 0:%u 1:%u 2:%u 3:%u 4+:%u\n", name, nelems, size,
+	           nelems / size, nelems * 100 / size % 100, max_len,
+	           chains[0], chains[1], chains[2], chains[3], chains[4]);
+}
+
+static int dnetmap_hash_proc_show(struct seq_file *m, void *data)
+{
+	struct dnetmap_net *dnetmap_net = m->private;
+
+	dnetmap_hash_show(m, "prenat", &dnetmap_net->prenat_hash);
+	dnetmap_hash_show(m, "postnat", &dnetmap_net->postnat_hash);
+	return 0;
+}
+
+static int dnetmap_hash_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dnetmap_hash_proc_show, pde_data(inode));
+}
+
+static const struct proc_ops dnetmap_hash_proc_fops = {
+	.proc_open    = dnetmap_hash_proc_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
 static int __net_init dnetmap_proc_net_init(struct net *net)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
+	struct proc_dir_entry *pde;
 
 	dnetmap_net->xt_dnetmap = proc_mkdir("xt_DNETMAP", net->proc_net);
 	if (dnetmap_net->xt_dnetmap == NULL)
 		return -ENOMEM;
+	if (proc_create_data("hash_stat", S_IRUGO, dnetmap_net->xt_dnetmap,
+	    &dnetmap_hash_proc_fops, dnetmap_net) == NULL)
+		goto out_dir;
+	/* as private as the prefix files */
+	pde = proc_create_data("bindings", proc_perms,
+	      dnetmap_net->xt_dnetmap, &dnetmap_dump_proc_fops, dnetmap_net);
+	if (pde == NULL)
+		goto out_hash;
+	proc_set_user(pde, make_kuid(&init_user_ns, proc_uid),
+	              make_kgid(&init_user_ns, proc_gid));
 	return 0;
+ out_hash:
+	remove_proc_entry("hash_stat", dnetmap_net->xt_dnetmap);
+ out_dir:
+	remove_proc_entry("xt_DNETMAP", net->proc_net);
+	return -ENOMEM;
 }
 
 static void __net_exit dnetmap_proc_net_exit(struct net *net)
 {
+	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
+
+	remove_proc_entry("bindings", dnetmap_net->xt_dnetmap);
+	remove_proc_entry("hash_stat", dnetmap_net->xt_dnetmap);
 	remove_proc_entry("xt_DNETMAP", net->proc_net);
 }
 
@@ -831,17 +1477,28 @@ static inline void dnetmap_proc_net_exit(struct net *net)
 static int __net_init dnetmap_net_init(struct net *net)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
-	int i;
-
-	dnetmap_net->dnetmap_iphash = kmalloc(sizeof(struct list_head) *
-					      hash_size * 2, GFP_ATOMIC);
-	if (dnetmap_net->dnetmap_iphash == NULL)
-		return -ENOMEM;
+	int ret;
 
+	spin_lock_init(&dnetmap_net->lock);
 	INIT_LIST_HEAD(&dnetmap_net->prefixes);
-	for (i = 0; i < hash_size * 2; i++)
-		INIT_LIST_HEAD(&dnetmap_net->dnetmap_iphash[i]);
-	return dnetmap_proc_net_init(net);
+	INIT_DELAYED_WORK(&dnetmap_net->expire_work, dnetmap_expire_work);
+	ret = rhashtable_init(&dnetmap_net->prenat_hash,
+	      &dnetmap_prenat_params);
+	if (ret < 0)
+		return ret;
+	ret = rhashtable_init(&dnetmap_net->postnat_hash,
+	      &dnetmap_postnat_params);
+	if (ret < 0)
+		goto out_prenat;
+	ret = dnetmap_proc_net_init(net);
+	if (ret < 0)
+		goto out_postnat;
+	return 0;
+ out_postnat:
+	rhashtable_destroy(&dnetmap_net->postnat_hash);
+ out_prenat:
+	rhashtable_destroy(&dnetmap_net->prenat_hash);
+	return ret;
 }
 
 static void __net_exit dnetmap_net_exit(struct net *net)
@@ -850,19 +1507,21 @@ static void __net_exit dnetmap_net_exit(struct net *net)
 	struct dnetmap_prefix *p,*next;
 
 	mutex_lock(&dnetmap_mutex);
-	spin_lock_bh(&dnetmap_lock);
 
 	list_for_each_entry_safe(p, next, &dnetmap_net->prefixes, list){
 		BUG_ON(p->refcnt != 0);
 		dnetmap_prefix_destroy(dnetmap_net, p);
 	}
 
-	spin_unlock_bh(&dnetmap_lock);
 	mutex_unlock(&dnetmap_mutex);
 
-	kfree(dnetmap_net->dnetmap_iphash);
-	kfree(dnetmap_net);
+	/* with no prefixes left, it does not schedule itself again */
+	cancel_delayed_work_sync(&dnetmap_net->expire_work);
+
+	/* the netns core frees dnetmap_net itself */
 	dnetmap_proc_net_exit(net);
+	rhashtable_destroy(&dnetmap_net->prenat_hash);
+	rhashtable_destroy(&dnetmap_net->postnat_hash);
 }
 
 static struct pernet_operations dnetmap_net_ops = {
@@ -872,38 +1531,67 @@ static struct pernet_operations dnetmap_net_ops = {
 	.size = sizeof(struct dnetmap_net),
 };
 
-static struct xt_target dnetmap_tg_reg __read_mostly = {
-	.name       = "DNETMAP",
-	.family     = NFPROTO_IPV4,
-	.target     = dnetmap_tg,
-	.targetsize = sizeof(struct xt_DNETMAP_tginfo),
-	.table      = "nat",
-	.hooks      = (1 << NF_INET_POST_ROUTING) | (1 << NF_INET_LOCAL_OUT) |
-	              (1 << NF_INET_PRE_ROUTING),
-	.checkentry = dnetmap_tg_check,
-	.destroy    = dnetmap_tg_destroy,
-	.me         = THIS_MODULE
+static struct xt_target dnetmap_tg_reg[] __read_mostly = {
+	{
+		.name       = "DNETMAP",
+		.revision   = 1,
+		.family     = NFPROTO_IPV4,
+		.target     = dnetmap_tg,
+		.targetsize = sizeof(struct xt_DNETMAP_tginfo),
+		.table      = "nat",
+		.hooks      = (1 << NF_INET_POST_ROUTING) |
+		              (1 << NF_INET_LOCAL_OUT) |
+		              (1 << NF_INET_PRE_ROUTING),
+		.checkentry = dnetmap_tg_check,
+		.destroy    = dnetmap_tg_destroy,
+		.me         = THIS_MODULE,
+	},
+#ifdef WITH_IPV6
+	{
+		.name       = "DNETMAP",
+		.revision   = 1,
+		.family     = NFPROTO_IPV6,
+		.target     = dnetmap_tg,
+		.targetsize = sizeof(struct xt_DNETMAP_tginfo),
+		.table      = "nat",
+		.hooks      = (1 << NF_INET_POST_ROUTING) |
+		              (1 << NF_INET_LOCAL_OUT) |
+		              (1 << NF_INET_PRE_ROUTING),
+		.checkentry = dnetmap_tg_check,
+		.destroy    = dnetmap_tg_destroy,
+		.me         = THIS_MODULE,
+	},
+#endif
 };
 
 static int __init dnetmap_tg_init(void)
 {
 	int err;
 
-	/* verify parameters */
-	if (ffs(hash_size) != fls(hash_size) || hash_size <= 0) {
-		pr_info("bad hash_size parameter value - using defaults");
-		hash_size = default_hash_size;
-	}
-
 	jtimeout = default_ttl * HZ;
 
+#if !IS_ENABLED(CONFIG_CONNECTOR)
+	if (nl_multicast_group != -1)
+		pr_info("CONFIG_CONNECTOR not present; "
+		        "binding events go to klog\n");
+#endif
+	if (nl_multicast_group > 0) {
+		err = dnetmap_nl_alloc();
+		if (err)
+			return err;
+	}
+
 	err = register_pernet_subsys(&dnetmap_net_ops);
-	if (err)
+	if (err) {
+		dnetmap_nl_free();
 		return err;
+	}
 
-	err = xt_register_target(&dnetmap_tg_reg);
-	if (err)
+	err = xt_register_targets(dnetmap_tg_reg, ARRAY_SIZE(dnetmap_tg_reg));
+	if (err) {
 		unregister_pernet_subsys(&dnetmap_net_ops);
+		dnetmap_nl_free();
+	}
 
 	printk( KERN_INFO KBUILD_MODNAME " INIT successfull (version %d)\n", DNETMAP_VERSION );
 
@@ -912,8 +1600,9 @@ static int __init dnetmap_tg_init(void)
 
 static void __exit dnetmap_tg_exit(void)
 {
-	xt_unregister_target(&dnetmap_tg_reg);
+	xt_unregister_targets(dnetmap_tg_reg, ARRAY_SIZE(dnetmap_tg_reg));
 	unregister_pernet_subsys(&dnetmap_net_ops);
+	dnetmap_nl_free();
 }
 #else /* CONFIG_NF_NAT */
 static int __init dnetmap_tg_init(void)
@@ -928,5 +1617,6 @@ module_init(dnetmap_tg_init);
 module_exit(dnetmap_tg_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Marek Kierdelewicz <marek@piasta.pl>");
-MODULE_DESCRIPTION("Xtables: dynamic two-way 1:1 NAT mapping of IPv4 addresses");
+MODULE_DESCRIPTION("Xtables: dynamic two-way 1:1 NAT mapping of IPv4 addresses and IPv6 networks");
 MODULE_ALIAS("ipt_DNETMAP");
+MODULE_ALIAS("ip6t_DNETMAP");
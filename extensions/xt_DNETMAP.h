@@ -10,8 +10,63 @@ enum {
 	XT_DNETMAP_FULL				 	= 1 << 5,
 };
 
+/* binding events */
+enum {
+	XT_DNETMAP_EV_BIND = 1,
+	XT_DNETMAP_EV_TIMEOUT,
+	XT_DNETMAP_EV_REMOVE,
+	XT_DNETMAP_EV_STATIC,
+};
+
+enum {
+	/* events per connector message, at most */
+	XT_DNETMAP_NL_BATCH = 64,
+	/* cn_msg.id of the events; the index is shared by Xtables-addons */
+	XT_DNETMAP_CN_IDX = 0x78746100,
+	XT_DNETMAP_CN_VAL = 2,
+};
+
+struct dnetmap_prefix;
+
+/*
+ * Records of /proc/net/xt_DNETMAP/bindings; the addresses are in network
+ * byte order, the rest in host byte order. IPv6 bindings are between /64
+ * networks, whose addresses have the lower 64 bits clear.
+ */
+struct xt_DNETMAP_binding {
+	union nf_inet_addr prenat_addr, postnat_addr;
+	/* seconds until a dynamic binding times out */
+	__s32 ttl;
+	/* XT_DNETMAP_STATIC */
+	__u8 flags;
+	/* NFPROTO_IPV4 or NFPROTO_IPV6 */
+	__u8 family;
+	__u8 pad[2];
+};
+
+/*
+ * Binding events as sent to the nl_multicast_group connector group, up to
+ * XT_DNETMAP_NL_BATCH of them in a message, cn_msg.len bytes in all.
+ * cn_msg.ack is the number of events the kernel failed to send before
+ * that message. The addresses are as in struct xt_DNETMAP_binding.
+ *
+ * @time:	nanoseconds since the epoch
+ * @type:	XT_DNETMAP_EV_*
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ */
+struct xt_DNETMAP_event {
+	__u64 time;
+	union nf_inet_addr prenat_addr, postnat_addr;
+	__u8 type;
+	__u8 family;
+	__u8 pad[6];
+};
+
 struct xt_DNETMAP_tginfo {
 	struct nf_nat_range prefix;
 	__u8 flags;
 	__s32 ttl;
+
+	/* Used internally by the kernel */
+	struct dnetmap_prefix *p __attribute__((aligned(8)));
 };
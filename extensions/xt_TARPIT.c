@@ -39,7 +39,10 @@
  */
 
 #include <linux/ip.h>
+#include <linux/jhash.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
 #include <linux/netfilter_ipv6.h>
@@ -59,6 +62,34 @@
 #	define WITH_IPV6 1
 #endif
 
+/* buckets per CPU when the budget is per source prefix */
+#define TARPIT_LIMIT_BUCKETS 256
+
+/*
+ * Token bucket. A reply costs HZ credits, and every jiffy brings in as
+ * many as the rate, so that no division is needed per packet.
+ */
+struct tarpit_bucket {
+	unsigned long stamp;
+	u64 credit;
+};
+
+/*
+ * Reply budget of a rule: one bucket per CPU, or per CPU and hash of the
+ * source prefix; sources whose hashes collide share a bucket.
+ *
+ * @max:	credits of a full bucket
+ * @fill:	jiffies it takes an empty bucket to fill up
+ */
+struct xt_tarpit_limit {
+	struct tarpit_bucket __percpu *buckets;
+	unsigned int nbuckets;
+	u32 seed;
+	__be32 mask[4];
+	u64 max;
+	unsigned long fill;
+};
+
 static bool xttarpit_tarpit(struct tcphdr *tcph, const struct tcphdr *oth)
 {
 	/* No replies for RST, FIN or !SYN,!ACK */
@@ -170,16 +201,61 @@ static bool tarpit_generic(struct tcphdr *tcph, const struct tcphdr *oth,
 	return true;
 }
 
+static unsigned int tarpit_hash(const struct xt_tarpit_limit *l,
+    const union nf_inet_addr *saddr, unsigned int family)
+{
+	u32 a[4];
+	unsigned int i;
+
+	if (family == NFPROTO_IPV4)
+		return jhash_1word((__force u32)(saddr->ip & l->mask[0]),
+		       l->seed);
+	for (i = 0; i < ARRAY_SIZE(a); ++i)
+		a[i] = (__force u32)(saddr->all[i] & l->mask[i]);
+	return jhash2(a, ARRAY_SIZE(a), l->seed);
+}
+
+/*
+ * Takes a reply out of the budget of the rule, if there is one. Only
+ * replies that are actually built are charged. The buckets of a CPU are
+ * only used from there, with BH disabled.
+ */
+static bool tarpit_allow(const struct xt_tarpit_tginfo *info,
+    const union nf_inet_addr *saddr, unsigned int family)
+{
+	const struct xt_tarpit_limit *l = info->limit;
+	struct tarpit_bucket *b;
+	unsigned long now = jiffies, elapsed;
+
+	if (l == NULL)
+		return true;
+	b = this_cpu_ptr(l->buckets);
+	if (l->nbuckets > 1)
+		b += tarpit_hash(l, saddr, family) % l->nbuckets;
+
+	elapsed = now - b->stamp;
+	b->stamp = now;
+	if (elapsed >= l->fill)
+		b->credit = l->max;
+	else
+		b->credit = min(b->credit + (u64)elapsed * info->rate, l->max);
+	if (b->credit < HZ)
+		return false;
+	b->credit -= HZ;
+	return true;
+}
+
 static void tarpit_tcp4(const struct xt_action_param *par,
     struct sk_buff *oldskb, unsigned int mode)
 {
+	const struct xt_tarpit_tginfo *info = par->targinfo;
 	struct tcphdr _otcph, *tcph;
 	const struct tcphdr *oth;
 	unsigned int addr_type = RTN_UNSPEC;
 	struct sk_buff *nskb;
-	const struct iphdr *oldhdr;
+	const struct iphdr *oldhdr = ip_hdr(oldskb);
 	struct iphdr *niph;
-	uint16_t tmp, payload;
+	uint16_t payload;
 
 	/* A truncated TCP header is not going to be useful */
 	if (oldskb->len < ip_hdrlen(oldskb) + sizeof(struct tcphdr))
@@ -196,49 +272,46 @@ static void tarpit_tcp4(const struct xt_action_param *par,
 		return;
 
 	/*
-	 * Copy skb (even if skb is about to be dropped, we cannot just
-	 * clone it because there may be other things, such as tcpdump,
-	 * interested in it)
+	 * The reply is just the headers, built from scratch rather than
+	 * by copying the packet, which may carry any amount of data.
 	 */
-	nskb = skb_copy_expand(oldskb, LL_MAX_HEADER,
-	                       skb_tailroom(oldskb), GFP_ATOMIC);
+	nskb = alloc_skb(LL_MAX_HEADER + sizeof(struct iphdr) +
+	       sizeof(struct tcphdr), GFP_ATOMIC);
 	if (nskb == NULL)
 		return;
 
-	/* This packet will not be the same as the other: clear nf fields */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
-	nf_reset_ct(nskb);
-#else
-	nf_reset(nskb);
-#endif
-	skb_nfmark(nskb) = 0;
-	skb_init_secmark(nskb);
-	skb_shinfo(nskb)->gso_size = 0;
-	skb_shinfo(nskb)->gso_segs = 0;
-	skb_shinfo(nskb)->gso_type = 0;
-	oldhdr = ip_hdr(oldskb);
-	tcph = (struct tcphdr *)(skb_network_header(nskb) + ip_hdrlen(nskb));
+	skb_reserve(nskb, LL_MAX_HEADER);
+	nskb->protocol = oldskb->protocol;
 
+	skb_reset_network_header(nskb);
+	niph = (void *)skb_put(nskb, sizeof(*niph));
+	niph->version  = 4;
+	niph->ihl      = sizeof(*niph) / 4;
+	niph->tos      = oldhdr->tos;
+	niph->tot_len  = htons(sizeof(struct iphdr) + sizeof(struct tcphdr));
+	niph->protocol = IPPROTO_TCP;
 	/* Swap source and dest */
-	niph         = ip_hdr(nskb);
-	niph->daddr  = xchg(&niph->saddr, niph->daddr);
-	tmp          = tcph->source;
-	tcph->source = tcph->dest;
-	tcph->dest   = tmp;
-
-	/* Calculate payload size?? */
-	payload = nskb->len - ip_hdrlen(nskb) - sizeof(struct tcphdr);
-
-	/* Truncate to length (no data) */
+	niph->saddr    = oldhdr->daddr;
+	niph->daddr    = oldhdr->saddr;
+
+	skb_reset_transport_header(nskb);
+	tcph = (void *)skb_put(nskb, sizeof(*tcph));
+	memcpy(tcph, oth, sizeof(*tcph));
+	tcph->source  = oth->dest;
+	tcph->dest    = oth->source;
 	tcph->doff    = sizeof(struct tcphdr) / 4;
-	skb_trim(nskb, ip_hdrlen(nskb) + sizeof(struct tcphdr));
-	niph->tot_len = htons(nskb->len);
 	tcph->urg_ptr = 0;
 	/* Reset flags */
 	((u_int8_t *)tcph)[13] = 0;
 
+	/* Calculate payload size?? */
+	payload = oldskb->len - ip_hdrlen(oldskb) - sizeof(struct tcphdr);
+
 	if (!tarpit_generic(tcph, oth, payload, mode))
 		goto free_nskb;
+	if (!tarpit_allow(info, (const union nf_inet_addr *)&oldhdr->saddr,
+	    NFPROTO_IPV4))
+		goto free_nskb;
 
 	/* Adjust TCP checksum */
 	tcph->check = 0;
@@ -256,17 +329,19 @@ static void tarpit_tcp4(const struct xt_action_param *par,
 #ifdef CONFIG_BRIDGE_NETFILTER
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
 	if (par->state->hook != NF_INET_FORWARD ||
-	    ((struct nf_bridge_info *)skb_ext_find(nskb, SKB_EXT_BRIDGE_NF) != NULL &&
-	    ((struct nf_bridge_info *)skb_ext_find(nskb, SKB_EXT_BRIDGE_NF))->physoutdev))
+	    ((struct nf_bridge_info *)skb_ext_find(oldskb, SKB_EXT_BRIDGE_NF) != NULL &&
+	    ((struct nf_bridge_info *)skb_ext_find(oldskb, SKB_EXT_BRIDGE_NF))->physoutdev))
 #else
-	if (par->state->hook != NF_INET_FORWARD || (nskb->nf_bridge != NULL &&
-	    nskb->nf_bridge->physoutdev != NULL))
+	if (par->state->hook != NF_INET_FORWARD || (oldskb->nf_bridge != NULL &&
+	    oldskb->nf_bridge->physoutdev != NULL))
 #endif
 #else
 	if (par->state->hook != NF_INET_FORWARD)
 #endif
 		addr_type = RTN_LOCAL;
 
+	/* ip_route_me_harder expects the skb's dst to be set */
+	skb_dst_set(nskb, dst_clone(skb_dst(oldskb)));
 	if (ip_route_me_harder(par_net(par), par->state->sk, nskb, addr_type) != 0)
 		goto free_nskb;
 	else
@@ -301,6 +376,7 @@ static void tarpit_tcp4(const struct xt_action_param *par,
 static void tarpit_tcp6(const struct xt_action_param *par,
     struct sk_buff *oldskb, unsigned int mode)
 {
+	const struct xt_tarpit_tginfo *info = par->targinfo;
 	struct sk_buff *nskb;
 	struct tcphdr *tcph, oth;
 	unsigned int otcplen;
@@ -343,44 +419,29 @@ static void tarpit_tcp6(const struct xt_action_param *par,
 		return;
 	}
 
-	nskb = skb_copy_expand(oldskb, LL_MAX_HEADER,
-	       skb_tailroom(oldskb), GFP_ATOMIC);
+	/* Just the headers, as for IPv4 */
+	nskb = alloc_skb(LL_MAX_HEADER + sizeof(struct ipv6hdr) +
+	       sizeof(struct tcphdr), GFP_ATOMIC);
 	if (nskb == NULL) {
 		if (net_ratelimit())
 			pr_debug("cannot alloc skb\n");
 		return;
 	}
 
-	/* This packet will not be the same as the other: clear nf fields */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
-	nf_reset_ct(nskb);
-#else
-	nf_reset(nskb);
-#endif
-	skb_nfmark(nskb) = 0;
-	skb_init_secmark(nskb);
-	skb_shinfo(nskb)->gso_size = 0;
-	skb_shinfo(nskb)->gso_segs = 0;
-	skb_shinfo(nskb)->gso_type = 0;
-	skb_put(nskb, sizeof(struct ipv6hdr));
-	ip6h = ipv6_hdr(nskb);
+	skb_reserve(nskb, LL_MAX_HEADER);
+	nskb->protocol = oldskb->protocol;
+
+	skb_reset_network_header(nskb);
+	ip6h = (void *)skb_put(nskb, sizeof(*ip6h));
 	*(__be32 *)ip6h =  htonl(0x60000000 | (tclass << 20));
+	ip6h->payload_len = htons(sizeof(struct tcphdr));
 	ip6h->nexthdr = IPPROTO_TCP;
 	ip6h->saddr = oip6h->daddr;
 	ip6h->daddr = oip6h->saddr;
 
-	/* Adjust IP TTL */
-	if (mode == XTTARPIT_HONEYPOT) {
-		ip6h->hop_limit = 128;
-	} else {
-		ip6h->hop_limit = ip6_dst_hoplimit(skb_dst(nskb));
-	}
-
-	tcph = (struct tcphdr *)(skb_network_header(nskb) +
-	       sizeof(struct ipv6hdr));
-
-	/* Truncate to length (no data) */
-	skb_trim(nskb, sizeof(struct ipv6hdr) + sizeof(struct tcphdr));
+	skb_reset_transport_header(nskb);
+	tcph = (void *)skb_put(nskb, sizeof(*tcph));
+	memcpy(tcph, &oth, sizeof(*tcph));
 	tcph->doff    = sizeof(struct tcphdr)/4;
 	tcph->source  = oth.dest;
 	tcph->dest    = oth.source;
@@ -388,20 +449,31 @@ static void tarpit_tcp6(const struct xt_action_param *par,
 	/* Reset flags */
 	((uint8_t *)tcph)[13] = 0;
 
-	payload = nskb->len - sizeof(struct ipv6hdr) - sizeof(struct tcphdr);
-	if (!tarpit_generic(&oth, tcph, payload, mode))
+	payload = otcplen - sizeof(struct tcphdr);
+	if (!tarpit_generic(tcph, &oth, payload, mode))
+		goto free_nskb;
+	if (!tarpit_allow(info, (const union nf_inet_addr *)&oip6h->saddr,
+	    NFPROTO_IPV6))
 		goto free_nskb;
 
-	ip6h->payload_len = htons(sizeof(struct tcphdr));
 	tcph->check = 0;
 
 	/* Adjust TCP checksum */
-	tcph->check = csum_ipv6_magic(&ipv6_hdr(nskb)->saddr,
-	              &ipv6_hdr(nskb)->daddr, sizeof(struct tcphdr),
-	              IPPROTO_TCP,
+	tcph->check = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr,
+	              sizeof(struct tcphdr), IPPROTO_TCP,
 	              csum_partial(tcph, sizeof(struct tcphdr), 0));
+
+	/* ip6_route_me_harder expects the skb's dst to be set */
+	skb_dst_set(nskb, dst_clone(skb_dst(oldskb)));
 	if (ip6_route_me_harder(par_net(par), nskb->sk, nskb))
 		goto free_nskb;
+	ip6h = ipv6_hdr(nskb);
+
+	/* Adjust IP TTL */
+	if (mode == XTTARPIT_HONEYPOT)
+		ip6h->hop_limit = 128;
+	else
+		ip6h->hop_limit = ip6_dst_hoplimit(skb_dst(nskb));
 
 	nskb->ip_summed = CHECKSUM_NONE;
 
@@ -491,25 +563,87 @@ tarpit_tg6(struct sk_buff *skb, const struct xt_action_param *par)
 }
 #endif
 
+static int tarpit_tg_check(const struct xt_tgchk_param *par)
+{
+	struct xt_tarpit_tginfo *info = par->targinfo;
+	unsigned int maxlen = par->family == NFPROTO_IPV6 ? 128 : 32;
+	struct tarpit_bucket *b;
+	struct xt_tarpit_limit *l;
+	unsigned int cpu, i, len;
+
+	info->limit = NULL;
+	if (info->rate == 0)
+		return 0;
+	if (info->srcmask > maxlen) {
+		pr_info("TARPIT: --reply-srcmask %u is longer than an IPv%u address\n",
+		        info->srcmask, maxlen == 32 ? 4 : 6);
+		return -EINVAL;
+	}
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (l == NULL)
+		return -ENOMEM;
+	l->nbuckets = info->srcmask > 0 ? TARPIT_LIMIT_BUCKETS : 1;
+	l->buckets = __alloc_percpu(l->nbuckets * sizeof(*b),
+	             __alignof__(*b));
+	if (l->buckets == NULL) {
+		kfree(l);
+		return -ENOMEM;
+	}
+	get_random_bytes(&l->seed, sizeof(l->seed));
+	for (i = 0; i < ARRAY_SIZE(l->mask); ++i) {
+		len = clamp_t(int, (int)info->srcmask - 32 * (int)i, 0, 32);
+		l->mask[i] = len == 0 ? 0 : htonl(~0U << (32 - len));
+	}
+	l->max  = (u64)(info->burst != 0 ? info->burst : info->rate) * HZ;
+	l->fill = div_u64(l->max, info->rate) + 1;
+
+	/* all buckets start out full */
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(l->buckets, cpu);
+		for (i = 0; i < l->nbuckets; ++i) {
+			b[i].stamp  = jiffies;
+			b[i].credit = l->max;
+		}
+	}
+	info->limit = l;
+	return 0;
+}
+
+static void tarpit_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	const struct xt_tarpit_tginfo *info = par->targinfo;
+	struct xt_tarpit_limit *l = info->limit;
+
+	if (l == NULL)
+		return;
+	free_percpu(l->buckets);
+	kfree(l);
+}
+
 static struct xt_target tarpit_tg_reg[] __read_mostly = {
 	{
 		.name       = "TARPIT",
-		.revision   = 0,
+		.revision   = 1,
 		.family     = NFPROTO_IPV4,
 		.hooks      = (1 << NF_INET_LOCAL_IN) | (1 << NF_INET_FORWARD),
 		.proto      = IPPROTO_TCP,
 		.target     = tarpit_tg4,
+		.checkentry = tarpit_tg_check,
+		.destroy    = tarpit_tg_destroy,
 		.targetsize = sizeof(struct xt_tarpit_tginfo),
 		.me         = THIS_MODULE,
 	},
 #ifdef WITH_IPV6
 	{
 		.name       = "TARPIT",
-		.revision   = 0,
+		.revision   = 1,
 		.family     = NFPROTO_IPV6,
 		.hooks      = (1 << NF_INET_LOCAL_IN) | (1 << NF_INET_FORWARD),
 		.proto      = IPPROTO_TCP,
 		.target     = tarpit_tg6,
+		.checkentry = tarpit_tg_check,
+		.destroy    = tarpit_tg_destroy,
 		.targetsize = sizeof(struct xt_tarpit_tginfo),
 		.me         = THIS_MODULE,
 	},
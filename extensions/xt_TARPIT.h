@@ -6,6 +6,19 @@ enum xt_tarpit_target_variant {
 	XTTARPIT_RESET,
 };
 
+struct xt_tarpit_limit;
+
+/*
+ * @rate:	replies per second and CPU, 0 for no limit
+ * @burst:	replies that can be sent at once, 0 for @rate
+ * @srcmask:	prefix length of the sources that get a budget each,
+ *		0 for one budget in all
+ */
 struct xt_tarpit_tginfo {
 	uint8_t variant;
+	uint8_t srcmask;
+	uint32_t rate, burst;
+
+	/* Used internally by the kernel */
+	struct xt_tarpit_limit *limit __attribute__((aligned(8)));
 };
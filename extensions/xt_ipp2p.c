@@ -1,19 +1,19 @@
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/version.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 #include <net/tcp.h>
 #include <net/udp.h>
-#include <asm/unaligned.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
 #include "xt_ipp2p.h"
 #include "compat_xtables.h"
-
-//#define IPP2P_DEBUG_ARES
-//#define IPP2P_DEBUG_SOUL
-//#define IPP2P_DEBUG_WINMX
-
-#define get_u8(X,  O)  (*(const __u8 *)((X) + O))
-#define get_u16(X, O)  get_unaligned((const __u16 *)((X) + O))
-#define get_u32(X, O)  get_unaligned((const __u32 *)((X) + O))
+#include "ipp2p_search.h"
 
 MODULE_AUTHOR("Eicke Friedrich/Klaus Degner <ipp2p@ipp2p.org>");
 MODULE_DESCRIPTION("An extension to iptables to identify P2P traffic.");
@@ -25,817 +25,116 @@ ip_transport_len(const struct sk_buff *skb)
 {
         return ntohs(ip_hdr(skb)->tot_len) - skb_network_header_len(skb);
 }
-static inline unsigned int
-ipv6_transport_len(const struct sk_buff *skb)
-{
-        return ntohs(ipv6_hdr(skb)->payload_len) + sizeof(struct ipv6hdr) -
-               skb_network_header_len(skb);
-}
 #endif
 
-struct ipp2p_result_printer {
-	const union nf_inet_addr *saddr, *daddr;
-	short sport, dport;
-	void (*print)(const union nf_inet_addr *, short, const union nf_inet_addr *, short, bool, unsigned int);
+/*
+ * Payload of nonlinear packets (GRO, scatter-gather) is copied here;
+ * anything beyond IPP2P_SCRATCH_SIZE bytes is not looked at.
+ */
+enum {
+	IPP2P_SCRATCH_SIZE = 2048,
 };
 
-static void
-print_result(const struct ipp2p_result_printer *rp, bool result,
-             unsigned int hlen)
-{
-	rp->print(rp->saddr, rp->sport,
-		  rp->daddr, rp->dport,
-		  result, hlen);
-}
-
-/* Search for UDP eDonkey/eMule/Kad commands */
-static unsigned int
-udp_search_edk(const unsigned char *t, const unsigned int packet_len)
-{
-	if (packet_len < 4)
-		return 0;
-
-	switch (t[0]) {
-	case 0xe3:
-		/* edonkey */
-		switch (t[1]) {
-		/* client -> server status request */
-		case 0x96:
-			if (packet_len == 6)
-				return IPP2P_EDK * 100 + 50;
-			break;
-
-		/* server -> client status request */
-		case 0x97:
-			if (packet_len == 34)
-				return IPP2P_EDK * 100 + 51;
-			break;
-
-		/* server description request */
-		/* e3 2a ff f0 .. | size == 6 */
-		case 0xa2:
-			if (packet_len == 6 &&
-			    get_u16(t, 2) == __constant_htons(0xfff0))
-				return IPP2P_EDK * 100 + 52;
-			break;
-
-		/* server description response */
-		/* e3 a3 ff f0 ..  | size > 40 && size < 200 */
-		/*
-		case 0xa3:
-			return IPP2P_EDK * 100 + 53;
-			break;
-		*/
-
-		case 0x9a:
-			if (packet_len == 18)
-				return IPP2P_EDK * 100 + 54;
-			break;
-
-		case 0x92:
-			if (packet_len == 10)
-				return IPP2P_EDK * 100 + 55;
-			break;
-		}
-		break;
-
-	case 0xe4:
-		switch (t[1]) {
-		/* e4 20 .. | size == 35 */
-		case 0x20:
-			if (packet_len == 35 && t[2] != 0x00 && t[34] != 0x00)
-				return IPP2P_EDK * 100 + 60;
-			break;
-
-		/* e4 00 .. 00 | size == 27 ? */
-		case 0x00:
-			if (packet_len == 27 && t[26] == 0x00)
-				return IPP2P_EDK * 100 + 61;
-			break;
-
-		/* e4 10 .. 00 | size == 27 ? */
-		case 0x10:
-			if (packet_len == 27 && t[26] == 0x00)
-				return IPP2P_EDK * 100 + 62;
-			break;
-
-		/* e4 18 .. 00 | size == 27 ? */
-		case 0x18:
-			if (packet_len == 27 && t[26] == 0x00)
-				return IPP2P_EDK * 100 + 63;
-			break;
-
-		/* e4 52 .. | size = 36 */
-		case 0x52:
-			if (packet_len == 36)
-				return IPP2P_EDK * 100 + 64;
-			break;
-
-		/* e4 58 .. | size == 6 */
-		case 0x58:
-			if (packet_len == 6)
-				return IPP2P_EDK * 100 + 65;
-			break;
-
-		/* e4 59 .. | size == 2 */
-		case 0x59:
-			if (packet_len == 2)
-				return IPP2P_EDK * 100 + 66;
-			break;
-
-		/* e4 28 .. | packet_len == 49,69,94,119... */
-		case 0x28:
-			if ((packet_len - 44) % 25 == 0)
-				return IPP2P_EDK * 100 + 67;
-			break;
-
-		/* e4 50 xx xx | size == 4 */
-		case 0x50:
-			if (packet_len == 4)
-				return IPP2P_EDK * 100 + 68;
-			break;
-
-		/* e4 40 xx xx | size == 48 */
-		case 0x40:
-			if (packet_len == 48)
-				return IPP2P_EDK * 100 + 69;
-			break;
-		}
-		break;
-	}
-	return 0;
-}
-
-/* Search for UDP Gnutella commands */
-static unsigned int
-udp_search_gnu(const unsigned char *t, const unsigned int packet_len)
-{
-	if (packet_len >= 3 && memcmp(t, "GND", 3) == 0)
-		return IPP2P_GNU * 100 + 51;
-	if (packet_len >= 9 && memcmp(t, "GNUTELLA ", 9) == 0)
-		return IPP2P_GNU * 100 + 52;
-	return 0;
-}
-
-/* Search for UDP KaZaA commands */
-static unsigned int
-udp_search_kazaa(const unsigned char *t, const unsigned int packet_len)
-{
-	if (packet_len < 6)
-		return 0;
-	if (memcmp(t + packet_len - 6, "KaZaA\x00", 6) == 0)
-		return IPP2P_KAZAA * 100 + 50;
-	return 0;
-}
-
-/* Search for UDP DirectConnect commands */
-static unsigned int udp_search_directconnect(const unsigned char *t,
-                                             const unsigned int packet_len)
-{
-	if (packet_len < 5)
-		return 0;
-	if (t[0] == 0x24 && t[packet_len-1] == 0x7c) {
-		if (memcmp(&t[1], "SR ", 3) == 0)
-			return IPP2P_DC * 100 + 60;
-		if (packet_len >= 7 && memcmp(&t[1], "Ping ", 5) == 0)
-			return IPP2P_DC * 100 + 61;
-	}
-	return 0;
-}
-
-/* Search for UDP BitTorrent commands */
-static unsigned int
-udp_search_bit(const unsigned char *haystack, const unsigned int packet_len)
-{
-	switch (packet_len) {
-	case 16:
-		/* ^ 00 00 04 17 27 10 19 80 */
-		if (ntohl(get_u32(haystack, 0)) == 0x00000417 &&
-		    ntohl(get_u32(haystack, 4)) == 0x27101980)
-			return IPP2P_BIT * 100 + 50;
-		break;
-	case 36:
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000400) &&
-		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
-			return IPP2P_BIT * 100 + 51;
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000400))
-			return IPP2P_BIT * 100 + 61;
-		break;
-	case 57:
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000404) &&
-		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
-			return IPP2P_BIT * 100 + 52;
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000404))
-			return IPP2P_BIT * 100 + 62;
-		break;
-	case 59:
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000406) &&
-		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
-			return (IPP2P_BIT * 100 + 53);
-		if (get_u32(haystack, 8) == __constant_htonl(0x00000406))
-			return (IPP2P_BIT * 100 + 63);
-		break;
-	case 203:
-		if (get_u32(haystack, 0) == __constant_htonl(0x00000405))
-			return IPP2P_BIT * 100 + 54;
-		break;
-	case 21:
-		if (get_u32(haystack, 0) == __constant_htonl(0x00000401))
-			return IPP2P_BIT * 100 + 55;
-		break;
-	case 44:
-		if (get_u32(haystack, 0)  == __constant_htonl(0x00000827) &&
-		    get_u32(haystack, 4) == __constant_htonl(0x37502950))
-			return IPP2P_BIT * 100 + 80;
-		break;
-	default:
-		/* this packet does not have a constant size */
-		if (packet_len >= 32 &&
-		    get_u32(haystack, 8) == __constant_htonl(0x00000402) &&
-		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
-			return IPP2P_BIT * 100 + 56;
-		break;
-	}
-
-	/* some extra-bitcomet rules: "d1:" [a|r] "d2:id20:" */
-	if (packet_len > 22 && get_u8(haystack, 0) == 'd' &&
-	    get_u8(haystack, 1) == '1' && get_u8(haystack, 2) == ':')
-		if (get_u8(haystack, 3) == 'a' ||
-		    get_u8(haystack, 3) == 'r')
-			if (memcmp(haystack + 4, "d2:id20:", 8) == 0)
-				return IPP2P_BIT * 100 + 57;
-
-#if 0
-	/* bitlord rules */
-	/* packetlen must be bigger than 32 */
-	/* first 4 bytes are zero */
-	if (packet_len > 32 && get_u32(haystack, 0) == 0x00000000) {
-		/* first rule: 00 00 00 00 01 00 00 xx xx xx xx 00 00 00 00*/
-		if (get_u32(haystack, 4) == 0x00000000 &&
-		    get_u32(haystack, 8) == 0x00010000 &&
-		    get_u32(haystack, 16) == 0x00000000)
-			return IPP2P_BIT * 100 + 71;
-
-		/* 00 01 00 00 0d 00 00 xx xx xx xx 00 00 00 00*/
-		if (get_u32(haystack, 4) == 0x00000001 &&
-		    get_u32(haystack, 8) == 0x000d0000 &&
-		    get_u32(haystack, 16) == 0x00000000)
-			return IPP2P_BIT * 100 + 71;
-	}
-#endif
-
-	return 0;
-}
-
-/* Search for Ares commands */
-static unsigned int
-search_ares(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 3)
-		return 0;
-	/* all ares packets start with  */
-	if (payload[1] == 0 && plen - payload[0] == 3) {
-		switch (payload[2]) {
-		case 0x5a:
-			/* ares connect */
-			if (plen == 6 && payload[5] == 0x05)
-				return IPP2P_ARES * 100 + 1;
-			break;
-		case 0x09:
-			/*
-			 * ares search, min 3 chars --> 14 bytes
-			 * lets define a search can be up to 30 chars
-			 * --> max 34 bytes
-			 */
-			if (plen >= 14 && plen <= 34)
-				return IPP2P_ARES * 100 + 1;
-			break;
-#ifdef IPP2P_DEBUG_ARES
-		default:
-			printk(KERN_DEBUG "Unknown Ares command %x "
-			       "recognized, len: %u\n",
-			       (unsigned int)payload[2], plen);
-#endif
-		}
-	}
-
-#if 0
-	/* found connect packet: 03 00 5a 04 03 05 */
-	/* new version ares 1.8: 03 00 5a xx xx 05 */
-	if (plen == 6)
-		/* possible connect command */
-		if (payload[0] == 0x03 && payload[1] == 0x00 &&
-		    payload[2] == 0x5a && payload[5] == 0x05)
-			return IPP2P_ARES * 100 + 1;
-
-	if (plen == 60)
-		/* possible download command*/
-		if (payload[59] == 0x0a && payload[58] == 0x0a)
-			if (memcmp(t, "PUSH SHA1:", 10) == 0)
-				/* found download command */
-				return IPP2P_ARES * 100 + 2;
-#endif
-
-	return 0;
-}
-
-/* Search for SoulSeek commands */
-static unsigned int
-search_soul(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 8)
-		return 0;
-	/* match: xx xx xx xx | xx = sizeof(payload) - 4 */
-	if (get_u32(payload, 0) == plen - 4) {
-		const uint32_t m = get_u32(payload, 4);
-
-		/* match 00 yy yy 00, yy can be everything */
-		if (get_u8(payload, 4) == 0x00 && get_u8(payload, 7) == 0x00) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "0: Soulseek command 0x%x "
-			       "recognized\n", get_u32(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 1;
-		}
-
-		/* next match: 01 yy 00 00 | yy can be everything */
-		if (get_u8(payload, 4) == 0x01 && get_u16(payload, 6) == 0x0000) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "1: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 2;
-		}
-
-		/* other soulseek commandos are: 1-5,7,9,13-18,22,23,26,28,35-37,40-46,50,51,60,62-69,91,92,1001 */
-		/* try to do this in an intelligent way */
-		/* get all small commandos */
-		switch (m) {
-		case 7:
-		case 9:
-		case 22:
-		case 23:
-		case 26:
-		case 28:
-		case 50:
-		case 51:
-		case 60:
-		case 91:
-		case 92:
-		case 1001:
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "2: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 3;
-		}
-
-		if (m > 0 && m < 6) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "3: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 4;
-		}
-
-		if (m > 12 && m < 19) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "4: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 5;
-		}
-
-		if (m > 34 && m < 38) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "5: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 6;
-		}
-
-		if (m > 39 && m < 47) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "6: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 7;
-		}
-
-		if (m > 61 && m < 70) {
-#ifdef IPP2P_DEBUG_SOUL
-			printk(KERN_DEBUG "7: Soulseek command 0x%x "
-			       "recognized\n", get_u16(payload, 4));
-#endif
-			return IPP2P_SOUL * 100 + 8;
-		}
-
-#ifdef IPP2P_DEBUG_SOUL
-		printk(KERN_DEBUG "unknown SOULSEEK command: 0x%x, first "
-		       "16 bit: 0x%x, first 8 bit: 0x%x ,soulseek ???\n",
-		       get_u32(payload, 4), get_u16(payload, 4) >> 16,
-		       get_u8(payload, 4) >> 24);
-#endif
-	}
-
-	/* match 14 00 00 00 01 yy 00 00 00 STRING(YY) 01 00 00 00 00 46|50 00 00 00 00 */
-	/* without size at the beginning !!! */
-	if (get_u32(payload, 0) == 0x14 && get_u8(payload, 4) == 0x01) {
-		uint32_t y = get_u32(payload, 5);
-
-		/* we need 19 chars + string */
-		if (y + 19 <= plen) {
-			const unsigned char *w = payload + 9 + y;
-			if (get_u32(w, 0) == 0x01 &&
-			    (get_u16(w, 4) == 0x4600 ||
-			    get_u16(w, 4) == 0x5000) &&
-			    get_u32(w, 6) == 0x00)
-				;
-#ifdef IPP2P_DEBUG_SOUL
-	    		printk(KERN_DEBUG "Soulssek special client command recognized\n");
-#endif
-	    		return IPP2P_SOUL * 100 + 9;
-		}
-	}
-	return 0;
-}
-
-/* Search for WinMX commands */
-static unsigned int
-search_winmx(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen == 4 && memcmp(payload, "SEND", 4) == 0)
-		return IPP2P_WINMX * 100 + 1;
-	if (plen == 3 && memcmp(payload, "GET", 3) == 0)
-		return IPP2P_WINMX * 100 + 2;
-	/*
-	if (packet_len < head_len + 10)
-		return 0;
-	*/
-	if (plen < 10)
-		return 0;
-
-	if (memcmp(payload, "SEND", 4) == 0 || memcmp(payload, "GET", 3) == 0) {
-		uint16_t c = 4;
-		const uint16_t end = plen - 2;
-		uint8_t count = 0;
-
-		while (c < end) {
-			if (payload[c] == 0x20 && payload[c+1] == 0x22) {
-				c++;
-				count++;
-				if (count >= 2)
-					return IPP2P_WINMX * 100 + 3;
-			}
-			c++;
-		}
-	}
-
-	if (plen == 149 && payload[0] == '8') {
-#ifdef IPP2P_DEBUG_WINMX
-		printk(KERN_INFO "maybe WinMX\n");
-#endif
-		if (get_u32(payload, 17) == 0 && get_u32(payload, 21) == 0 &&
-		    get_u32(payload, 25) == 0 &&
-//		    get_u32(payload, 33) == __constant_htonl(0x71182b1a) &&
-//		    get_u32(payload, 37) == __constant_htonl(0x05050000) &&
-//		    get_u32(payload, 133) == __constant_htonl(0x31097edf) &&
-//		    get_u32(payload, 145) == __constant_htonl(0xdcb8f792))
-		    get_u16(payload, 39) == 0 &&
-		    get_u16(payload, 135) == __constant_htons(0x7edf) &&
-		    get_u16(payload,147) == __constant_htons(0xf792))
-		{
-#ifdef IPP2P_DEBUG_WINMX
-			printk(KERN_INFO "got WinMX\n");
-#endif
-			return IPP2P_WINMX * 100 + 4;
-		}
-	}
-	return 0;
-}
-
-/* Search for appleJuice commands */
-static unsigned int
-search_apple(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen > 7 && payload[6] == 0x0d && payload[7] == 0x0a &&
-	    memcmp(payload, "ajprot", 6) == 0)
-		return IPP2P_APPLE * 100;
-
-	return 0;
-}
-
-/* Search for BitTorrent commands */
-static unsigned int
-search_bittorrent(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen > 20) {
-		/* test for match 0x13+"BitTorrent protocol" */
-		if (payload[0] == 0x13)
-			if (memcmp(payload + 1, "BitTorrent protocol", 19) == 0)
-				return IPP2P_BIT * 100;
-		/*
-		 * Any tracker command starts with GET / then *may be* some file on web server
-		 * (e.g. announce.php or dupa.pl or whatever.cgi or NOTHING for tracker on root dir)
-		 * but *must have* one (or more) of strings listed below (true for scrape and announce)
-		 */
-		if (memcmp(payload, "GET /", 5) == 0) {
-			if (HX_memmem(payload, plen, "info_hash=", 10) != NULL)
-				return IPP2P_BIT * 100 + 1;
-			if (HX_memmem(payload, plen, "peer_id=", 8) != NULL)
-				return IPP2P_BIT * 100 + 2;
-			if (HX_memmem(payload, plen, "passkey=", 8) != NULL)
-				return IPP2P_BIT * 100 + 4;
-		}
-	} else {
-	    	/* bitcomet encryptes the first packet, so we have to detect another
-	    	 * one later in the flow */
-		/* first try failed, too many false positives */
-	    	/*
-		if (size == 5 && get_u32(t, 0) == __constant_htonl(1) &&
-		    t[4] < 3)
-			return IPP2P_BIT * 100 + 3;
-		*/
-
-	    	/* second try: block request packets */
-	    	if (plen == 17 &&
-		    get_u32(payload, 0) == __constant_htonl(0x0d) &&
-		    payload[4] == 0x06 &&
-		    get_u32(payload,13) == __constant_htonl(0x4000))
-			return IPP2P_BIT * 100 + 3;
-	}
+struct ipp2p_scratch {
+	unsigned char data[IPP2P_SCRATCH_SIZE];
+};
 
-	return 0;
-}
+static struct ipp2p_scratch __percpu *ipp2p_scratch;
 
-/* check for Kazaa get command */
-static unsigned int
-search_kazaa(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 13)
-		return 0;
-	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a &&
-	    memcmp(payload, "GET /.hash=", 11) == 0)
-		return IPP2P_DATA_KAZAA * 100;
-
-	return 0;
-}
+/* Detector counters, exported in /proc/net/xt_ipp2p */
+struct ipp2p_net {
+	struct ipp2p_stats __percpu *stats;
+};
 
-/* check for gnutella get command */
-static unsigned int
-search_gnu(const unsigned char *payload, const unsigned int plen)
+static unsigned int ipp2p_net_id;
+static inline struct ipp2p_net *ipp2p_pernet(struct net *net)
 {
-	if (plen < 11)
-		return 0;
-	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
-		if (memcmp(payload, "GET /get/", 9) == 0)
-			return IPP2P_DATA_GNU * 100 + 1;
-		if (plen >= 15 && memcmp(payload, "GET /uri-res/", 13) == 0)
-			return IPP2P_DATA_GNU * 100 + 2;
-	}
-	return 0;
+	return net_generic(net, ipp2p_net_id);
 }
 
-/* check for gnutella get commands and other typical data */
-static unsigned int
-search_all_gnu(const unsigned char *payload, const unsigned int plen)
+static void ipp2p_stats_show_one(struct seq_file *m, const char *proto,
+    unsigned int command, const struct ipp2p_net *pn, bool udp,
+    unsigned int idx)
 {
-	if (plen < 11)
-		return 0;
-	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
-		if (plen >= 19 && memcmp(payload, "GNUTELLA CONNECT/", 17) == 0)
-			return IPP2P_GNU * 100 + 1;
-		if (memcmp(payload, "GNUTELLA/", 9) == 0)
-			return IPP2P_GNU * 100 + 2;
+	struct ipp2p_counter sum = {};
+	unsigned int cpu;
 
-		if (plen >= 22 && (memcmp(payload, "GET /get/", 9) == 0 ||
-		    memcmp(payload, "GET /uri-res/", 13) == 0))
-		{
-			unsigned int c;
+	for_each_possible_cpu(cpu) {
+		const struct ipp2p_stats *st = per_cpu_ptr(pn->stats, cpu);
+		const struct ipp2p_counter *c = udp ? &st->udp[idx] :
+		                                &st->tcp[idx];
+		uint64_t calls, hits, bytes;
+		unsigned int start;
 
-			for (c = 0; c < plen - 22; ++c)
-				if (payload[c] == 0x0d &&
-				    payload[c+1] == 0x0a &&
-				    (memcmp(&payload[c+2], "X-Gnutella-", 11) == 0 ||
-				    memcmp(&payload[c+2], "X-Queue:", 8) == 0))
-					return IPP2P_GNU * 100 + 3;
-		}
+		do {
+			start = u64_stats_fetch_begin(&st->syncp);
+			calls = c->calls;
+			hits  = c->hits;
+			bytes = c->bytes;
+		} while (u64_stats_fetch_retry(&st->syncp, start));
+		sum.calls += calls;
+		sum.hits  += hits;
+		sum.bytes += bytes;
 	}
-	return 0;
+	seq_printf(m, "%s %-10s %llu %llu %llu\n", proto,
+	           ipp2p_names[__ffs(command)], sum.calls, sum.hits, sum.bytes);
 }
 
-/* check for KaZaA download commands and other typical data */
-/* plen is guaranteed to be >= 5 (see @matchlist) */
-static unsigned int
-search_all_kazaa(const unsigned char *payload, const unsigned int plen)
+static int ipp2p_stats_show(struct seq_file *m, void *data)
 {
-	uint16_t c, end, rem;
-
-	if (plen < 7)
-		/* too short for anything we test for - early bailout */
-		return 0;
-
-	if (payload[plen-2] != 0x0d || payload[plen-1] != 0x0a)
-		return 0;
-
-	if (memcmp(payload, "GIVE ", 5) == 0)
-		return IPP2P_KAZAA * 100 + 1;
-
-	if (memcmp(payload, "GET /", 5) != 0)
-		return 0;
-
-	if (plen < 18)
-		/* The next tests would not succeed anyhow. */
-		return 0;
-
-	end = plen - 18;
-	rem = plen - 5;
-	for (c = 5; c < end; ++c, --rem) {
-		if (payload[c] != 0x0d)
-			continue;
-		if (payload[c+1] != 0x0a)
-			continue;
-		if (rem >= 18 &&
-		    memcmp(&payload[c+2], "X-Kazaa-Username: ", 18) == 0)
-			return IPP2P_KAZAA * 100 + 2;
-		if (rem >= 24 &&
-		    memcmp(&payload[c+2], "User-Agent: PeerEnabler/", 24) == 0)
-			return IPP2P_KAZAA * 100 + 2;
-	}
+	const struct ipp2p_net *pn = m->private;
+	unsigned int i;
 
+	seq_puts(m, "# proto detector calls hits bytes\n");
+	for (i = 0; matchlist[i].command != 0; ++i)
+		ipp2p_stats_show_one(m, "tcp", matchlist[i].command, pn, false, i);
+	for (i = 0; udp_list[i].command != 0; ++i)
+		ipp2p_stats_show_one(m, "udp", udp_list[i].command, pn, true, i);
 	return 0;
 }
 
-/* fast check for edonkey file segment transfer command */
-static unsigned int
-search_edk(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 6)
-		return 0;
-	if (payload[0] != 0xe3) {
-		return 0;
-	} else {
-		if (payload[5] == 0x47)
-			return IPP2P_DATA_EDK * 100;
-		else
-			return 0;
-	}
-}
-
-/* intensive but slower search for some edonkey packets including size-check */
-static unsigned int
-search_all_edk(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 6)
-		return 0;
-	if (payload[0] != 0xe3) {
-		return 0;
-	} else {
-		unsigned int cmd = get_u16(payload, 1);
-
-		if (cmd == plen - 5) {
-			switch (payload[5]) {
-			case 0x01:
-				/* Client: hello or Server:hello */
-			return IPP2P_EDK * 100 + 1;
-				case 0x4c:
-				/* Client: Hello-Answer */
-				return IPP2P_EDK * 100 + 9;
-			}
-		}
-		return 0;
-	}
-}
-
-/* fast check for Direct Connect send command */
-static unsigned int
-search_dc(const unsigned char *payload, const unsigned int plen)
+static int ipp2p_stats_open(struct inode *inode, struct file *file)
 {
-	if (plen < 6)
-		return 0;
-	if (payload[0] != 0x24) {
-		return 0;
-	} else {
-		if (memcmp(&payload[1], "Send|", 5) == 0)
-			return IPP2P_DATA_DC * 100;
-		else
-			return 0;
-	}
+	return single_open(file, ipp2p_stats_show, pde_data(inode));
 }
 
-/* intensive but slower check for all direct connect packets */
-static unsigned int
-search_all_dc(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen < 7)
-		return 0;
-	if (payload[0] == 0x24 && payload[plen-1] == 0x7c) {
-		const unsigned char *t = &payload[1];
-
-		/* Client-Hub-Protocol */
-		if (memcmp(t, "Lock ", 5) == 0)
-			return IPP2P_DC * 100 + 1;
-
-		/*
-		 * Client-Client-Protocol, some are already recognized by
-		 * client-hub (like lock)
-		 */
-		if (plen >= 9 && memcmp(t, "MyNick ", 7) == 0)
-			return IPP2P_DC * 100 + 38;
-	}
-	return 0;
-}
+static const struct proc_ops ipp2p_stats_fops = {
+	.proc_open    = ipp2p_stats_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
 
-/* check for mute */
-static unsigned int
-search_mute(const unsigned char *payload, const unsigned int plen)
-{
-	if (plen == 209 || plen == 345 || plen == 473 || plen == 609 ||
-	    plen == 1121) {
-		//printk(KERN_DEBUG "size hit: %u", size);
-		if (memcmp(payload,"PublicKey: ", 11) == 0) {
-			return IPP2P_MUTE * 100 + 0;
-			/*
-			if (memcmp(t + size - 14, "\x0aEndPublicKey\x0a", 14) == 0)
-				printk(KERN_DEBUG "end pubic key hit: %u", size);
-			*/
-		}
-	}
-	return 0;
-}
+struct ipp2p_result_printer {
+	const union nf_inet_addr *saddr, *daddr;
+	short sport, dport;
+	void (*print)(const union nf_inet_addr *, short, const union nf_inet_addr *, short, bool, unsigned int);
+};
 
-/* check for xdcc */
-static unsigned int
-search_xdcc(const unsigned char *payload, const unsigned int plen)
+static void
+print_result(const struct ipp2p_result_printer *rp, bool result,
+             unsigned int hlen)
 {
-	/* search in small packets only */
-	if (plen > 20 && plen < 200 && payload[plen-1] == 0x0a &&
-	    payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0)
-	{
-		uint16_t x = 10;
-		const uint16_t end = plen - 13;
-
-		/*
-		 * is seems to be a irc private massage, chedck for
-		 * xdcc command
-		 */
-		while (x < end)	{
-			if (payload[x] == ':')
-				if (memcmp(&payload[x+1], "xdcc send #", 11) == 0)
-					return IPP2P_XDCC * 100 + 0;
-			x++;
-		}
-	}
-	return 0;
+	rp->print(rp->saddr, rp->sport,
+		  rp->daddr, rp->dport,
+		  result, hlen);
 }
 
-/* search for waste */
-static unsigned int
-search_waste(const unsigned char *payload, const unsigned int plen)
+/*
+ * Returns a pointer to @*len bytes of payload at @offset, truncating @*len
+ * if the payload has to be copied; the detectors are then told that they
+ * only see part of it. Must be called with BH disabled.
+ */
+static const unsigned char *
+ipp2p_payload(const struct sk_buff *skb, unsigned int offset,
+              unsigned int *len)
 {
-	if (plen >= 8 && memcmp(payload, "GET.sha1:", 9) == 0)
-		return IPP2P_WASTE * 100 + 0;
-
-	return 0;
+	if (offset + *len > skb_headlen(skb) && *len > IPP2P_SCRATCH_SIZE)
+		*len = IPP2P_SCRATCH_SIZE;
+	return skb_header_pointer(skb, offset, *len,
+	       this_cpu_ptr(ipp2p_scratch)->data);
 }
 
-static const struct {
-	unsigned int command;
-	unsigned int packet_len;
-	unsigned int (*function_name)(const unsigned char *, const unsigned int);
-} matchlist[] = {
-	{IPP2P_EDK,         20, search_all_edk},
-	{IPP2P_DATA_KAZAA, 200, search_kazaa}, /* exp */
-	{IPP2P_DATA_EDK,    60, search_edk}, /* exp */
-	{IPP2P_DATA_DC,     26, search_dc}, /* exp */
-	{IPP2P_DC,           5, search_all_dc},
-	{IPP2P_DATA_GNU,    40, search_gnu}, /* exp */
-	{IPP2P_GNU,          5, search_all_gnu},
-	{IPP2P_KAZAA,        5, search_all_kazaa},
-	{IPP2P_BIT,         20, search_bittorrent},
-	{IPP2P_APPLE,        5, search_apple},
-	{IPP2P_SOUL,         5, search_soul},
-	{IPP2P_WINMX,        2, search_winmx},
-	{IPP2P_ARES,         5, search_ares},
-	{IPP2P_MUTE,       200, search_mute},
-	{IPP2P_WASTE,        5, search_waste},
-	{IPP2P_XDCC,         5, search_xdcc},
-	{0},
-};
-
-static const struct {
-	unsigned int command;
-	unsigned int packet_len;
-	unsigned int (*function_name)(const unsigned char *, const unsigned int);
-} udp_list[] = {
-	{IPP2P_KAZAA, 14, udp_search_kazaa},
-	{IPP2P_BIT,   23, udp_search_bit},
-	{IPP2P_GNU,   11, udp_search_gnu},
-	{IPP2P_EDK,    9, udp_search_edk},
-	{IPP2P_DC,    12, udp_search_directconnect},
-	{0},
-};
-
 static void
 ipp2p_print_result_tcp4(const union nf_inet_addr *saddr, short sport,
                         const union nf_inet_addr *daddr, short dport,
@@ -856,12 +155,14 @@ ipp2p_print_result_tcp6(const union nf_inet_addr *saddr, short sport,
 
 static bool
 ipp2p_mt_tcp(const struct ipt_p2p_info *info, const struct tcphdr *tcph,
-             const unsigned char *haystack, unsigned int hlen,
-             const struct ipp2p_result_printer *rp)
+             const struct sk_buff *skb, unsigned int thoff, unsigned int hlen,
+             const struct ipp2p_result_printer *rp, struct ipp2p_stats *st,
+             bool *inspected)
 {
 	size_t tcph_len = tcph->doff * 4;
-	bool p2p_result = false;
-	int i = 0;
+	const unsigned char *haystack;
+	bool p2p_result;
+	unsigned int i, plen;
 
 	if (tcph->fin) return 0;  /* if FIN bit is set bail out */
 	if (tcph->syn) return 0;  /* if SYN bit is set bail out */
@@ -875,22 +176,18 @@ ipp2p_mt_tcp(const struct ipt_p2p_info *info, const struct tcphdr *tcph,
 	if (hlen == tcph_len)
 		return 0;
 
-	haystack += tcph_len;
-	hlen     -= tcph_len;
-
-	while (matchlist[i].command) {
-		if ((info->cmd & matchlist[i].command) == matchlist[i].command &&
-		    hlen > matchlist[i].packet_len)
-		{
-			p2p_result = matchlist[i].function_name(haystack, hlen);
-			if (p2p_result)	{
-				if (info->debug)
-					print_result(rp, p2p_result, hlen);
-				return p2p_result;
-			}
-		}
-		i++;
-	}
+	hlen    -= tcph_len;
+	plen    = hlen;
+	if (info->max_bytes != 0 && plen > info->max_bytes)
+		plen = info->max_bytes;
+	haystack = ipp2p_payload(skb, thoff + tcph_len, &plen);
+	if (haystack == NULL)
+		return 0;
+	*inspected = true;
+	p2p_result = ipp2p_search_tcp(info->matcher, haystack, plen, hlen,
+	             &i, st);
+	if (p2p_result && info->debug)
+		print_result(rp, p2p_result, hlen);
 	return p2p_result;
 }
 
@@ -914,12 +211,14 @@ ipp2p_print_result_udp6(const union nf_inet_addr *saddr, short sport,
 
 static bool
 ipp2p_mt_udp(const struct ipt_p2p_info *info, const struct udphdr *udph,
-             const unsigned char *haystack, unsigned int hlen,
-             const struct ipp2p_result_printer *rp)
+             const struct sk_buff *skb, unsigned int thoff, unsigned int hlen,
+             const struct ipp2p_result_printer *rp, struct ipp2p_stats *st,
+             bool *inspected)
 {
 	size_t udph_len = sizeof(*udph);
-	bool p2p_result = false;
-	int i = 0;
+	const unsigned char *haystack;
+	bool p2p_result;
+	unsigned int i, plen;
 
 	if (hlen < udph_len) {
 		if (info->debug)
@@ -929,36 +228,107 @@ ipp2p_mt_udp(const struct ipt_p2p_info *info, const struct udphdr *udph,
 	if (hlen == udph_len)
 		return 0;
 
-	haystack += udph_len;
-	hlen     -= udph_len;
+	hlen    -= udph_len;
+	plen    = hlen;
+	if (info->max_bytes != 0 && plen > info->max_bytes)
+		plen = info->max_bytes;
+	haystack = ipp2p_payload(skb, thoff + udph_len, &plen);
+	if (haystack == NULL)
+		return 0;
 
-	while (udp_list[i].command) {
-		if ((info->cmd & udp_list[i].command) == udp_list[i].command &&
-		    hlen > udp_list[i].packet_len)
-		{
-			p2p_result = udp_list[i].function_name(haystack, hlen);
-			if (p2p_result) {
-				if (info->debug)
-					print_result(rp, p2p_result, hlen);
-				return p2p_result;
-			}
-		}
-		i++;
-	}
+	*inspected = true;
+	p2p_result = ipp2p_search_udp(info->matcher, haystack, plen, hlen,
+	             &i, st);
+	if (p2p_result && info->debug)
+		print_result(rp, p2p_result, hlen);
 	return p2p_result;
 }
 
+/*
+ * The verdict cache lives in the @cache_mask bits of the connmark. Values
+ * below @cache_packets count the payload packets inspected so far; the two
+ * highest values record the final verdict.
+ */
+static inline unsigned int ipp2p_ct_top(const struct ipt_p2p_info *info)
+{
+	return info->cache_mask >> __ffs(info->cache_mask);
+}
+
+static inline unsigned int
+ipp2p_ct_get(const struct ipt_p2p_info *info, uint32_t mark)
+{
+	return (mark & info->cache_mask) >> __ffs(info->cache_mask);
+}
+
+#if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
+static inline unsigned int
+ipp2p_ct_state(const struct ipt_p2p_info *info, const struct nf_conn *ct)
+{
+	return ipp2p_ct_get(info, READ_ONCE(ct->mark));
+}
+
+static void ipp2p_ct_update(const struct ipt_p2p_info *info,
+    struct nf_conn *ct, unsigned int state, bool result)
+{
+	unsigned int top = ipp2p_ct_top(info), next;
+	uint32_t mark = READ_ONCE(ct->mark);
+
+	if (result)
+		next = top;
+	else if (state + 1 >= info->cache_packets)
+		next = top - 1;
+	else
+		next = state + 1;
+
+	/* Should another CPU have updated the mark meanwhile, it wins. */
+	if (ipp2p_ct_get(info, mark) != state ||
+	    cmpxchg(&ct->mark, mark, (mark & ~info->cache_mask) |
+	    (next << __ffs(info->cache_mask))) != mark)
+		return;
+	if (next >= top - 1)
+		nf_conntrack_event_cache(IPCT_MARK, ct);
+}
+#else
+/* Without connmarks there is nowhere to keep the cache; see ipp2p_mt_check. */
+static inline unsigned int
+ipp2p_ct_state(const struct ipt_p2p_info *info, const struct nf_conn *ct)
+{
+	return 0;
+}
+
+static inline void ipp2p_ct_update(const struct ipt_p2p_info *info,
+    struct nf_conn *ct, unsigned int state, bool result)
+{
+}
+#endif
+
 static bool
 ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct ipt_p2p_info *info = par->matchinfo;
 	struct ipp2p_result_printer printer;
 	union nf_inet_addr saddr, daddr;
-	const unsigned char *haystack;  /* packet data */
+	struct ipp2p_stats *st;
+	unsigned int thoff;             /* transport header offset */
 	unsigned int hlen;              /* packet data length */
 	uint8_t family = xt_family(par);
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct = NULL;
+	unsigned int state = 0;
+	bool result = false, inspected = false;
 	int protocol;
 
+	if (info->cache_mask != 0) {
+		ct = nf_ct_get(skb, &ctinfo);
+		if (ct != NULL) {
+			state = ipp2p_ct_state(info, ct);
+			if (state == ipp2p_ct_top(info))
+				return true;
+			if (state == ipp2p_ct_top(info) - 1)
+				return false;
+		}
+	}
+
 	/*
 	 * must not be a fragment
 	 *
@@ -972,89 +342,202 @@ ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		return 0;
 	}
 
-	/* make sure that skb is linear */
-	if (skb_is_nonlinear(skb)) {
-		if (info->debug)
-			printk("IPP2P.match: nonlinear skb found\n");
-		return 0;
-	}
-
 	if (family == NFPROTO_IPV4) {
 		const struct iphdr *ip = ip_hdr(skb);
 		saddr.ip = ip->saddr;
 		daddr.ip = ip->daddr;
 		protocol = ip->protocol;
+		thoff = par->thoff;
 		hlen = ip_transport_len(skb);
 	} else {
 		const struct ipv6hdr *ip = ipv6_hdr(skb);
-		int thoff = 0;
+		int off = 0;
 
 		saddr.in6 = ip->saddr;
 		daddr.in6 = ip->daddr;
-		protocol = ipv6_find_hdr(skb, &thoff, -1, NULL, NULL);
+		protocol = ipv6_find_hdr(skb, &off, -1, NULL, NULL);
 		if (protocol < 0)
 			return 0;
-		hlen = ipv6_transport_len(skb);
+		thoff = off;
+		hlen = skb_network_offset(skb) + sizeof(*ip) +
+		       ntohs(ip->payload_len) - thoff;
 	}
 
 	printer.saddr = &saddr;
 	printer.daddr = &daddr;
-	haystack = skb_transport_header(skb);
 
+	/* for the per-CPU scratch buffer and counters */
+	local_bh_disable();
+	st = this_cpu_ptr(ipp2p_pernet(xt_net(par))->stats);
 	switch (protocol) {
 	case IPPROTO_TCP:	/* what to do with a TCP packet */
 	{
-		const struct tcphdr *tcph = tcp_hdr(skb);
+		struct tcphdr _tcph;
+		const struct tcphdr *tcph;
 
+		tcph = skb_header_pointer(skb, thoff, sizeof(_tcph), &_tcph);
+		if (tcph == NULL)
+			break;
 		printer.sport = ntohs(tcph->source);
 		printer.dport = ntohs(tcph->dest);
 		printer.print = family == NFPROTO_IPV6 ?
 		                ipp2p_print_result_tcp6 : ipp2p_print_result_tcp4;
-		return ipp2p_mt_tcp(info, tcph, haystack, hlen, &printer);
+		result = ipp2p_mt_tcp(info, tcph, skb, thoff, hlen, &printer, st,
+		         &inspected);
+		break;
 	}
 	case IPPROTO_UDP:	/* what to do with a UDP packet */
 	case IPPROTO_UDPLITE:
 	{
-		const struct udphdr *udph = udp_hdr(skb);
+		struct udphdr _udph;
+		const struct udphdr *udph;
 
+		udph = skb_header_pointer(skb, thoff, sizeof(_udph), &_udph);
+		if (udph == NULL)
+			break;
 		printer.sport = ntohs(udph->source);
 		printer.dport = ntohs(udph->dest);
 		printer.print = family == NFPROTO_IPV6 ?
 		                ipp2p_print_result_udp6 : ipp2p_print_result_udp4;
-		return ipp2p_mt_udp(info, udph, haystack, hlen, &printer);
+		result = ipp2p_mt_udp(info, udph, skb, thoff, hlen, &printer, st,
+		         &inspected);
+		break;
 	}
-	default:
-		return 0;
 	}
+	local_bh_enable();
+
+	if (ct != NULL && inspected)
+		ipp2p_ct_update(info, ct, state, result);
+	return result;
+}
+
+static int ipp2p_mt_check(const struct xt_mtchk_param *par)
+{
+	struct ipt_p2p_info *info = par->matchinfo;
+	int ret;
+
+	if (info->cache_mask != 0) {
+		unsigned int top = ipp2p_ct_top(info);
+
+		if (!IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)) {
+			pr_info("IPP2P.check: --cache-mask needs a kernel "
+			        "with CONFIG_NF_CONNTRACK_MARK\n");
+			return -EOPNOTSUPP;
+		}
+		/* contiguous, and room for the count plus two verdicts */
+		if ((top & (top + 1)) != 0 || info->cache_packets == 0 ||
+		    info->cache_packets >= top) {
+			pr_info("IPP2P.check: cache mask 0x%x cannot hold %u packets\n",
+			        info->cache_mask, info->cache_packets);
+			return -EINVAL;
+		}
+	}
+
+	info->matcher = ipp2p_matcher_build(info->cmd);
+	if (info->matcher == NULL)
+		return -ENOMEM;
+	if (info->cache_mask != 0) {
+		ret = nf_ct_netns_get(par->net, par->family);
+		if (ret < 0) {
+			kvfree(info->matcher);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void ipp2p_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	struct ipt_p2p_info *info = par->matchinfo;
+
+	if (info->cache_mask != 0)
+		nf_ct_netns_put(par->net, par->family);
+	kvfree(info->matcher);
 }
 
 static struct xt_match ipp2p_mt_reg[] __read_mostly = {
 	{
 		.name       = "ipp2p",
-		.revision   = 1,
+		.revision   = 2,
 		.family     = NFPROTO_IPV4,
+		.checkentry = ipp2p_mt_check,
 		.match      = ipp2p_mt,
+		.destroy    = ipp2p_mt_destroy,
 		.matchsize  = sizeof(struct ipt_p2p_info),
 		.me         = THIS_MODULE,
 	},
 	{
 		.name       = "ipp2p",
-		.revision   = 1,
+		.revision   = 2,
 		.family     = NFPROTO_IPV6,
+		.checkentry = ipp2p_mt_check,
 		.match      = ipp2p_mt,
+		.destroy    = ipp2p_mt_destroy,
 		.matchsize  = sizeof(struct ipt_p2p_info),
 		.me         = THIS_MODULE,
 	},
 };
 
+static int __net_init ipp2p_net_init(struct net *net)
+{
+	struct ipp2p_net *pn = ipp2p_pernet(net);
+	unsigned int cpu;
+
+	pn->stats = alloc_percpu(struct ipp2p_stats);
+	if (pn->stats == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(pn->stats, cpu)->syncp);
+	if (proc_create_data("xt_ipp2p", 0444, net->proc_net,
+	    &ipp2p_stats_fops, pn) == NULL) {
+		free_percpu(pn->stats);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void __net_exit ipp2p_net_exit(struct net *net)
+{
+	struct ipp2p_net *pn = ipp2p_pernet(net);
+
+	remove_proc_entry("xt_ipp2p", net->proc_net);
+	free_percpu(pn->stats);
+}
+
+static struct pernet_operations ipp2p_net_ops = {
+	.init   = ipp2p_net_init,
+	.exit   = ipp2p_net_exit,
+	.id     = &ipp2p_net_id,
+	.size   = sizeof(struct ipp2p_net),
+};
+
 static int __init ipp2p_mt_init(void)
 {
-	return xt_register_matches(ipp2p_mt_reg, ARRAY_SIZE(ipp2p_mt_reg));
+	int ret;
+
+	ipp2p_scratch = alloc_percpu(struct ipp2p_scratch);
+	if (ipp2p_scratch == NULL)
+		return -ENOMEM;
+	ret = register_pernet_subsys(&ipp2p_net_ops);
+	if (ret < 0)
+		goto out_scratch;
+	ret = xt_register_matches(ipp2p_mt_reg, ARRAY_SIZE(ipp2p_mt_reg));
+	if (ret < 0)
+		goto out_pernet;
+	return 0;
+
+ out_pernet:
+	unregister_pernet_subsys(&ipp2p_net_ops);
+ out_scratch:
+	free_percpu(ipp2p_scratch);
+	return ret;
 }
 
 static void __exit ipp2p_mt_exit(void)
 {
 	xt_unregister_matches(ipp2p_mt_reg, ARRAY_SIZE(ipp2p_mt_reg));
+	unregister_pernet_subsys(&ipp2p_net_ops);
+	free_percpu(ipp2p_scratch);
 }
 
 module_init(ipp2p_mt_init);
@@ -37,6 +37,17 @@ enum {
 	IPP2P_XDCC       = 1 << IPP2N_XDCC,
 };
 
+struct ipp2p_matcher;
+
+/*
+ * @cache_mask:		connmark bits that remember the verdict of a flow
+ * @cache_packets:	payload packets to inspect before giving up on a flow
+ * @max_bytes:		payload bytes of a packet to inspect at most (0: all)
+ */
 struct ipt_p2p_info {
 	int32_t cmd, debug;
+	uint32_t cache_mask, cache_packets, max_bytes;
+
+	/* Used internally by the kernel */
+	struct ipp2p_matcher *matcher __attribute__((aligned(8)));
 };